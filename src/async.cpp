@@ -0,0 +1,209 @@
+/* 
+ *  this file is part of wdfs --> http://noedler.de/projekte/wdfs/
+ *
+ *  wdfs is a webdav filesystem with special features for accessing subversion
+ *  repositories. it is based on fuse v2.5+ and neon v0.24.7+.
+ * 
+ *  copyright (c) 2005 - 2007 jens m. noedler, noedler@web.de
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *  This program is released under the GPL with the additional exemption
+ *  that compiling, linking and/or using OpenSSL is allowed.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <glib.h>
+#include <pthread.h>
+
+#include "wdfs-main.h"
+#include "async.h"
+
+/* the fuse callbacks block their thread until the webdav server answered.
+ * work that nobody waits for (prefetching, uploading, refreshing the cache,
+ * ...) is done by jobs of an async_pool instead. a pool runs a bounded number
+ * of worker threads that take the jobs from a queue. the requests of a job
+ * check a session out of the session pool, so the jobs of all pools share the
+ * connections of the session pool. a job holds no session while it waits for
+ * something else, which may need a session itself. when a job is finished, its
+ * completion callback is called in the worker thread.
+ * async_pool_wait() waits until all submitted jobs are finished. this is 
+ * needed for fsync() and unmount. */
+
+
+struct async_job {
+	async_work_fn work;
+	async_done_fn done;
+	void *data;
+};
+
+struct async_pool {
+	const char *name;
+	GThreadPool *threads;
+	pthread_mutex_t mutex;
+	pthread_cond_t idle;		/* signaled, if no job is left */
+	unsigned long pending;		/* jobs submitted and not yet finished */
+	unsigned long pending_max;	/* highest number of pending jobs */
+	unsigned long submitted;	/* jobs submitted in total */
+	unsigned long failed;		/* jobs that returned an error */
+};
+
+
+/* +++++++ local static methods +++++++ */
+
+
+/* called by the GThreadPool for each job. runs the job and its completion
+ * callback, then frees the job. */
+static void async_worker(void *job_data, void *pool_data)
+{
+	struct async_job *job = (struct async_job*)job_data;
+	struct async_pool *pool = (struct async_pool*)pool_data;
+
+	int ret = job->work(job->data);
+	if (job->done != NULL)
+		job->done(job->data, ret);
+	FREE(job);
+
+	pthread_mutex_lock(&pool->mutex);
+	if (ret != 0)
+		pool->failed++;
+	if (--pool->pending == 0)
+		pthread_cond_broadcast(&pool->idle);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+
+/* +++++++ exported non-static methods +++++++ */
+
+
+/* creates a pool that runs its jobs with up to threads worker threads. the
+ * name is used for debug output. returns the new pool or NULL on error. */
+struct async_pool* async_pool_new(const char *name, int threads)
+{
+	assert(name && threads > 0);
+
+#if !GLIB_CHECK_VERSION(2, 32, 0)
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+#endif
+
+	struct async_pool *pool = g_new0(struct async_pool, 1);
+	pool->name = name;
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->idle, NULL);
+
+	GError *error = NULL;
+	pool->threads = 
+		g_thread_pool_new(async_worker, pool, threads, FALSE, &error);
+	if (pool->threads == NULL) {
+		fprintf(stderr, "## error: could not create %s threads: %s\n",
+			name, error ? error->message : "unknown");
+		if (error != NULL)
+			g_error_free(error);
+		pthread_mutex_destroy(&pool->mutex);
+		pthread_cond_destroy(&pool->idle);
+		FREE(pool);
+		return NULL;
+	}
+
+	if (wdfs.debug == true)
+		fprintf(stderr, "** started %s with %d threads\n", name, threads);
+	return pool;
+}
+
+
+/* queues a job. the pool calls work(data) and then done(data, ret) in one of
+ * its worker threads. returns 0 on success or -1 on error. */
+int async_submit(
+	struct async_pool *pool, async_work_fn work, async_done_fn done, void *data)
+{
+	assert(pool && work);
+
+	struct async_job *job = g_new0(struct async_job, 1);
+	job->work = work;
+	job->done = done;
+	job->data = data;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->submitted++;
+	if (++pool->pending > pool->pending_max)
+		pool->pending_max = pool->pending;
+	pthread_mutex_unlock(&pool->mutex);
+
+	GError *error = NULL;
+	if (!g_thread_pool_push(pool->threads, job, &error)) {
+		fprintf(stderr, "## error: could not queue %s job: %s\n",
+			pool->name, error ? error->message : "unknown");
+		if (error != NULL)
+			g_error_free(error);
+		FREE(job);
+		pthread_mutex_lock(&pool->mutex);
+		if (--pool->pending == 0)
+			pthread_cond_broadcast(&pool->idle);
+		pthread_mutex_unlock(&pool->mutex);
+		return -1;
+	}
+	return 0;
+}
+
+
+/* waits until every job of the pool is finished, including jobs that are
+ * submitted by other jobs while waiting. */
+void async_pool_wait(struct async_pool *pool)
+{
+	if (pool == NULL)
+		return;
+
+	pthread_mutex_lock(&pool->mutex);
+	while (pool->pending > 0)
+		pthread_cond_wait(&pool->idle, &pool->mutex);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+
+/* waits for all jobs, stops the worker threads and frees the pool. */
+void async_pool_free(struct async_pool *pool)
+{
+	if (pool == NULL)
+		return;
+
+	async_pool_wait(pool);
+	g_thread_pool_free(pool->threads, FALSE, TRUE);
+
+	if (wdfs.debug == true)
+		fprintf(stderr, "** stopped %s\n", pool->name);
+
+	pthread_mutex_destroy(&pool->mutex);
+	pthread_cond_destroy(&pool->idle);
+	FREE(pool);
+}
+
+
+/* prints the statistics of the pool. */
+void async_print_stats(struct async_pool *pool, FILE *stream)
+{
+	if (pool == NULL)
+		return;
+
+	pthread_mutex_lock(&pool->mutex);
+	fprintf(stream, "%s: %lu jobs (%lu failed), %lu pending, %lu pending max\n",
+		pool->name, pool->submitted, pool->failed, 
+		pool->pending, pool->pending_max);
+	pthread_mutex_unlock(&pool->mutex);
+}
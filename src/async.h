@@ -0,0 +1,18 @@
+#ifndef ASYNC_H_
+#define ASYNC_H_
+
+/* a job does the work and returns 0 on success or a negative error code. */
+typedef int (*async_work_fn)(void *data);
+/* called after the job with the job's return value. may be NULL. */
+typedef void (*async_done_fn)(void *data, int ret);
+
+struct async_pool;
+
+struct async_pool* async_pool_new(const char *name, int threads);
+int async_submit(
+	struct async_pool *pool, async_work_fn work, async_done_fn done, void *data);
+void async_pool_wait(struct async_pool *pool);
+void async_pool_free(struct async_pool *pool);
+void async_print_stats(struct async_pool *pool, FILE *stream);
+
+#endif /*ASYNC_H_*/
@@ -0,0 +1,180 @@
+/*
+ *  this file is part of wdfs --> http://noedler.de/projekte/wdfs/
+ *
+ *  wdfs is a webdav filesystem with special features for accessing subversion
+ *  repositories. it is based on fuse v2.5+ and neon v0.24.7+.
+ *
+ *  copyright (c) 2005 - 2007 jens m. noedler, noedler@web.de
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *  This program is released under the GPL with the additional exemption
+ *  that compiling, linking and/or using OpenSSL is allowed.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <glib.h>
+
+#include "wdfs-main.h"
+#include "async.h"
+#include "cache.h"
+#include "snapshot.h"
+
+/* a microbenchmark of the attribute cache. it's only built with the cmake
+ * option WDFS_BENCH. the cache is filled with ITEMS items, then 1, 2, 4, ...
+ * threads call cache_get_item() and every 10th time cache_add_item() for
+ * random files. the throughput of all threads is printed for each number of
+ * threads. if the cache scales, it grows with the number of threads up to
+ * the number of cpus. with a single cpu the threads only take turns, so the
+ * numbers tell nothing about the scaling then.
+ * usage: cache-bench [max_threads [items [operations per thread]]]
+ * the cache is linked without the rest of wdfs, so the few functions of wdfs
+ * it uses are replaced below. */
+
+static int items = 100000;
+static int operations = 1000000;
+static char **keys = NULL;
+
+
+/* +++++++ replacements of wdfs +++++++ */
+
+
+struct wdfs_conf wdfs;
+struct async_pool *background_jobs = NULL;
+
+/* the keys of the benchmark are unified already */
+char* unify_path(const char *in, int mode)
+{
+	return strdup(in);
+}
+
+int async_submit(
+	struct async_pool *pool, async_work_fn work, async_done_fn done, void *data)
+{
+	return -1;
+}
+
+void snapshot_forget(const char *key)
+{
+}
+
+int refresh_attributes(const char *remotepath)
+{
+	return -1;
+}
+
+
+/* +++++++ local static methods +++++++ */
+
+
+static void* bench_thread(void *data)
+{
+	unsigned int seed = GPOINTER_TO_UINT(data);
+	struct stat stat;
+	memset(&stat, 0, sizeof(stat));
+	stat.st_mode = S_IFREG | 0644;
+
+	int i;
+	for (i = 0; i < operations; i++) {
+		const char *key = keys[rand_r(&seed) % items];
+		if (i % 10 == 0) {
+			stat.st_size = i;
+			cache_add_item(&stat, key);
+		} else {
+			cache_get_item(&stat, key);
+		}
+	}
+	return NULL;
+}
+
+
+/* runs the benchmark with the number of threads and returns the operations
+ * per second. */
+static double bench_run(int threads)
+{
+	pthread_t *ids = g_new0(pthread_t, threads);
+	gint64 start = g_get_monotonic_time();
+
+	int i;
+	for (i = 0; i < threads; i++)
+		pthread_create(&ids[i], NULL, bench_thread, GUINT_TO_POINTER(i + 1));
+	for (i = 0; i < threads; i++)
+		pthread_join(ids[i], NULL);
+
+	gint64 elapsed = g_get_monotonic_time() - start;
+	g_free(ids);
+	return (double)threads * operations * 1000000 / (elapsed ? elapsed : 1);
+}
+
+
+int main(int argc, char *argv[])
+{
+	int max_threads = (argc > 1) ? atoi(argv[1]) : 8;
+	if (argc > 2)
+		items = atoi(argv[2]);
+	if (argc > 3)
+		operations = atoi(argv[3]);
+	if (max_threads < 1 || items < 1 || operations < 1) {
+		fprintf(stderr, "usage: %s [max_threads [items [operations]]]\n",
+			argv[0]);
+		return 1;
+	}
+
+	/* the defaults of wdfs, the items must not time out meanwhile */
+	memset(&wdfs, 0, sizeof(wdfs));
+	wdfs.debug = false;
+	wdfs.cache_ttl_min = 3600;
+	wdfs.cache_ttl_max = 3600;
+	wdfs.cache_memory = 64;
+	wdfs.negative_timeout = 5;
+	wdfs.stale_grace = 0;
+	wdfs.stale_max = 60;
+
+	cache_initialize();
+
+	struct stat stat;
+	memset(&stat, 0, sizeof(stat));
+	stat.st_mode = S_IFREG | 0644;
+	keys = g_new0(char*, items);
+	int i;
+	for (i = 0; i < items; i++) {
+		keys[i] = g_strdup_printf("/bench/dir%d/file%d", i % 100, i);
+		cache_add_item(&stat, keys[i]);
+	}
+
+	printf("%d items, %d operations per thread, 10%% cache_add_item(), "
+		"%ld cpus\n", items, operations, sysconf(_SC_NPROCESSORS_ONLN));
+	double single = 0;
+	int threads;
+	for (threads = 1; threads <= max_threads; threads *= 2) {
+		double rate = bench_run(threads);
+		if (threads == 1)
+			single = rate;
+		printf("%3d threads: %12.0f operations/s, %5.2f x 1 thread\n",
+			threads, rate, rate / single);
+	}
+
+	cache_destroy();
+	for (i = 0; i < items; i++)
+		g_free(keys[i]);
+	g_free(keys);
+	return 0;
+}
@@ -27,6 +27,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <assert.h>
 #include <glib.h>
 #include <pthread.h>
@@ -34,41 +35,140 @@
 
 #include "wdfs-main.h"
 #include "cache.h"
+#include "async.h"
+#include "snapshot.h"
 
 /* this cache is designed to buffer the file's attributes (struct stat) locally
  * instead of sending a new request to the webdav server. this leads into a
  * better responsiveness of the filesystem.
- * every file's attributes is stored in a 'struct cache_item' that contains a
- * 'struct stat' and a 'time_t timeout' field. the timeout field is used to 
- * purge the cache_item, if it is too old. how long a cache_item is stored is
- * configured at CACHE_ITEM_TIMEOUT (in seconds).
- * the cache_items are stored in a hash as a hash value and the corresponding
- * remotepath (uri) as the hash key. because the remotepath (uri) is unique,
- * a hash is a appropriate data structure and accessing it is fast.
- * a 2nd thread runs every CACHE_ITEM_TIMEOUT seconds in the background and
- * removed timed out cache_items. 
+ * every file's attributes is stored in a 'struct cache_item' that contains the
+ * used fields of a 'struct stat' and a 'time_t timeout' field. the timeout 
+ * field is used to purge the cache_item, if it is too old. how long a 
+ * cache_item is stored is configured by "-o cache_ttl_min" (in seconds).
+ * the cache_items are stored in a hash table with the remotepath (uri) as the
+ * key. because fuse runs multi-threaded, the table is split into shards by 
+ * the key's hash. each shard has its own lock, so threads that access 
+ * different shards don't block each other, and lookups only need the shard's
+ * read lock. lookups are not lock-free, each of them takes and releases the
+ * read lock of its shard. a shard is an open addressing table with linear
+ * probing, the items are stored inline in its slots.
+ * a 2nd thread runs every second in the background and removes the timed
+ * out cache_items. to find them without scanning the whole cache, each shard
+ * has a timer wheel: a ring of CACHE_WHEEL_SLOTS buckets, one per second. 
+ * when an item is added, a timer with its hash and timeout is appended to 
+ * the bucket of the timeout's second. the control thread only looks at the
+ * items of the buckets, that are due. a refreshed item keeps its timer, that
+ * is set again for the new timeout when it's due. timers of deleted items are
+ * not removed from the wheel, they just find no timed out item.
+ * a negative item remembers, that a file does not exist. it's added, if the
+ * server answered "404 Not Found" or the file was deleted, and lives for 
+ * "-o negative_timeout" seconds. creating the file or a file in a directory
+ * removes the negative items of the file and of the directory.
+ * the memory of the cache is limited by "-o cache_memory". if a shard would
+ * exceed its part of the limit, items are evicted by the clock algorithm: a
+ * hand sweeps over the slots and removes the first item that was not used
+ * since the last sweep. items that are only added once, e.g. by a "find" over
+ * a big tree, are evicted before the items that are looked up again.
+ * with "-o stale_grace" a timed out item is kept for the grace period. 
+ * getattr() gets its attributes at once, if nothing newer is known, and a 
+ * background job asks the server for the current attributes. an item is not
+ * served longer than "-o stale_max" seconds after it was fetched.
+ * if "-o cache_ttl_max" is bigger than "-o cache_ttl_min", each item has its
+ * own lifetime. it starts at the minimum and is doubled up to the maximum 
+ * each time the server sends unchanged attributes again. if the attributes
+ * were changed, it's set back to the minimum. so the items of stable trees
+ * are kept long and changing files are asked for often. to notice unchanged
+ * attributes, a timed out item is kept for another lifetime. a "Cache-Control:
+ * max-age" of the server's answer overrides the lifetime (up to the maximum).
  */
 
 
-/* lifetime of a cache item in seconds. this value can be edit here. */
-const size_t cache_item_lifetime = 20;
+/* number of shards, must be a power of 2 */
+#define CACHE_SHARD_BITS	4
+#define CACHE_SHARDS		(1 << CACHE_SHARD_BITS)
 
-/* initalize this mutex, which is used to prevent data 
- * inconsistencies due to race conditions. */
-pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* initial number of slots of a shard, must be a power of 2 */
+#define CACHE_SHARD_SLOTS	64
+
+/* number of one second buckets of a timer wheel. timers, that are due in a
+ * later round of the wheel, stay in their bucket. */
+#define CACHE_WHEEL_SLOTS	64
+
+/* the control thread removes at most this number of timers at once, before
+ * it unlocks the shard for other threads. */
+#define CACHE_EXPIRE_BATCH	256
 
 /* every created thread needs an id. this is the cache control thread's id. */
 pthread_t cache_control_thread_id;
 
-/* hash object to store the cache items */
-static GHashTable *cache;
+/* set by cache_destroy() to stop the control thread, which waits for the 
+ * cache_control_cond with a timeout of a second. */
+static bool_t cache_control_stop = false;
+static pthread_mutex_t cache_control_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_control_cond = PTHREAD_COND_INITIALIZER;
 
 
+/* the fields of a 'struct stat', that are set by wdfs. st_blocks is 
+ * calculated from the size. */
 struct cache_item {
-	struct stat stat;	/* 96 bytes (i386) */
-	time_t timeout;		/*  4 bytes (i386) */
+	off_t size;
+	time_t atime;
+	time_t mtime;
+	time_t ctime;
+	time_t timeout;
+	mode_t mode;
+	guint32 nlink;
+	uid_t uid;
+	gid_t gid;
+};
+
+/* a slot of a shard. the slot is empty, if key is NULL. */
+struct cache_slot {
+	guint64 hash;		/* hash of the key */
+	char *key;			/* unified remotepath */
+	struct cache_item item;
+	time_t armed;		/* timeout of the item's timer in the wheel */
+	bool_t referenced;	/* used since the last sweep of the clock hand */
+	bool_t negative;	/* the file does not exist, item has no data */
+	time_t validated;	/* the data was fetched from the server at this time */
+	guint32 lifetime;	/* adaptive lifetime of a positive item in seconds */
+	bool_t refreshing;	/* a background job fetches the item's data */
 };
 
+/* an entry of a timer wheel's bucket */
+struct cache_timer {
+	guint64 hash;		/* hash of the item's key */
+	time_t timeout;		/* timeout of the item, when the timer was set */
+};
+
+/* a part of the cache. aligned to avoid false sharing between the shards. */
+struct cache_shard {
+	pthread_rwlock_t lock;
+	struct cache_slot *slots;
+	size_t capacity;	/* number of slots, a power of 2 */
+	size_t used;		/* number of slots, that are not empty */
+	size_t key_bytes;	/* memory used by the keys */
+	size_t timers;		/* number of timers in the wheel */
+	size_t hand;		/* slot of the clock hand */
+	unsigned long evicted;	/* number of items removed by the memory limit */
+	GArray *wheel[CACHE_WHEEL_SLOTS];	/* buckets of struct cache_timer */
+	time_t wheel_time;	/* the buckets up to this second are expired */
+	unsigned long expired;	/* number of timed out items removed */
+	unsigned long hits;		/* updated atomically, the read lock is shared */
+	unsigned long misses;
+	unsigned long negative_hits;
+	unsigned long stale_hits;
+	unsigned long refreshed;
+	unsigned long refresh_failed;
+	unsigned long unchanged;	/* items fetched again without changes */
+	unsigned long changed;
+} __attribute__((aligned(64)));
+
+static struct cache_shard cache[CACHE_SHARDS];
+
+/* memory limit of a shard in bytes */
+static size_t cache_shard_budget;
+
 
 /* +++++++ local static methods +++++++ */
 /* author jens, 31.07.2005 18:44:28, location: heli at heinemanns */
@@ -84,80 +184,500 @@ static int cache_item_timed_out(const int timeout)
 }
 
 
-/* callback method for g_hash_table_foreach_remove() called in cache_control_
- * thread(). this method check if a cache item has reached it's timeout and 
- * then removes it from the cache.  */
-static int cache_control_thread_callback(void *key, void *value, void *userdata)
+/* returns the time, until the positive item of the slot may be served stale
+ * after its timeout. */
+static time_t cache_slot_stale_until(const struct cache_slot *slot)
+{
+	if (slot->negative == true || wdfs.stale_grace == 0)
+		return slot->item.timeout;
+
+	time_t expiry = slot->item.timeout + wdfs.stale_grace;
+	if (expiry > slot->validated + wdfs.stale_max)
+		expiry = slot->validated + wdfs.stale_max;
+	return (expiry > slot->item.timeout) ? expiry : slot->item.timeout;
+}
+
+
+/* returns the time, when the item of the slot is removed from the cache. 
+ * with adaptive lifetimes, a positive item is kept for another lifetime
+ * after its timeout. */
+static time_t cache_slot_expiry(const struct cache_slot *slot)
+{
+	time_t expiry = cache_slot_stale_until(slot);
+	if (slot->negative == false && wdfs.cache_ttl_max > wdfs.cache_ttl_min &&
+			expiry < slot->item.timeout + (time_t)slot->lifetime)
+		expiry = slot->item.timeout + slot->lifetime;
+	return expiry;
+}
+
+
+/* stores the attributes of stat in the item. */
+static void cache_item_set(struct cache_item *item, const struct stat *stat)
+{
+	item->size = stat->st_size;
+	item->atime = stat->st_atime;
+	item->mtime = stat->st_mtime;
+	item->ctime = stat->st_ctime;
+	item->mode = stat->st_mode;
+	item->nlink = stat->st_nlink;
+	item->uid = stat->st_uid;
+	item->gid = stat->st_gid;
+}
+
+
+/* restores the attributes of the item to stat. */
+static void cache_item_get(const struct cache_item *item, struct stat *stat)
+{
+	memset(stat, 0, sizeof(struct stat));
+	stat->st_size = item->size;
+	stat->st_atime = item->atime;
+	stat->st_mtime = item->mtime;
+	stat->st_ctime = item->ctime;
+	stat->st_mode = item->mode;
+	stat->st_nlink = item->nlink;
+	stat->st_uid = item->uid;
+	stat->st_gid = item->gid;
+	/* calculate number of 512 byte blocks */
+	stat->st_blocks = (stat->st_size + 511) / 512;
+}
+
+
+/* 64 bit fnv-1a hash of the key. the low bits select the shard, the other 
+ * bits the slot. */
+static guint64 cache_hash(const char *key)
+{
+	guint64 hash = G_GUINT64_CONSTANT(14695981039346656037);
+	for (; *key != '\0'; key++) {
+		hash ^= (unsigned char)*key;
+		hash *= G_GUINT64_CONSTANT(1099511628211);
+	}
+	return hash;
+}
+
+
+static struct cache_shard* cache_shard_of(guint64 hash)
+{
+	return &cache[hash & (CACHE_SHARDS - 1)];
+}
+
+
+/* returns the slot of the key or the empty slot, where it would be inserted.
+ * the shard's lock must be held. */
+static struct cache_slot* cache_shard_find(
+	struct cache_shard *shard, guint64 hash, const char *key)
+{
+	size_t mask = shard->capacity - 1;
+	size_t index = (hash >> CACHE_SHARD_BITS) & mask;
+	while (shard->slots[index].key != NULL) {
+		struct cache_slot *slot = &shard->slots[index];
+		if (slot->hash == hash && !strcmp(slot->key, key))
+			return slot;
+		index = (index + 1) & mask;
+	}
+	return &shard->slots[index];
+}
+
+
+/* doubles the number of slots of the shard. the write lock must be held. */
+static void cache_shard_grow(struct cache_shard *shard)
+{
+	struct cache_slot *old_slots = shard->slots;
+	size_t old_capacity = shard->capacity;
+
+	shard->capacity *= 2;
+	shard->slots = g_new0(struct cache_slot, shard->capacity);
+
+	size_t index;
+	for (index = 0; index < old_capacity; index++) {
+		if (old_slots[index].key == NULL)
+			continue;
+		*cache_shard_find(shard, old_slots[index].hash, old_slots[index].key)
+			= old_slots[index];
+	}
+	g_free(old_slots);
+}
+
+
+/* empties the slot at index and moves the following slots of the probe 
+ * sequence backwards, so that no tombstones are needed. the write lock must
+ * be held. */
+static void cache_shard_remove(struct cache_shard *shard, size_t index)
 {
-	struct cache_item *item = (struct cache_item *)value;
-	if (cache_item_timed_out(item->timeout)) {
-		if (wdfs.debug == true) {
-			fprintf(stderr,
-				"** cache control thread: "
-				"item has timed out and is removed '%s'\n", (char*)key);
+	size_t mask = shard->capacity - 1;
+	shard->key_bytes -= strlen(shard->slots[index].key) + 1;
+	FREE(shard->slots[index].key);
+	shard->used--;
+
+	size_t hole = index;
+	size_t next = (index + 1) & mask;
+	while (shard->slots[next].key != NULL) {
+		size_t home = (shard->slots[next].hash >> CACHE_SHARD_BITS) & mask;
+		/* the slot may fill the hole, if its home is not between the hole
+		 * and the slot (cyclically) */
+		if (((next - home) & mask) >= ((next - hole) & mask)) {
+			shard->slots[hole] = shard->slots[next];
+			shard->slots[next].key = NULL;
+			hole = next;
 		}
-		/* remove this item */
-		return 1;
+		next = (next + 1) & mask;
 	}
-	/* don't remove this item */
-	return 0;
+}
+
+
+/* returns the memory used by the shard in bytes. */
+static size_t cache_shard_bytes(struct cache_shard *shard)
+{
+	return shard->capacity * sizeof(struct cache_slot) + shard->key_bytes +
+		shard->timers * sizeof(struct cache_timer);
+}
+
+
+/* returns the memory of the shard's items in bytes, a slot, a timer and the
+ * key for each item. the limit is checked against it and not against all
+ * memory of the shard, because the slots are never shrunk and the timers of
+ * deleted items stay in the wheel until they are due. so evicting an item
+ * always brings the shard nearer to the limit. */
+static size_t cache_shard_item_bytes(struct cache_shard *shard)
+{
+	return shard->used * (sizeof(struct cache_slot) +
+		sizeof(struct cache_timer)) + shard->key_bytes;
+}
+
+
+/* removes the item at the clock hand, that was not used since the last 
+ * sweep. returns true if an item was evicted. the write lock must be held. */
+static bool_t cache_shard_evict(struct cache_shard *shard)
+{
+	size_t mask = shard->capacity - 1;
+	size_t steps;
+	/* after one sweep no item is referenced any more */
+	for (steps = 0; steps < 2 * shard->capacity && shard->used > 0; steps++) {
+		struct cache_slot *slot = &shard->slots[shard->hand];
+		if (slot->key != NULL && slot->referenced == false) {
+			if (wdfs.debug == true)
+				fprintf(stderr, "** evicted cache item '%s'\n", slot->key);
+			/* the hand stays, the next item may be moved to this slot */
+			cache_shard_remove(shard, shard->hand);
+			shard->evicted++;
+			return true;
+		}
+		slot->referenced = false;
+		shard->hand = (shard->hand + 1) & mask;
+	}
+	return false;
+}
+
+
+/* appends a timer for the item of the slot to the wheel. the write lock must
+ * be held. */
+static void cache_shard_set_timer(
+	struct cache_shard *shard, struct cache_slot *slot)
+{
+	struct cache_timer timer;
+	timer.hash = slot->hash;
+	timer.timeout = cache_slot_expiry(slot);
+	g_array_append_val(
+		shard->wheel[timer.timeout % CACHE_WHEEL_SLOTS], timer);
+	shard->timers++;
+	slot->armed = timer.timeout;
+}
+
+
+/* removes the expired items with the timer's hash. the item of a timer 
+ * may have been deleted or refreshed meanwhile, or there may be other items
+ * with the same hash, so all slots of the probe sequence are checked. a 
+ * refreshed item gets a new timer. the write lock must be held. */
+static void cache_shard_expire(
+	struct cache_shard *shard, const struct cache_timer *timer, time_t now)
+{
+	size_t mask = shard->capacity - 1;
+	size_t index = (timer->hash >> CACHE_SHARD_BITS) & mask;
+	while (shard->slots[index].key != NULL) {
+		struct cache_slot *slot = &shard->slots[index];
+		if (slot->hash == timer->hash && cache_slot_expiry(slot) <= now) {
+			if (wdfs.debug == true) {
+				fprintf(stderr,
+					"** cache control thread: "
+					"item has timed out and is removed '%s'\n", slot->key);
+			}
+			/* the next item may be moved to this slot, check it again */
+			cache_shard_remove(shard, index);
+			shard->expired++;
+			continue;
+		}
+		if (slot->hash == timer->hash && slot->armed == timer->timeout)
+			cache_shard_set_timer(shard, slot);
+		index = (index + 1) & mask;
+	}
+}
+
+
+/* expires the buckets of the shard, that are due. the shard is locked for at
+ * most CACHE_EXPIRE_BATCH timers at once, so lookups are not blocked long. */
+static void cache_shard_advance(struct cache_shard *shard, time_t now)
+{
+	pthread_rwlock_wrlock(&shard->lock);
+	/* a whole round of the wheel is due after a long pause */
+	if (now - shard->wheel_time > CACHE_WHEEL_SLOTS)
+		shard->wheel_time = now - CACHE_WHEEL_SLOTS;
+
+	while (shard->wheel_time < now) {
+		shard->wheel_time++;
+		GArray **bucket = &shard->wheel[shard->wheel_time % CACHE_WHEEL_SLOTS];
+		if ((*bucket)->len == 0)
+			continue;
+
+		/* take the bucket's timers, new timers go to an empty bucket */
+		GArray *timers = *bucket;
+		*bucket = g_array_new(FALSE, FALSE, sizeof(struct cache_timer));
+		shard->timers -= timers->len;
+
+		guint i;
+		for (i = 0; i < timers->len; i++) {
+			struct cache_timer *timer = 
+				&g_array_index(timers, struct cache_timer, i);
+			/* the item is due in a later round of the wheel */
+			if (timer->timeout > now) {
+				g_array_append_val(*bucket, *timer);
+				shard->timers++;
+			} else
+				cache_shard_expire(shard, timer, now);
+
+			/* let the waiting threads use the shard */
+			if ((i + 1) % CACHE_EXPIRE_BATCH == 0) {
+				pthread_rwlock_unlock(&shard->lock);
+				pthread_rwlock_wrlock(&shard->lock);
+				bucket = &shard->wheel[shard->wheel_time % CACHE_WHEEL_SLOTS];
+			}
+		}
+		g_array_free(timers, TRUE);
+	}
+	pthread_rwlock_unlock(&shard->lock);
 }
 
 
 /* +++++++ exported non-static methods +++++++ */
 
 
-/* this thread runs until it is canceled by the main thread and
- * removes every CACHE_ITEM_TIMEOUT seconds timed out cache items. */
+/* this thread runs until it is stopped by cache_destroy() and removes the 
+ * timed out cache items every second. */
 static void* cache_control_thread(void *unused)
 {
-	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-	/* thread exits if a cancel signal is recieved and
-	 * cansel state is PTHREAD_CANCEL_ENABLE */
-	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
-	while (1) {
-		sleep(cache_item_lifetime);
-		/* do not allow cancling this thread while doing it's work */
-		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-		/* to avoid conflict with cache_delete_item() lock */
-		pthread_mutex_lock(&cache_mutex);
-		/* check each cache item, if it is timed out and remove it */
-		g_hash_table_foreach_remove(cache, &cache_control_thread_callback, NULL);
-		pthread_mutex_unlock(&cache_mutex);
-		/* now this thread might be cancel, because it is idle */
-		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	pthread_mutex_lock(&cache_control_mutex);
+	while (cache_control_stop == false) {
+		struct timespec wakeup;
+		wakeup.tv_sec = time(NULL) + 1;
+		wakeup.tv_nsec = 0;
+		pthread_cond_timedwait(
+			&cache_control_cond, &cache_control_mutex, &wakeup);
+		if (cache_control_stop == true)
+			break;
+		pthread_mutex_unlock(&cache_control_mutex);
+
+		/* the shards are locked one after another */
+		time_t now = time(NULL);
+		int i;
+		for (i = 0; i < CACHE_SHARDS; i++)
+			cache_shard_advance(&cache[i], now);
+
+		pthread_mutex_lock(&cache_control_mutex);
 	}
+	pthread_mutex_unlock(&cache_control_mutex);
 	return NULL;
 }
 
 
-/* initializes the cache's hash table and start a 2nd thread, that removed 
+/* initializes the cache's shards and start a 2nd thread, that removed 
  * timed out item from the cache periodically. */
 void cache_initialize()
 {
-	cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
-	assert(cache);
+	cache_shard_budget = (size_t)wdfs.cache_memory * 1024 * 1024 / CACHE_SHARDS;
+
+	int i;
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		pthread_rwlock_init(&cache[i].lock, NULL);
+		cache[i].capacity = CACHE_SHARD_SLOTS;
+		cache[i].slots = g_new0(struct cache_slot, CACHE_SHARD_SLOTS);
+		cache[i].used = 0;
+		cache[i].key_bytes = 0;
+		cache[i].timers = 0;
+		cache[i].hand = 0;
+		cache[i].evicted = 0;
+		int bucket;
+		for (bucket = 0; bucket < CACHE_WHEEL_SLOTS; bucket++)
+			cache[i].wheel[bucket] = 
+				g_array_new(FALSE, FALSE, sizeof(struct cache_timer));
+		cache[i].wheel_time = time(NULL);
+		cache[i].expired = 0;
+		cache[i].hits = 0;
+		cache[i].negative_hits = 0;
+		cache[i].misses = 0;
+		cache[i].stale_hits = 0;
+		cache[i].refreshed = 0;
+		cache[i].refresh_failed = 0;
+		cache[i].unchanged = 0;
+		cache[i].changed = 0;
+	}
 
 	/* setup a thread, that removes timed out cache items in the background */
 	pthread_create(&cache_control_thread_id, NULL, &cache_control_thread, NULL);
 }
 
 
-/* detroys the cache if it's no longer needed. joins the 2nd thread and kills
- * the hash table. */
+/* detroys the cache if it's no longer needed. joins the 2nd thread and frees
+ * the shards. */
 void cache_destroy()
 {
-	if (wdfs.debug == true)
-		fprintf(stderr,
-			"** destroying %d cache items\n", g_hash_table_size(cache));
 	/* exit cache control thread */
-	pthread_cancel(cache_control_thread_id);
+	pthread_mutex_lock(&cache_control_mutex);
+	cache_control_stop = true;
+	pthread_cond_signal(&cache_control_cond);
+	pthread_mutex_unlock(&cache_control_mutex);
 	pthread_join(cache_control_thread_id, NULL);
 
-	/* to avoid conflict with cache_control_thread() lock */
-	pthread_mutex_lock(&cache_mutex);
-	g_hash_table_destroy(cache);
-	pthread_mutex_unlock(&cache_mutex);
+	size_t items = 0;
+	int i;
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		struct cache_shard *shard = &cache[i];
+		pthread_rwlock_wrlock(&shard->lock);
+		items += shard->used;
+		size_t index;
+		for (index = 0; index < shard->capacity; index++)
+			FREE(shard->slots[index].key);
+		g_free(shard->slots);
+		shard->slots = NULL;
+		int bucket;
+		for (bucket = 0; bucket < CACHE_WHEEL_SLOTS; bucket++)
+			g_array_free(shard->wheel[bucket], TRUE);
+		shard->capacity = 0;
+		shard->used = 0;
+		pthread_rwlock_unlock(&shard->lock);
+		pthread_rwlock_destroy(&shard->lock);
+	}
+
+	if (wdfs.debug == true)
+		fprintf(stderr, "** destroyed %lu cache items\n", (unsigned long)items);
+}
+
+
+/* sets the data of the slot's item, that is used for lifetime seconds. if 
+ * stat is NULL, the item is negative. if lifetime is negative, the adaptive
+ * lifetime of the item is used. is_new is true for a new item. the write 
+ * lock must be held.
+ * the adaptive lifetime is only doubled, if the item was unchanged for its
+ * whole lifetime. the items added again by each listing of the directory 
+ * before they timed out don't count. */
+static void cache_slot_update(struct cache_shard *shard, 
+	struct cache_slot *slot, const struct stat *stat, time_t lifetime, 
+	bool_t is_new)
+{
+	time_t now = time(NULL);
+
+	if (stat != NULL) {
+		if (is_new == true || slot->negative == true) {
+			slot->lifetime = wdfs.cache_ttl_min;
+		} else if (slot->item.size == stat->st_size &&
+				slot->item.mtime == stat->st_mtime &&
+				slot->item.mode == stat->st_mode) {
+			if (now >= slot->item.timeout) {
+				slot->lifetime *= 2;
+				if (slot->lifetime > (guint32)wdfs.cache_ttl_max)
+					slot->lifetime = wdfs.cache_ttl_max;
+			}
+			shard->unchanged++;
+		} else {
+			slot->lifetime = wdfs.cache_ttl_min;
+			shard->changed++;
+		}
+		if (lifetime < 0)
+			lifetime = slot->lifetime;
+		cache_item_set(&slot->item, stat);
+	}
+
+	slot->validated = now;
+	slot->item.timeout = slot->validated + lifetime;
+	slot->negative = (stat == NULL) ? true : false;
+}
+
+
+/* adds the item of the unified remotepath2 to the cache or updates it. 
+ * the key remotepath2 is taken by the cache or freed. if stat is NULL, a 
+ * negative item is added, that tells the file does not exist. a negative
+ * lifetime selects the item's adaptive lifetime. */
+static void cache_insert(
+	char *remotepath2, const struct stat *stat, time_t lifetime)
+{
+	guint64 hash = cache_hash(remotepath2);
+	struct cache_shard *shard = cache_shard_of(hash);
+
+	/* the cache knows newer data than the snapshot */
+	snapshot_forget(remotepath2);
+
+	pthread_rwlock_wrlock(&shard->lock);
+	struct cache_slot *slot = cache_shard_find(shard, hash, remotepath2);
+	if (slot->key == NULL) {
+		/* make room for the new item within the memory limit */
+		size_t key_bytes = strlen(remotepath2) + 1;
+		size_t item_bytes = sizeof(struct cache_slot) +
+			sizeof(struct cache_timer) + key_bytes;
+		while (shard->used > 0 && cache_shard_item_bytes(shard) +
+				item_bytes > cache_shard_budget) {
+			if (cache_shard_evict(shard) == false)
+				break;
+		}
+
+		/* keep the load factor below 3/4, the doubled slots must fit into
+		 * the limit too */
+		while ((shard->used + 1) * 4 > shard->capacity * 3) {
+			if (shard->capacity * 2 * sizeof(struct cache_slot) <=
+					cache_shard_budget)
+				cache_shard_grow(shard);
+			else if (cache_shard_evict(shard) == false)
+				break;
+		}
+
+		/* the slots may have moved */
+		slot = cache_shard_find(shard, hash, remotepath2);
+		slot->hash = hash;
+		slot->key = remotepath2;
+		slot->referenced = false;
+		slot->refreshing = false;
+		shard->key_bytes += key_bytes;
+		shard->used++;
+		remotepath2 = NULL;
+		cache_slot_update(shard, slot, stat, lifetime, true);
+		cache_shard_set_timer(shard, slot);
+	} else {
+		/* the timer sets itself again for a later expiry */
+		cache_slot_update(shard, slot, stat, lifetime, false);
+		if (cache_slot_expiry(slot) < slot->armed)
+			cache_shard_set_timer(shard, slot);
+		slot->referenced = true;
+	}
+
+	if (wdfs.debug == true)
+		fprintf(stderr, "** added %scache item for '%s'\n", 
+			slot->negative == true ? "negative " : "", slot->key);
+	pthread_rwlock_unlock(&shard->lock);
+	FREE(remotepath2);
+}
+
+
+/* removes the item of the unified remotepath2, if it's negative. */
+static void cache_remove_negative(const char *remotepath2)
+{
+	guint64 hash = cache_hash(remotepath2);
+	struct cache_shard *shard = cache_shard_of(hash);
+
+	pthread_rwlock_wrlock(&shard->lock);
+	struct cache_slot *slot = cache_shard_find(shard, hash, remotepath2);
+	if (slot->key != NULL && slot->negative == true) {
+		cache_shard_remove(shard, slot - shard->slots);
+		if (wdfs.debug == true)
+			fprintf(stderr, "** removed negative cache item for '%s'\n",
+				remotepath2);
+	}
+	pthread_rwlock_unlock(&shard->lock);
 }
 
 
@@ -172,18 +692,66 @@ void cache_add_item(struct stat *stat, const char *remotepath)
 		return;
 	}
 
-	/* get the new cache item and set it's values */
-	struct cache_item *item = g_new0(struct cache_item, 1);
-	item->stat = *stat;
-	item->timeout = time(NULL) + cache_item_lifetime;
+	cache_insert(remotepath2, stat, -1);
+}
 
-	/* to avoid conflict with cache_control_thread() lock */
-	pthread_mutex_lock(&cache_mutex);
-	g_hash_table_insert(cache, strdup(remotepath2), item);
-	pthread_mutex_unlock(&cache_mutex);
 
-	if (wdfs.debug == true)
-		fprintf(stderr, "** added cache item for '%s'\n", remotepath2);
+/* adds a new item to the cache, that is used for max_age seconds as told by
+ * the server. if max_age is negative, it's ignored. */
+void cache_add_item_max_age(
+	struct stat *stat, const char *remotepath, int max_age)
+{
+	assert(remotepath && stat);
+
+	char *remotepath2 = unify_path(remotepath, UNESCAPE);
+	if (remotepath2 == NULL) {
+		fprintf(stderr, "## fatal error: unify_path() returned NULL\n");
+		return;
+	}
+
+	if (max_age > wdfs.cache_ttl_max)
+		max_age = wdfs.cache_ttl_max;
+	cache_insert(remotepath2, stat, max_age);
+}
+
+
+/* remembers, that the file does not exist, for "-o negative_timeout" seconds.
+ * getattr() answers with -ENOENT meanwhile without asking the server. */
+void cache_add_negative(const char *remotepath)
+{
+	assert(remotepath);
+
+	if (wdfs.negative_timeout == 0)
+		return;
+
+	char *remotepath2 = unify_path(remotepath, UNESCAPE);
+	if (remotepath2 == NULL) {
+		fprintf(stderr, "## fatal error: unify_path() returned NULL\n");
+		return;
+	}
+
+	cache_insert(remotepath2, NULL, wdfs.negative_timeout);
+}
+
+
+/* removes the negative items of the file and its parent directory, because
+ * the file was created. */
+void cache_delete_negative(const char *remotepath)
+{
+	assert(remotepath);
+
+	char *remotepath2 = unify_path(remotepath, UNESCAPE);
+	if (remotepath2 == NULL) {
+		fprintf(stderr, "## fatal error: unify_path() returned NULL\n");
+		return;
+	}
+
+	cache_remove_negative(remotepath2);
+	char *slash = strrchr(remotepath2, '/');
+	if (slash != NULL) {
+		*slash = '\0';
+		cache_remove_negative(remotepath2);
+	}
 	FREE(remotepath2);
 }
 
@@ -199,23 +767,83 @@ void cache_delete_item(const char *remotepath)
 		return;
 	}
 
-	/* to avoid conflict with cache_control_thread() lock */
-	pthread_mutex_lock(&cache_mutex);
-	struct cache_item *item = 
-		(struct cache_item *)g_hash_table_lookup(cache, remotepath2);
-	if (item != NULL) {
-		g_hash_table_remove(cache, remotepath2);
+	guint64 hash = cache_hash(remotepath2);
+	struct cache_shard *shard = cache_shard_of(hash);
+	snapshot_forget(remotepath2);
+
+	pthread_rwlock_wrlock(&shard->lock);
+	struct cache_slot *slot = cache_shard_find(shard, hash, remotepath2);
+	if (slot->key != NULL) {
+		cache_shard_remove(shard, slot - shard->slots);
 		if (wdfs.debug == true)
 			fprintf(stderr, "** removed cache item for '%s'\n", remotepath2);
 	}
-	pthread_mutex_unlock(&cache_mutex);
+	pthread_rwlock_unlock(&shard->lock);
+	FREE(remotepath2);
+}
+
+
+/* removes the items of all files below the directory remotepath, e.g. if it
+ * was moved. directory is true, if the caller knows remotepath as a directory,
+ * e.g. from the listing of its parent. otherwise the cache is only walked, if
+ * it has remotepath as a directory, so that an unknown path or a file costs
+ * no walk over all shards. */
+void cache_delete_tree(const char *remotepath, bool_t directory)
+{
+	assert(remotepath);
+
+	char *remotepath2 = unify_path(remotepath, UNESCAPE);
+	if (remotepath2 == NULL) {
+		fprintf(stderr, "## fatal error: unify_path() returned NULL\n");
+		return;
+	}
+
+	guint64 hash = cache_hash(remotepath2);
+	struct cache_shard *shard = cache_shard_of(hash);
+	pthread_rwlock_rdlock(&shard->lock);
+	struct cache_slot *slot = cache_shard_find(shard, hash, remotepath2);
+	if (slot->key != NULL && slot->negative == false &&
+			S_ISDIR(slot->item.mode))
+		directory = true;
+	pthread_rwlock_unlock(&shard->lock);
+	if (directory == false) {
+		FREE(remotepath2);
+		return;
+	}
+
+	/* the slots following a removed one move backwards, so the index is not
+	 * advanced after a removal */
+	char *prefix = g_strconcat(remotepath2, "/", NULL);
+	unsigned long removed = 0;
+	int i;
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		shard = &cache[i];
+		pthread_rwlock_wrlock(&shard->lock);
+		size_t index = 0;
+		while (index < shard->capacity) {
+			slot = &shard->slots[index];
+			if (slot->key != NULL && g_str_has_prefix(slot->key, prefix)) {
+				cache_shard_remove(shard, index);
+				removed++;
+			} else {
+				index++;
+			}
+		}
+		pthread_rwlock_unlock(&shard->lock);
+	}
+
+	if (wdfs.debug == true && removed > 0)
+		fprintf(stderr, "** removed %lu cache items below '%s'\n",
+			removed, remotepath2);
+	g_free(prefix);
 	FREE(remotepath2);
 }
 
 
 /* looks at the cache for the wanted item. if it's found and not already timed
  * out, the "struct stat *stat" is pointing to the wanted item's stat. 
- * returns 0 on success or -1 on error. */
+ * returns 0 on success, -ENOENT if the file is known not to exist or -1 if
+ * the file is not cached. */
 int cache_get_item(struct stat *stat, const char *remotepath)
 {
 	int ret = -1;
@@ -227,26 +855,36 @@ int cache_get_item(struct stat *stat, const char *remotepath)
 		return -1;
 	}
 
-	/* to avoid conflict with cache_control_thread() lock */
-	pthread_mutex_lock(&cache_mutex);
-	if (g_hash_table_lookup(cache, remotepath2) != NULL) {
-		struct cache_item *item =
-			(struct cache_item *)g_hash_table_lookup(cache, remotepath2);
-		pthread_mutex_unlock(&cache_mutex);
-		/* used cached item, if it's not timed out */
-		if (!cache_item_timed_out(item->timeout)) {
-			*stat = item->stat;
-			ret = 0;
-			if (wdfs.debug == true)
-				fprintf(stderr, "** cache hit for '%s'\n", remotepath2);
-		/* if this cache item has timed out, remove it */
-		} else {
-			if (wdfs.debug == true)
-				fprintf(stderr, "** cache item timed out '%s'\n", remotepath2);
-			cache_delete_item(remotepath2);
-		}
+	guint64 hash = cache_hash(remotepath2);
+	struct cache_shard *shard = cache_shard_of(hash);
+
+	/* the item is copied while the lock is held, because other threads may
+	 * remove it from the cache at any time. timed out items are left to the
+	 * cache control thread, so a lookup needs only the read lock. */
+	pthread_rwlock_rdlock(&shard->lock);
+	struct cache_slot *slot = cache_shard_find(shard, hash, remotepath2);
+	if (slot->key != NULL && !cache_item_timed_out(slot->item.timeout)) {
+		if (slot->negative == false)
+			cache_item_get(&slot->item, stat);
+		/* a benign race, other readers only set it too. it's only written
+		 * once per sweep, so the slot's cache line stays shared between
+		 * the cpus of the readers. */
+		if (slot->referenced == false)
+			slot->referenced = true;
+		ret = (slot->negative == true) ? -ENOENT : 0;
+	}
+	pthread_rwlock_unlock(&shard->lock);
+
+	if (ret == 0) {
+		__sync_fetch_and_add(&shard->hits, 1);
+		if (wdfs.debug == true)
+			fprintf(stderr, "** cache hit for '%s'\n", remotepath2);
+	} else if (ret == -ENOENT) {
+		__sync_fetch_and_add(&shard->negative_hits, 1);
+		if (wdfs.debug == true)
+			fprintf(stderr, "** negative cache hit for '%s'\n", remotepath2);
 	} else {
-		pthread_mutex_unlock(&cache_mutex);
+		__sync_fetch_and_add(&shard->misses, 1);
 		if (wdfs.debug == true)
 			fprintf(stderr, "** <no> cache hit for '%s'\n", remotepath2);
 	}
@@ -254,3 +892,162 @@ int cache_get_item(struct stat *stat, const char *remotepath)
 	return ret;
 }
 
+
+/* a background job, that fetches the attributes of a stale item */
+struct cache_refresh_job {
+	char *remotepath;	/* the path as given to cache_get_stale() */
+	char *key;			/* the unified remotepath */
+};
+
+
+static int cache_refresh_work(void *data)
+{
+	struct cache_refresh_job *job = (struct cache_refresh_job*)data;
+	return refresh_attributes(job->remotepath);
+}
+
+
+/* the item may be refreshed again, if the job failed. */
+static void cache_refresh_done(void *data, int ret)
+{
+	struct cache_refresh_job *job = (struct cache_refresh_job*)data;
+	guint64 hash = cache_hash(job->key);
+	struct cache_shard *shard = cache_shard_of(hash);
+
+	pthread_rwlock_wrlock(&shard->lock);
+	struct cache_slot *slot = cache_shard_find(shard, hash, job->key);
+	if (slot->key != NULL)
+		slot->refreshing = false;
+	if (ret == 0)
+		shard->refreshed++;
+	else
+		shard->refresh_failed++;
+	pthread_rwlock_unlock(&shard->lock);
+
+	FREE(job->remotepath);
+	FREE(job->key);
+	FREE(job);
+}
+
+
+/* looks at the cache for a timed out item, that is still in the grace 
+ * period of "-o stale_grace". if it's found, stat is set to its attributes
+ * and a background job fetches the current ones, unless a job already does.
+ * returns 0 on success or -1 if there is no such item. */
+int cache_get_stale(struct stat *stat, const char *remotepath)
+{
+	assert(remotepath && stat);
+
+	/* without background jobs the item could not be refreshed */
+	if (wdfs.stale_grace == 0 || background_jobs == NULL)
+		return -1;
+
+	char *remotepath2 = unify_path(remotepath, UNESCAPE);
+	if (remotepath2 == NULL) {
+		fprintf(stderr, "## error: unify_path() returned NULL\n");
+		return -1;
+	}
+
+	guint64 hash = cache_hash(remotepath2);
+	struct cache_shard *shard = cache_shard_of(hash);
+
+	int ret = -1;
+	bool_t refresh = false;
+	pthread_rwlock_rdlock(&shard->lock);
+	struct cache_slot *slot = cache_shard_find(shard, hash, remotepath2);
+	if (slot->key != NULL && slot->negative == false &&
+			cache_slot_stale_until(slot) > time(NULL)) {
+		cache_item_get(&slot->item, stat);
+		if (slot->referenced == false)
+			slot->referenced = true;
+		/* only one reader starts the job */
+		if (__sync_bool_compare_and_swap(&slot->refreshing, false, true))
+			refresh = true;
+		ret = 0;
+	}
+	pthread_rwlock_unlock(&shard->lock);
+
+	if (ret == 0) {
+		__sync_fetch_and_add(&shard->stale_hits, 1);
+		if (wdfs.debug == true)
+			fprintf(stderr, "** stale cache hit for '%s'\n", remotepath2);
+	}
+
+	if (refresh == true) {
+		struct cache_refresh_job *job = g_new0(struct cache_refresh_job, 1);
+		job->remotepath = strdup(remotepath);
+		job->key = remotepath2;
+		remotepath2 = NULL;
+		if (job->remotepath == NULL || async_submit(background_jobs,
+				cache_refresh_work, cache_refresh_done, job))
+			cache_refresh_done(job, -1);
+	}
+	FREE(remotepath2);
+	return ret;
+}
+
+
+/* calls fn for each item of the cache, that is not timed out and not 
+ * negative. the shard of the item is locked meanwhile, so fn must not use 
+ * the cache. */
+void cache_foreach(
+	void (*fn)(const char *key, const struct stat *stat, void *data), 
+	void *data)
+{
+	int i;
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		struct cache_shard *shard = &cache[i];
+		pthread_rwlock_rdlock(&shard->lock);
+		size_t index;
+		for (index = 0; index < shard->capacity; index++) {
+			struct cache_slot *slot = &shard->slots[index];
+			if (slot->key == NULL || slot->negative == true ||
+					cache_item_timed_out(slot->item.timeout))
+				continue;
+			struct stat stat;
+			cache_item_get(&slot->item, &stat);
+			fn(slot->key, &stat, data);
+		}
+		pthread_rwlock_unlock(&shard->lock);
+	}
+}
+
+
+/* prints the statistics of the cache. */
+void cache_print_stats(FILE *stream)
+{
+	unsigned long hits = 0, negative_hits = 0, misses = 0;
+	unsigned long stale_hits = 0, refreshed = 0, refresh_failed = 0;
+	unsigned long unchanged = 0, changed = 0;
+	unsigned long expired = 0, evicted = 0;
+	size_t items = 0, slots = 0, bytes = 0;
+	int i;
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		pthread_rwlock_rdlock(&cache[i].lock);
+		hits += cache[i].hits;
+		negative_hits += cache[i].negative_hits;
+		misses += cache[i].misses;
+		stale_hits += cache[i].stale_hits;
+		refreshed += cache[i].refreshed;
+		refresh_failed += cache[i].refresh_failed;
+		unchanged += cache[i].unchanged;
+		changed += cache[i].changed;
+		expired += cache[i].expired;
+		evicted += cache[i].evicted;
+		bytes += cache_shard_bytes(&cache[i]);
+		items += cache[i].used;
+		slots += cache[i].capacity;
+		pthread_rwlock_unlock(&cache[i].lock);
+	}
+	fprintf(stream, "attribute cache: %lu hits, %lu negative hits, "
+		"%lu misses, %lu expired, %lu evicted, %lu items in %lu slots of "
+		"%d shards, %lu KB\n", hits, negative_hits, misses, expired, 
+		evicted, (unsigned long)items, 
+		(unsigned long)slots, CACHE_SHARDS, (unsigned long)(bytes / 1024));
+	if (wdfs.stale_grace > 0)
+		fprintf(stream, "attribute cache: %lu stale hits, %lu refreshed, "
+			"%lu refreshs failed\n", stale_hits, refreshed, refresh_failed);
+	if (wdfs.cache_ttl_max > wdfs.cache_ttl_min)
+		fprintf(stream, "attribute cache: %lu items fetched again unchanged, "
+			"%lu changed\n", unchanged, changed);
+}
@@ -4,7 +4,17 @@
 void cache_initialize();
 void cache_destroy();
 void cache_add_item(struct stat *stat, const char *remotepath);
+void cache_add_item_max_age(
+	struct stat *stat, const char *remotepath, int max_age);
 void cache_delete_item(const char *remotepath);
+void cache_delete_tree(const char *remotepath, bool_t directory);
+void cache_add_negative(const char *remotepath);
+void cache_delete_negative(const char *remotepath);
 int cache_get_item(struct stat *stat, const char *remotepath);
+int cache_get_stale(struct stat *stat, const char *remotepath);
+void cache_foreach(
+	void (*fn)(const char *key, const struct stat *stat, void *data), 
+	void *data);
+void cache_print_stats(FILE *stream);
 
 #endif /*CACHE_H_*/
@@ -0,0 +1,813 @@
+/* 
+ *  this file is part of wdfs --> http://noedler.de/projekte/wdfs/
+ *
+ *  wdfs is a webdav filesystem with special features for accessing subversion
+ *  repositories. it is based on fuse v2.5+ and neon v0.24.7+.
+ * 
+ *  copyright (c) 2005 - 2007 jens m. noedler, noedler@web.de
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *  This program is released under the GPL with the additional exemption
+ *  that compiling, linking and/or using OpenSSL is allowed.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <glib.h>
+#include <ne_request.h>
+#include <ne_dates.h>
+
+#include "wdfs-main.h"
+#include "webdav.h"
+#include "spool.h"
+#include "content.h"
+
+/* the content cache keeps the data of files locally in the directory
+ * wdfs.content_cache, so that a file must not be fetched again if it's opened
+ * again -- even after remounting. for each file there are two files named by
+ * the sha1 hash of the remotepath:
+ *   <hash>.data  the file's data
+ *   <hash>.meta  remotepath, etag, last modification time and size
+ * an entry is only valid if both files exist and the size matches. to keep
+ * this crash-safe the .meta file is removed before the .data file is replaced
+ * and written (to a temporary file that is renamed) after it. leftovers are
+ * removed by content_cache_initialize().
+ * before a cached file is used, it's validated with a conditional GET that
+ * sends the etag as "If-None-Match" and the last modification time as 
+ * "If-Modified-Since". if the server answers "304 Not Modified" the cached
+ * data is used. otherwise the server sends the new file with the same 
+ * response, which replaces the cached data.
+ * if the cache is bigger than wdfs.content_cache_size MB, the least recently
+ * used entries are removed. the entries are kept in a list ordered by their
+ * last use for this.
+ * content_mutex protects the index, but not the data. a file is copied to a
+ * temporary file without holding it, only the renames are done under it.
+ * spool files are created in the cache's directory, so that a complete spool
+ * is added to the cache by linking the file instead of copying it. */
+
+
+/* an entry of the in-memory index of the cache. the key is the hash. */
+struct content_entry {
+	off_t size;
+	time_t last_used;
+	GList *link;			/* link of the entry in lru, its data is the key */
+};
+
+/* the values stored in a .meta file */
+struct content_meta {
+	char *path;
+	char *etag;
+	time_t mtime;
+	off_t size;
+};
+
+/* index of the cached files, the keys ordered by their last use (the most
+ * recently used first), the total size of all files and a mutex that 
+ * protects them */
+static GHashTable *entries = NULL;
+static GQueue lru = G_QUEUE_INIT;
+static off_t total_size = 0;
+static pthread_mutex_t content_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* used to create unique names for temporary files, protected by tmp_mutex */
+static unsigned long tmp_counter = 0;
+static pthread_mutex_t tmp_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct {
+	unsigned long hits;			/* files served from the cache */
+	unsigned long misses;		/* files not found in the cache */
+	unsigned long stale;		/* files found, but changed at the server */
+	unsigned long refetched;	/* stale files sent by the conditional GET */
+	unsigned long stored;		/* files added to the cache */
+	unsigned long evicted;		/* files removed to keep the size limit */
+	unsigned long long bytes_served;	/* bytes not fetched again */
+} content_stats;
+
+/* state of a conditional GET, used by the callbacks of conditional_get() */
+struct conditional_request {
+	int fh;					/* file for the new data or -1 */
+	off_t offset;			/* number of bytes received */
+	int error;				/* set to errno, if writing the data failed */
+	char *etag;				/* etag of the new data */
+	time_t mtime;			/* last modification time of the new data */
+};
+
+
+/* +++++++ local static methods +++++++ */
+
+
+/* returns the g_malloc()ed key of the remotepath or NULL on error */
+static char* content_key(const char *remotepath)
+{
+	char *path = unify_path(remotepath, UNESCAPE);
+	if (path == NULL)
+		return NULL;
+	char *key = g_compute_checksum_for_string(G_CHECKSUM_SHA1, path, -1);
+	FREE(path);
+	return key;
+}
+
+
+/* returns the g_malloc()ed name of the key's file with the given suffix */
+static char* content_file(const char *key, const char *suffix)
+{
+	return g_strdup_printf("%s/%s.%s", wdfs.content_cache, key, suffix);
+}
+
+
+/* returns a g_malloc()ed unique name for a temporary file */
+static char* content_tmp_file()
+{
+	pthread_mutex_lock(&tmp_mutex);
+	unsigned long counter = tmp_counter++;
+	pthread_mutex_unlock(&tmp_mutex);
+	return g_strdup_printf("%s/tmp-%d-%lu",
+		wdfs.content_cache, (int)getpid(), counter);
+}
+
+
+static void free_meta(struct content_meta *meta)
+{
+	free_chars(&meta->path, &meta->etag, NULL);
+}
+
+
+/* reads the .meta file of the key. returns 0 on success or -1 on error. */
+static int read_meta(const char *key, struct content_meta *meta)
+{
+	memset(meta, 0, sizeof(struct content_meta));
+
+	char *filename = content_file(key, "meta");
+	FILE *file = fopen(filename, "r");
+	g_free(filename);
+	if (file == NULL)
+		return -1;
+
+	char line[4096];
+	long long number;
+	while (fgets(line, sizeof(line), file) != NULL) {
+		line[strcspn(line, "\n")] = '\0';
+		if (!strncmp(line, "path ", 5))
+			meta->path = strdup(line + 5);
+		else if (!strncmp(line, "etag ", 5))
+			meta->etag = strdup(line + 5);
+		else if (sscanf(line, "mtime %lld", &number) == 1)
+			meta->mtime = number;
+		else if (sscanf(line, "size %lld", &number) == 1)
+			meta->size = number;
+	}
+	fclose(file);
+
+	if (meta->path == NULL) {
+		free_meta(meta);
+		return -1;
+	}
+	return 0;
+}
+
+
+/* writes the .meta file to a temporary file, that must be renamed to the
+ * key's .meta file. returns the g_malloc()ed name of the temporary file or
+ * NULL on error. */
+static char* write_meta(const struct content_meta *meta)
+{
+	char *tmp = content_tmp_file();
+	FILE *file = fopen(tmp, "w");
+	if (file == NULL) {
+		g_free(tmp);
+		return NULL;
+	}
+
+	fprintf(file, "path %s\n", meta->path);
+	if (meta->etag != NULL)
+		fprintf(file, "etag %s\n", meta->etag);
+	fprintf(file, "mtime %lld\nsize %lld\n",
+		(long long)meta->mtime, (long long)meta->size);
+
+	int ret = 0;
+	if (fflush(file) || fsync(fileno(file)))
+		ret = -1;
+	if (fclose(file))
+		ret = -1;
+
+	if (ret) {
+		unlink(tmp);
+		g_free(tmp);
+		return NULL;
+	}
+	return tmp;
+}
+
+
+/* removes both files of the key. the content_mutex must be held. */
+static void remove_files(const char *key)
+{
+	char *meta = content_file(key, "meta");
+	char *data = content_file(key, "data");
+	/* the .meta file first, because the .data file is useless without it */
+	unlink(meta);
+	unlink(data);
+	g_free(meta);
+	g_free(data);
+}
+
+
+/* adds the entry of the key to the index as the most recently used one. 
+ * the key must not be in the index. the content_mutex must be held. */
+static void add_entry(const char *key, off_t size, time_t last_used)
+{
+	struct content_entry *entry = g_new0(struct content_entry, 1);
+	char *entry_key = g_strdup(key);
+	entry->size = size;
+	entry->last_used = last_used;
+	entry->link = g_list_alloc();
+	entry->link->data = entry_key;
+	g_hash_table_insert(entries, entry_key, entry);
+	g_queue_push_head_link(&lru, entry->link);
+	total_size += size;
+}
+
+
+/* marks the entry as the most recently used one. the content_mutex must be
+ * held. */
+static void touch_entry(struct content_entry *entry)
+{
+	entry->last_used = time(NULL);
+	g_queue_unlink(&lru, entry->link);
+	g_queue_push_head_link(&lru, entry->link);
+}
+
+
+/* removes the entry of the key from the index and its files. the 
+ * content_mutex must be held. */
+static void remove_entry(const char *key)
+{
+	struct content_entry *entry = 
+		(struct content_entry*)g_hash_table_lookup(entries, key);
+	if (entry != NULL) {
+		total_size -= entry->size;
+		g_queue_delete_link(&lru, entry->link);
+		g_hash_table_remove(entries, key);
+	}
+	remove_files(key);
+}
+
+
+/* removes the least recently used entries until the cache fits into its size
+ * limit. the entry of keep is not removed. the content_mutex must be held. */
+static void evict_entries(const char *keep)
+{
+	const off_t max_size = (off_t)wdfs.content_cache_size * 1024 * 1024;
+
+	GList *link = lru.tail;
+	while (total_size > max_size && link != NULL) {
+		GList *previous = link->prev;
+		const char *key = (const char*)link->data;
+		if (keep == NULL || strcmp(key, keep)) {
+			if (wdfs.debug == true)
+				fprintf(stderr, "** content cache: evicting '%s'\n", key);
+			char *victim = strdup(key);
+			remove_entry(victim);
+			FREE(victim);
+			content_stats.evicted++;
+		}
+		link = previous;
+	}
+}
+
+
+/* sorts the keys of the index, the most recently used first */
+static gint compare_last_used(gconstpointer a, gconstpointer b, gpointer data)
+{
+	const struct content_entry *entry_a = (const struct content_entry*)
+		g_hash_table_lookup(entries, a);
+	const struct content_entry *entry_b = (const struct content_entry*)
+		g_hash_table_lookup(entries, b);
+	if (entry_a->last_used == entry_b->last_used)
+		return 0;
+	return (entry_a->last_used > entry_b->last_used) ? -1 : 1;
+}
+
+
+/* copies size bytes from the filehandle in to out. returns 0 on success or
+ * -1 on error. */
+static int copy_data(int in, int out, off_t size)
+{
+	char buffer[64 * 1024];
+	off_t offset = 0;
+	while (offset < size) {
+		ssize_t len = pread(in, buffer, sizeof(buffer), offset);
+		if (len <= 0)
+			return -1;
+		if (pwrite(out, buffer, len, offset) != len)
+			return -1;
+		offset += len;
+	}
+	return 0;
+}
+
+
+/* this method is called by neon after the response headers of a conditional
+ * GET were read. the body is only accepted if it's the new file. */
+static int conditional_accept_response(
+	void *userdata, ne_request *req, const ne_status *status)
+{
+	struct conditional_request *cond = (struct conditional_request*)userdata;
+
+	if (status->klass != 2)
+		return 0;
+
+#if NEON_VERSION >= 26
+	const char *etag = ne_get_response_header(req, "ETag");
+	if (etag != NULL)
+		cond->etag = strdup(etag);
+	const char *lastmodified = ne_get_response_header(req, "Last-Modified");
+	if (lastmodified != NULL)
+		cond->mtime = ne_rfc1123_parse(lastmodified);
+#endif
+
+	/* the file for the new data is created not until it's needed */
+	if (cond->fh == -1) {
+		cond->fh = content_cache_filehandle();
+		if (cond->fh == -1)
+			cond->fh = get_filehandle();
+		if (cond->fh == -1)
+			cond->error = errno ? errno : EIO;
+	}
+	return 1;
+}
+
+
+/* this method is called by neon for each block of the new file's data */
+#if NEON_VERSION >= 26
+static int conditional_body_reader(void *userdata, const char *buf, size_t len)
+#else
+static void conditional_body_reader(void *userdata, const char *buf, size_t len)
+#endif
+{
+	struct conditional_request *cond = (struct conditional_request*)userdata;
+
+	if (cond->error == 0 && len > 0) {
+		if (pwrite(cond->fh, buf, len, cond->offset) != (ssize_t)len)
+			cond->error = errno ? errno : EIO;
+		cond->offset += len;
+	}
+
+#if NEON_VERSION >= 26
+	return cond->error ? -1 : 0;
+#endif
+}
+
+
+/* asks the server with a conditional GET, if the cached file is still up to 
+ * date. returns 304 if it is, 200 if the new file was received into cond->fh
+ * or -1 on error. */
+static int conditional_get(
+	const char *remotepath, const struct content_meta *meta,
+	struct conditional_request *cond)
+{
+	memset(cond, 0, sizeof(struct conditional_request));
+	cond->fh = -1;
+
+	pooled_session session;
+	if (session == NULL)
+		return -1;
+	ne_request *req = ne_request_create(session, "GET", remotepath);
+	if (meta->etag != NULL)
+		ne_add_request_header(req, "If-None-Match", meta->etag);
+	if (meta->mtime != 0) {
+		char *date = ne_rfc1123_date(meta->mtime);
+		ne_add_request_header(req, "If-Modified-Since", date);
+		FREE(date);
+	}
+	ne_add_response_body_reader(req, conditional_accept_response,
+		conditional_body_reader, cond);
+
+	int ret = ne_request_dispatch(req);
+	int code = ne_get_status(req)->code;
+	if (ret == NE_OK && code != 304 && code != 200)
+		ne_set_error(session, "%d %s", code, ne_get_status(req)->reason_phrase);
+	if (ret != NE_OK || cond->error != 0 || (code != 304 && code != 200)) {
+		fprintf(stderr, "## GET error: %s\n", cond->error ? 
+			strerror(cond->error) : ne_get_error(session));
+		code = -1;
+	}
+	ne_request_destroy(req);
+
+	if (code != 200 && cond->fh != -1) {
+		close(cond->fh);
+		cond->fh = -1;
+	}
+	if (code != 200)
+		FREE(cond->etag);
+	return code;
+}
+
+
+/* +++++++ exported non-static methods +++++++ */
+
+
+/* creates the cache directory if needed and reads the index of the cache. 
+ * incomplete entries and temporary files are removed. returns 0 on success or
+ * -1 on error. */
+int content_cache_initialize()
+{
+	if (wdfs.content_cache == NULL)
+		return 0;
+
+	if (g_mkdir_with_parents(wdfs.content_cache, 0700)) {
+		fprintf(stderr, "## error: could not create content cache '%s': %s\n",
+			wdfs.content_cache, strerror(errno));
+		return -1;
+	}
+
+	DIR *dir = opendir(wdfs.content_cache);
+	if (dir == NULL) {
+		fprintf(stderr, "## error: could not open content cache '%s': %s\n",
+			wdfs.content_cache, strerror(errno));
+		return -1;
+	}
+
+	entries = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+	/* collect the file names first, the directory is modified below */
+	GPtrArray *names = g_ptr_array_new();
+	struct dirent *dirent;
+	while ((dirent = readdir(dir)) != NULL) {
+		if (dirent->d_name[0] != '.')
+			g_ptr_array_add(names, g_strdup(dirent->d_name));
+	}
+	closedir(dir);
+
+	guint i;
+	/* 1st pass: add entries with a valid .meta and .data file */
+	for (i = 0; i < names->len; i++) {
+		char *name = (char*)g_ptr_array_index(names, i);
+		if (!g_str_has_suffix(name, ".meta"))
+			continue;
+		char *key = g_strndup(name, strlen(name) - 5);
+
+		struct content_meta meta;
+		struct stat data_stat;
+		char *data = content_file(key, "data");
+		if (read_meta(key, &meta) == 0 && stat(data, &data_stat) == 0 &&
+				data_stat.st_size == meta.size) {
+			add_entry(key, meta.size, data_stat.st_mtime);
+			free_meta(&meta);
+		} else {
+			remove_files(key);
+		}
+		g_free(data);
+		g_free(key);
+	}
+
+	/* 2nd pass: remove temporary files and .data files without an entry */
+	for (i = 0; i < names->len; i++) {
+		char *name = (char*)g_ptr_array_index(names, i);
+		bool_t remove = false;
+		if (g_str_has_prefix(name, "tmp-")) {
+			remove = true;
+		} else if (g_str_has_suffix(name, ".data")) {
+			char *key = g_strndup(name, strlen(name) - 5);
+			remove = (g_hash_table_lookup(entries, key) == NULL);
+			g_free(key);
+		}
+		if (remove == true) {
+			char *filename = 
+				g_strdup_printf("%s/%s", wdfs.content_cache, name);
+			unlink(filename);
+			g_free(filename);
+		}
+		g_free(name);
+	}
+	g_ptr_array_free(names, TRUE);
+
+	pthread_mutex_lock(&content_mutex);
+	g_queue_sort(&lru, compare_last_used, NULL);
+	evict_entries(NULL);
+	pthread_mutex_unlock(&content_mutex);
+
+	if (wdfs.debug == true)
+		fprintf(stderr, "** content cache '%s': %u files, %lld bytes\n",
+			wdfs.content_cache, g_hash_table_size(entries),
+			(long long)total_size);
+	return 0;
+}
+
+
+/* frees the index. the cached files stay on the disk. */
+void content_cache_destroy()
+{
+	if (entries == NULL)
+		return;
+
+	pthread_mutex_lock(&content_mutex);
+	g_hash_table_destroy(entries);
+	entries = NULL;
+	g_queue_clear(&lru);
+	total_size = 0;
+	pthread_mutex_unlock(&content_mutex);
+}
+
+
+/* returns a filehandle of a file without a name in the cache's directory,
+ * that may be linked into the cache later. returns -1 if the cache is 
+ * disabled or the filesystem does not support this. */
+int content_cache_filehandle()
+{
+#ifdef O_TMPFILE
+	if (entries != NULL)
+		return open(wdfs.content_cache, O_TMPFILE | O_RDWR, 0600);
+#endif
+	return -1;
+}
+
+
+/* looks for the remote file in the cache and validates it. returns a complete
+ * spool with the cached data, a complete spool with the new data if the server
+ * sent it instead of "304 Not Modified" or NULL otherwise. the data is copied to a new spool file if the file is opened for writing,
+ * otherwise the cached file is used directly. */
+struct spool* content_cache_open(
+	const char *remotepath, const struct stat *stat, bool_t writable)
+{
+	assert(remotepath && stat);
+
+	if (entries == NULL)
+		return NULL;
+
+	char *key = content_key(remotepath);
+	if (key == NULL)
+		return NULL;
+
+	/* the meta and data files are renamed by content_cache_store() with the
+	 * lock held, so they are read with the lock too. otherwise the old meta
+	 * may be paired with the new data. */
+	struct content_meta meta;
+	int fh = -1;
+	pthread_mutex_lock(&content_mutex);
+	bool_t found = (g_hash_table_lookup(entries, key) != NULL);
+	if (found == false)
+		content_stats.misses++;
+	else if (read_meta(key, &meta) == 0) {
+		char *data = content_file(key, "data");
+		fh = open(data, writable == true ? O_RDWR : O_RDONLY);
+		g_free(data);
+		if (fh == -1)
+			free_meta(&meta);
+	}
+	pthread_mutex_unlock(&content_mutex);
+
+	if (fh == -1) {
+		g_free(key);
+		return NULL;
+	}
+
+	/* a data file of another size is damaged */
+	struct stat data_stat;
+	if (fstat(fh, &data_stat) || data_stat.st_size != meta.size) {
+		if (wdfs.debug == true)
+			fprintf(stderr, "** content cache: '%s' has a damaged data "
+				"file\n", remotepath);
+		close(fh);
+		pthread_mutex_lock(&content_mutex);
+		remove_entry(key);
+		pthread_mutex_unlock(&content_mutex);
+		free_meta(&meta);
+		g_free(key);
+		return NULL;
+	}
+
+	/* without etag, a different size or time means the file has changed.
+	 * then it's not worth asking the server. */
+	bool_t stale = (strcmp(meta.path, remotepath) != 0);
+	if (meta.etag == NULL && 
+			(meta.size != stat->st_size || meta.mtime != stat->st_mtime))
+		stale = true;
+
+	/* is the cached file still the one at the server? */
+	struct conditional_request cond;
+	int code = -1;
+	if (stale == false)
+		code = conditional_get(remotepath, &meta, &cond);
+
+	if (code != 304) {
+		if (wdfs.debug == true)
+			fprintf(stderr, "** content cache: '%s' is stale\n", remotepath);
+		close(fh);
+		pthread_mutex_lock(&content_mutex);
+		content_stats.stale++;
+		if (code == 200)
+			content_stats.refetched++;
+		remove_entry(key);
+		pthread_mutex_unlock(&content_mutex);
+		free_meta(&meta);
+		g_free(key);
+
+		/* the server sent the new file, no need to fetch it again */
+		if (code == 200) {
+			struct spool *spool = 
+				spool_new_complete(remotepath, cond.fh, cond.offset, cond.etag);
+			spool->mtime = cond.mtime ? cond.mtime : stat->st_mtime;
+			FREE(cond.etag);
+			return spool;
+		}
+		return NULL;
+	}
+
+	/* a writable file must not modify the cached data */
+	if (writable == true) {
+		int copy = content_cache_filehandle();
+		if (copy == -1)
+			copy = get_filehandle();
+		if (copy != -1 && copy_data(fh, copy, meta.size)) {
+			close(copy);
+			copy = -1;
+		}
+		close(fh);
+		fh = copy;
+	}
+
+	if (fh == -1) {
+		free_meta(&meta);
+		g_free(key);
+		return NULL;
+	}
+
+	/* mark this entry as recently used, also for the next mount */
+	futimens(fh, NULL);
+
+	struct spool *spool = 
+		spool_new_complete(remotepath, fh, meta.size, meta.etag);
+	spool->mtime = meta.mtime;
+	spool->cached = true;
+	spool->readonly = (writable == true) ? false : true;
+
+	pthread_mutex_lock(&content_mutex);
+	struct content_entry *entry =
+		(struct content_entry*)g_hash_table_lookup(entries, key);
+	if (entry != NULL)
+		touch_entry(entry);
+	content_stats.hits++;
+	content_stats.bytes_served += meta.size;
+	pthread_mutex_unlock(&content_mutex);
+
+	if (wdfs.debug == true)
+		fprintf(stderr, "** content cache hit for '%s'\n", remotepath);
+
+	free_meta(&meta);
+	g_free(key);
+	return spool;
+}
+
+
+/* adds the data of a complete and unmodified spool to the cache. */
+void content_cache_store(struct spool *spool)
+{
+	assert(spool);
+
+	if (entries == NULL || spool->cached == true || spool->missing != 0)
+		return;
+
+	/* without etag and time the file can't be validated later */
+	if (spool->etag == NULL && spool->mtime == 0)
+		return;
+
+	struct stat spool_stat;
+	if (fstat(spool->fh, &spool_stat) || 
+			spool_stat.st_size != spool->remote_size)
+		return;
+
+	/* files bigger than the cache are not stored at all */
+	if (spool->remote_size > (off_t)wdfs.content_cache_size * 1024 * 1024)
+		return;
+
+	char *key = content_key(spool->remotepath);
+	if (key == NULL)
+		return;
+
+	/* link the spool file into the cache's directory or copy it. this is
+	 * done without the lock, a big file must not block the other files. */
+	char *tmp = content_tmp_file();
+	int ret = -1;
+#ifdef O_TMPFILE
+	char proc_path[64];
+	snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", spool->fh);
+	if (linkat(AT_FDCWD, proc_path, AT_FDCWD, tmp, AT_SYMLINK_FOLLOW) == 0)
+		ret = fsync(spool->fh);
+#endif
+	if (ret) {
+		int fh = open(tmp, O_CREAT | O_EXCL | O_WRONLY, 0600);
+		if (fh != -1) {
+			ret = copy_data(spool->fh, fh, spool->remote_size);
+			if (ret == 0)
+				ret = fsync(fh);
+			close(fh);
+		}
+	}
+
+	struct content_meta meta;
+	meta.path = spool->remotepath;
+	meta.etag = spool->etag;
+	meta.mtime = spool->mtime;
+	meta.size = spool->remote_size;
+	char *meta_tmp = (ret == 0) ? write_meta(&meta) : NULL;
+	if (meta_tmp == NULL)
+		ret = -1;
+
+	char *data = content_file(key, "data");
+	char *meta_file = content_file(key, "meta");
+
+	pthread_mutex_lock(&content_mutex);
+
+	/* invalidate the old entry before its data is replaced */
+	remove_entry(key);
+
+	if (ret == 0)
+		ret = rename(tmp, data);
+	if (ret == 0)
+		ret = rename(meta_tmp, meta_file);
+
+	if (ret == 0) {
+		add_entry(key, spool->remote_size, time(NULL));
+		content_stats.stored++;
+		evict_entries(key);
+		if (wdfs.debug == true)
+			fprintf(stderr, "** content cache: stored '%s'\n", 
+				spool->remotepath);
+	} else {
+		fprintf(stderr, "## error: could not store '%s' in the content "
+			"cache: %s\n", spool->remotepath, strerror(errno));
+		unlink(tmp);
+		if (meta_tmp != NULL)
+			unlink(meta_tmp);
+		remove_files(key);
+	}
+
+	pthread_mutex_unlock(&content_mutex);
+	g_free(meta_file);
+	g_free(meta_tmp);
+	g_free(data);
+	g_free(tmp);
+	g_free(key);
+}
+
+
+/* removes the remote file from the cache, e.g. if it was changed or deleted. */
+void content_cache_remove(const char *remotepath)
+{
+	assert(remotepath);
+
+	if (entries == NULL)
+		return;
+
+	char *key = content_key(remotepath);
+	if (key == NULL)
+		return;
+
+	pthread_mutex_lock(&content_mutex);
+	if (g_hash_table_lookup(entries, key) != NULL)
+		remove_entry(key);
+	pthread_mutex_unlock(&content_mutex);
+	g_free(key);
+}
+
+
+/* prints the statistics of the content cache. */
+void content_cache_print_stats(FILE *stream)
+{
+	if (entries == NULL)
+		return;
+
+	pthread_mutex_lock(&content_mutex);
+	fprintf(stream,
+		"content cache: %u files, %lld bytes\n"
+		"  hits: %lu (%llu bytes), misses: %lu, stale: %lu (%lu refetched)\n"
+		"  stored: %lu, evicted: %lu\n",
+		g_hash_table_size(entries), (long long)total_size,
+		content_stats.hits, content_stats.bytes_served,
+		content_stats.misses, content_stats.stale, content_stats.refetched,
+		content_stats.stored, content_stats.evicted);
+	pthread_mutex_unlock(&content_mutex);
+}
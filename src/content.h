@@ -0,0 +1,13 @@
+#ifndef CONTENT_H_
+#define CONTENT_H_
+
+int content_cache_initialize();
+void content_cache_destroy();
+int content_cache_filehandle();
+struct spool* content_cache_open(
+	const char *remotepath, const struct stat *stat, bool_t writable);
+void content_cache_store(struct spool *spool);
+void content_cache_remove(const char *remotepath);
+void content_cache_print_stats(FILE *stream);
+
+#endif /*CONTENT_H_*/
@@ -0,0 +1,481 @@
+/* 
+ *  this file is part of wdfs --> http://noedler.de/projekte/wdfs/
+ *
+ *  wdfs is a webdav filesystem with special features for accessing subversion
+ *  repositories. it is based on fuse v2.5+ and neon v0.24.7+.
+ * 
+ *  copyright (c) 2005 - 2007 jens m. noedler, noedler@web.de
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *  This program is released under the GPL with the additional exemption
+ *  that compiling, linking and/or using OpenSSL is allowed.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <glib.h>
+
+#include "wdfs-main.h"
+#include "upload.h"
+#include "dircache.h"
+#include "snapshot.h"
+
+/* the directory cache keeps the complete listings of directories, so that a
+ * repeated readdir() (ls, tab completion, walking a tree) needs no PROPFIND.
+ * a listing is built by readdir() from the answer of the server and contains
+ * the name and the attributes of each member of the directory. it's used for
+ * "-o dir_timeout" seconds.
+ * a cached listing is complete, so it also answers getattr() for the members
+ * of the directory: a member's attributes are taken from the listing and a
+ * name, that is not in the listing, does not exist. the entries are sorted by
+ * name for the lookups.
+ * local changes of a file's attributes (put, truncate, chmod) remove the 
+ * listing of its directory.
+ * local changes of a directory (mknod, mkdir, unlink, rmdir, rename) remove 
+ * its listing. each removal increases dir_cache_generation. a listing, that
+ * was requested before a removal, is not stored, because it may be outdated.
+ * the listings are kept in lru order. if the memory of all listings exceeds
+ * "-o cache_memory", the least recently used listings are removed. */
+
+
+/* a member of a directory */
+struct dir_entry {
+	char *name;
+	struct stat stat;
+};
+
+struct dir_listing {
+	char *key;				/* unified remotepath of the directory */
+	GArray *entries;		/* struct dir_entry */
+	size_t bytes;			/* memory used by the listing */
+	time_t timeout;			/* the listing is used until this time */
+	unsigned long generation;	/* dir_cache_generation, when requested */
+	GList *link;			/* link of the listing in dir_cache_lru */
+};
+
+/* the listings by their key and in lru order, the most recently used first.
+ * protected by dir_cache_mutex. */
+static GHashTable *dir_cache = NULL;
+static GQueue dir_cache_lru = G_QUEUE_INIT;
+static pthread_mutex_t dir_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* increased, if a listing is removed because of a local change */
+static unsigned long dir_cache_generation = 0;
+
+/* memory used by all listings in bytes */
+static size_t dir_cache_bytes = 0;
+
+/* statistics, protected by dir_cache_mutex */
+static unsigned long dir_cache_hits = 0;
+static unsigned long dir_cache_misses = 0;
+static unsigned long dir_cache_invalidated = 0;
+static unsigned long dir_cache_evicted = 0;
+static unsigned long dir_cache_lookup_hits = 0;
+static unsigned long dir_cache_lookup_absent = 0;
+
+
+/* +++++++ local static methods +++++++ */
+
+
+/* compares two entries by name, used to sort the listings */
+static gint dir_entry_compare(gconstpointer a, gconstpointer b)
+{
+	return strcmp(((const struct dir_entry*)a)->name,
+		((const struct dir_entry*)b)->name);
+}
+
+
+/* removes the listing from the cache. dir_cache_mutex must be held. */
+static void dir_cache_remove(struct dir_listing *listing)
+{
+	g_hash_table_remove(dir_cache, listing->key);
+	g_queue_delete_link(&dir_cache_lru, listing->link);
+	dir_cache_bytes -= listing->bytes;
+	dir_listing_free(listing);
+}
+
+
+/* returns the valid listing of the unified key and marks it as recently 
+ * used or returns NULL. an expired listing is removed. dir_cache_mutex must
+ * be held. */
+static struct dir_listing* dir_cache_get(const char *key)
+{
+	struct dir_listing *listing = 
+		(struct dir_listing*)g_hash_table_lookup(dir_cache, key);
+	if (listing == NULL)
+		return NULL;
+
+	if (listing->timeout <= time(NULL)) {
+		dir_cache_remove(listing);
+		return NULL;
+	}
+
+	g_queue_unlink(&dir_cache_lru, listing->link);
+	g_queue_push_head_link(&dir_cache_lru, listing->link);
+	return listing;
+}
+
+
+/* removes the listing of the unified key because of a local change. 
+ * dir_cache_mutex must be held. */
+static void dir_cache_invalidate_key(const char *key)
+{
+	dir_cache_generation++;
+	snapshot_forget_directory(key);
+	struct dir_listing *listing = 
+		(struct dir_listing*)g_hash_table_lookup(dir_cache, key);
+	if (listing != NULL) {
+		if (wdfs.debug == true)
+			fprintf(stderr, "** removed directory listing '%s'\n", key);
+		dir_cache_remove(listing);
+		dir_cache_invalidated++;
+	}
+}
+
+
+/* +++++++ exported non-static methods +++++++ */
+
+
+void dir_cache_initialize()
+{
+	dir_cache = g_hash_table_new(g_str_hash, g_str_equal);
+}
+
+
+void dir_cache_destroy()
+{
+	pthread_mutex_lock(&dir_cache_mutex);
+	while (!g_queue_is_empty(&dir_cache_lru)) {
+		dir_cache_remove(
+			(struct dir_listing*)g_queue_peek_head(&dir_cache_lru));
+	}
+	g_hash_table_destroy(dir_cache);
+	dir_cache = NULL;
+	pthread_mutex_unlock(&dir_cache_mutex);
+}
+
+
+/* creates an empty listing of the directory remotepath, that is filled by 
+ * dir_listing_add(). returns NULL, if the directory cache is disabled. */
+struct dir_listing* dir_listing_new(const char *remotepath)
+{
+	assert(remotepath);
+
+	if (wdfs.dir_timeout == 0)
+		return NULL;
+
+	char *key = unify_path(remotepath, UNESCAPE);
+	if (key == NULL)
+		return NULL;
+
+	struct dir_listing *listing = g_new0(struct dir_listing, 1);
+	listing->key = key;
+	listing->entries = g_array_new(FALSE, FALSE, sizeof(struct dir_entry));
+	listing->bytes = sizeof(struct dir_listing) + strlen(key) + 1;
+
+	pthread_mutex_lock(&dir_cache_mutex);
+	listing->generation = dir_cache_generation;
+	pthread_mutex_unlock(&dir_cache_mutex);
+	return listing;
+}
+
+
+/* adds a member of the directory to the listing. */
+void dir_listing_add(
+	struct dir_listing *listing, const char *name, const struct stat *stat)
+{
+	assert(listing && name && stat);
+
+	struct dir_entry entry;
+	entry.name = strdup(name);
+	entry.stat = *stat;
+	g_array_append_val(listing->entries, entry);
+	listing->bytes += sizeof(struct dir_entry) + strlen(name) + 1;
+}
+
+
+void dir_listing_free(struct dir_listing *listing)
+{
+	if (listing == NULL)
+		return;
+
+	guint i;
+	for (i = 0; i < listing->entries->len; i++)
+		FREE(g_array_index(listing->entries, struct dir_entry, i).name);
+	g_array_free(listing->entries, TRUE);
+	FREE(listing->key);
+	FREE(listing);
+}
+
+
+/* adds the complete listing to the cache. the cache takes the listing. it's
+ * dropped, if the directory was changed locally since dir_listing_new(). */
+void dir_cache_store(struct dir_listing *listing)
+{
+	if (listing == NULL)
+		return;
+
+	/* the listing is newer than the one of the snapshot */
+	snapshot_forget_directory(listing->key);
+
+	pthread_mutex_lock(&dir_cache_mutex);
+	if (listing->generation != dir_cache_generation) {
+		pthread_mutex_unlock(&dir_cache_mutex);
+		dir_listing_free(listing);
+		return;
+	}
+
+	struct dir_listing *old = 
+		(struct dir_listing*)g_hash_table_lookup(dir_cache, listing->key);
+	if (old != NULL)
+		dir_cache_remove(old);
+
+	/* remove the least recently used listings to stay within the limit */
+	size_t budget = (size_t)wdfs.cache_memory * 1024 * 1024;
+	while (!g_queue_is_empty(&dir_cache_lru) && 
+			dir_cache_bytes + listing->bytes > budget) {
+		dir_cache_remove(
+			(struct dir_listing*)g_queue_peek_tail(&dir_cache_lru));
+		dir_cache_evicted++;
+	}
+
+	g_array_sort(listing->entries, dir_entry_compare);
+	listing->timeout = time(NULL) + wdfs.dir_timeout;
+	g_queue_push_head(&dir_cache_lru, listing);
+	listing->link = g_queue_peek_head_link(&dir_cache_lru);
+	g_hash_table_insert(dir_cache, listing->key, listing);
+	dir_cache_bytes += listing->bytes;
+
+	if (wdfs.debug == true)
+		fprintf(stderr, "** added directory listing '%s' with %u entries\n",
+			listing->key, listing->entries->len);
+	pthread_mutex_unlock(&dir_cache_mutex);
+}
+
+
+/* adds the members of the cached listing of remotepath to the directory with
+ * the fuse filler method. returns 0 on success or -1 if the listing is not
+ * cached. */
+int dir_cache_fill(const char *remotepath, void *buf, fuse_fill_dir_t filler)
+{
+	assert(remotepath && filler);
+
+	if (wdfs.dir_timeout == 0)
+		return -1;
+
+	char *key = unify_path(remotepath, UNESCAPE);
+	if (key == NULL)
+		return -1;
+
+	pthread_mutex_lock(&dir_cache_mutex);
+	struct dir_listing *listing = dir_cache_get(key);
+	if (listing == NULL) {
+		dir_cache_misses++;
+		pthread_mutex_unlock(&dir_cache_mutex);
+		FREE(key);
+		return -1;
+	}
+
+	dir_cache_hits++;
+
+	guint i;
+	for (i = 0; i < listing->entries->len; i++) {
+		struct dir_entry *entry = 
+			&g_array_index(listing->entries, struct dir_entry, i);
+		/* a file with a pending upload has the attributes of the local 
+		 * version */
+		struct stat stat = entry->stat;
+		if (wdfs.write_behind == true) {
+			char *path = g_strconcat(key, "/", entry->name, NULL);
+			upload_get_stat(&stat, path);
+			g_free(path);
+		}
+		if (filler(buf, entry->name, &stat, 0))
+			fprintf(stderr, "## filler() error in %s()!\n", __func__);
+	}
+	pthread_mutex_unlock(&dir_cache_mutex);
+
+	if (wdfs.debug == true)
+		fprintf(stderr, "** directory listing hit for '%s'\n", key);
+	FREE(key);
+	return 0;
+}
+
+
+/* looks up the file remotepath in the cached listing of its directory. if 
+ * it's found, stat is set to its attributes. returns 0 on success, -ENOENT 
+ * if the file is not in the complete listing or -1 if the directory's 
+ * listing is not cached. */
+int dir_cache_lookup(const char *remotepath, struct stat *stat)
+{
+	assert(remotepath && stat);
+
+	if (wdfs.dir_timeout == 0)
+		return -1;
+
+	char *key = unify_path(remotepath, UNESCAPE);
+	if (key == NULL)
+		return -1;
+
+	/* split the path into the directory's key and the name */
+	char *slash = strrchr(key, '/');
+	if (slash == NULL || slash[1] == '\0') {
+		FREE(key);
+		return -1;
+	}
+	*slash = '\0';
+	struct dir_entry wanted;
+	wanted.name = slash + 1;
+
+	int ret = -1;
+	pthread_mutex_lock(&dir_cache_mutex);
+	struct dir_listing *listing = dir_cache_get(key);
+	if (listing != NULL) {
+		struct dir_entry *entry = (struct dir_entry*)bsearch(
+			&wanted, listing->entries->data, listing->entries->len,
+			sizeof(struct dir_entry), dir_entry_compare);
+		if (entry != NULL) {
+			*stat = entry->stat;
+			dir_cache_lookup_hits++;
+			ret = 0;
+		} else {
+			dir_cache_lookup_absent++;
+			ret = -ENOENT;
+		}
+	}
+	pthread_mutex_unlock(&dir_cache_mutex);
+
+	if (wdfs.debug == true && ret != -1) {
+		fprintf(stderr, "** directory listing of '%s' %s '%s'\n", key,
+			ret == 0 ? "contains" : "does not contain", wanted.name);
+	}
+	FREE(key);
+	return ret;
+}
+
+
+/* removes the listing of the directory remotepath, because it was changed. */
+void dir_cache_invalidate(const char *remotepath)
+{
+	assert(remotepath);
+
+	char *key = unify_path(remotepath, UNESCAPE);
+	if (key == NULL)
+		return;
+
+	pthread_mutex_lock(&dir_cache_mutex);
+	dir_cache_invalidate_key(key);
+	pthread_mutex_unlock(&dir_cache_mutex);
+	FREE(key);
+}
+
+
+/* removes the listing of the directory, that contains remotepath, because 
+ * remotepath was created or removed. */
+void dir_cache_invalidate_parent(const char *remotepath)
+{
+	assert(remotepath);
+
+	char *key = unify_path(remotepath, UNESCAPE);
+	if (key == NULL)
+		return;
+
+	char *slash = strrchr(key, '/');
+	if (slash != NULL)
+		*slash = '\0';
+
+	pthread_mutex_lock(&dir_cache_mutex);
+	dir_cache_invalidate_key(key);
+	pthread_mutex_unlock(&dir_cache_mutex);
+	FREE(key);
+}
+
+
+/* removes the listings of the directory remotepath and of all directories 
+ * below it, e.g. if the directory was moved. */
+void dir_cache_invalidate_tree(const char *remotepath)
+{
+	assert(remotepath);
+
+	char *key = unify_path(remotepath, UNESCAPE);
+	if (key == NULL)
+		return;
+	char *prefix = g_strconcat(key, "/", NULL);
+	snapshot_forget_tree(key);
+
+	pthread_mutex_lock(&dir_cache_mutex);
+	dir_cache_invalidate_key(key);
+	GList *link = dir_cache_lru.head;
+	while (link != NULL) {
+		GList *next = link->next;
+		struct dir_listing *listing = (struct dir_listing*)link->data;
+		if (g_str_has_prefix(listing->key, prefix)) {
+			dir_cache_remove(listing);
+			dir_cache_invalidated++;
+		}
+		link = next;
+	}
+	pthread_mutex_unlock(&dir_cache_mutex);
+	g_free(prefix);
+	FREE(key);
+}
+
+
+/* calls fn for each valid listing with the directory's key and NULL as name
+ * and stat, and then for each member of the directory. the directory cache
+ * is locked meanwhile, so fn must not use it. */
+void dir_cache_foreach(void (*fn)(const char *key, const char *name, 
+	const struct stat *stat, void *data), void *data)
+{
+	time_t now = time(NULL);
+	pthread_mutex_lock(&dir_cache_mutex);
+	GList *link;
+	for (link = dir_cache_lru.head; link != NULL; link = link->next) {
+		struct dir_listing *listing = (struct dir_listing*)link->data;
+		if (listing->timeout <= now)
+			continue;
+		fn(listing->key, NULL, NULL, data);
+		guint i;
+		for (i = 0; i < listing->entries->len; i++) {
+			struct dir_entry *entry = 
+				&g_array_index(listing->entries, struct dir_entry, i);
+			fn(listing->key, entry->name, &entry->stat, data);
+		}
+	}
+	pthread_mutex_unlock(&dir_cache_mutex);
+}
+
+
+/* prints the statistics of the directory cache. */
+void dir_cache_print_stats(FILE *stream)
+{
+	pthread_mutex_lock(&dir_cache_mutex);
+	fprintf(stream, "directory cache: %lu hits, %lu misses, %lu invalidated, "
+		"%lu evicted, %u listings, %lu KB\n", dir_cache_hits, dir_cache_misses,
+		dir_cache_invalidated, dir_cache_evicted, 
+		g_queue_get_length(&dir_cache_lru),
+		(unsigned long)(dir_cache_bytes / 1024));
+	fprintf(stream, "directory cache: %lu getattr() answered, "
+		"%lu of them not existing\n", 
+		dir_cache_lookup_hits + dir_cache_lookup_absent,
+		dir_cache_lookup_absent);
+	pthread_mutex_unlock(&dir_cache_mutex);
+}
@@ -0,0 +1,22 @@
+#ifndef DIRCACHE_H_
+#define DIRCACHE_H_
+
+struct dir_listing;
+
+void dir_cache_initialize();
+void dir_cache_destroy();
+struct dir_listing* dir_listing_new(const char *remotepath);
+void dir_listing_add(
+	struct dir_listing *listing, const char *name, const struct stat *stat);
+void dir_listing_free(struct dir_listing *listing);
+void dir_cache_store(struct dir_listing *listing);
+int dir_cache_fill(const char *remotepath, void *buf, fuse_fill_dir_t filler);
+int dir_cache_lookup(const char *remotepath, struct stat *stat);
+void dir_cache_invalidate(const char *remotepath);
+void dir_cache_invalidate_parent(const char *remotepath);
+void dir_cache_invalidate_tree(const char *remotepath);
+void dir_cache_foreach(void (*fn)(const char *key, const char *name, 
+	const struct stat *stat, void *data), void *data);
+void dir_cache_print_stats(FILE *stream);
+
+#endif /*DIRCACHE_H_*/
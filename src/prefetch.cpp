@@ -0,0 +1,277 @@
+/*
+ *  this file is part of wdfs --> http://noedler.de/projekte/wdfs/
+ *
+ *  wdfs is a webdav filesystem with special features for accessing subversion
+ *  repositories. it is based on fuse v2.5+ and neon v0.24.7+.
+ *
+ *  copyright (c) 2005 - 2007 jens m. noedler, noedler@web.de
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *  This program is released under the GPL with the additional exemption
+ *  that compiling, linking and/or using OpenSSL is allowed.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <glib.h>
+
+#include "wdfs-main.h"
+#include "cache.h"
+#include "dircache.h"
+#include "prefetch.h"
+
+/* programs like make or a version control system call stat() for many files
+ * of a directory without reading the directory. each cache miss would send
+ * its own propfind request with depth 0. the sibling prefetch counts the
+ * misses of each directory. if "-o prefetch_misses" misses happen within
+ * PREFETCH_WINDOW seconds, the directory is listed with a propfind of depth
+ * 1 instead, which adds all of its files to the caches. the following
+ * stat() calls of the other files are answered from the caches.
+ * listing a big directory costs more than a few single requests. so the
+ * number of entries of each listed directory is remembered, and a directory
+ * is only listed, if it has at most PREFETCH_RATIO entries per miss.
+ * the history is kept for at most PREFETCH_HISTORY directories. */
+
+/* seconds, in which the misses of a directory are counted */
+#define PREFETCH_WINDOW		2
+
+/* maximum number of entries of a listed directory per miss */
+#define PREFETCH_RATIO		32
+
+/* maximum number of directories in the history */
+#define PREFETCH_HISTORY	4096
+
+struct prefetch_history {
+	time_t window;		/* start of the window, in which misses are counted */
+	int misses;			/* number of misses in the window */
+	int entries;		/* entries of the last listing or -1, if unknown */
+	bool_t busy;		/* the directory is listed by a prefetch */
+};
+
+/* the history by the directory's unified remotepath, protected by
+ * prefetch_mutex */
+static GHashTable *prefetch_table = NULL;
+static pthread_mutex_t prefetch_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* unified remotepath of the mount's root directory. only directories below
+ * it are listed. */
+static char *prefetch_root = NULL;
+
+/* statistics, protected by prefetch_mutex */
+static unsigned long prefetch_sent = 0;
+static unsigned long prefetch_answered = 0;
+static unsigned long prefetch_too_big = 0;
+
+
+/* +++++++ local static methods +++++++ */
+
+
+/* removes the history of idle directories, whose window is over. */
+static gboolean prefetch_idle(gpointer key, gpointer value, gpointer now)
+{
+	struct prefetch_history *history = (struct prefetch_history*)value;
+	return (history->busy == false &&
+		history->window + PREFETCH_WINDOW <= *(time_t*)now) ? TRUE : FALSE;
+}
+
+
+/* returns the history of the unified key and creates it, if it's not known
+ * yet. returns NULL, if the history is full. prefetch_mutex must be held. */
+static struct prefetch_history* prefetch_get(const char *key, time_t now)
+{
+	struct prefetch_history *history = (struct prefetch_history*)
+		g_hash_table_lookup(prefetch_table, key);
+	if (history != NULL)
+		return history;
+
+	if (g_hash_table_size(prefetch_table) >= PREFETCH_HISTORY) {
+		g_hash_table_foreach_remove(prefetch_table, prefetch_idle, &now);
+		if (g_hash_table_size(prefetch_table) >= PREFETCH_HISTORY)
+			return NULL;
+	}
+
+	history = g_new0(struct prefetch_history, 1);
+	history->window = now;
+	history->entries = -1;
+	g_hash_table_insert(prefetch_table, g_strdup(key), history);
+	return history;
+}
+
+
+/* returns true, if the unified key is the mount's root directory or below
+ * it. */
+static bool_t prefetch_in_mount(const char *key)
+{
+	size_t len = strlen(prefetch_root);
+	if (strncmp(key, prefetch_root, len))
+		return false;
+	return (key[len] == '\0' || key[len] == '/') ? true : false;
+}
+
+
+/* +++++++ exported non-static methods +++++++ */
+
+
+void prefetch_initialize()
+{
+	if (wdfs.prefetch_misses == 0)
+		return;
+
+	prefetch_root = unify_path(remotepath_basedir, UNESCAPE);
+	if (prefetch_root == NULL) {
+		fprintf(stderr, "## fatal error: unify_path() returned NULL\n");
+		return;
+	}
+	prefetch_table = g_hash_table_new_full(
+		g_str_hash, g_str_equal, g_free, g_free);
+}
+
+
+void prefetch_destroy()
+{
+	pthread_mutex_lock(&prefetch_mutex);
+	if (prefetch_table != NULL)
+		g_hash_table_destroy(prefetch_table);
+	prefetch_table = NULL;
+	pthread_mutex_unlock(&prefetch_mutex);
+	FREE(prefetch_root);
+}
+
+
+/* called by getattr() for a file, that is not cached. if it's the last of
+ * "-o prefetch_misses" misses in its directory, the directory is listed and
+ * the file is looked up in the caches. returns 0 and sets stat, if the file
+ * was found, -ENOENT if it's not in the listing or -1 if the directory was
+ * not listed. */
+int prefetch_siblings(const char *remotepath, struct stat *stat)
+{
+	assert(remotepath && stat);
+
+	if (prefetch_root == NULL)
+		return -1;
+
+	char *key = unify_path(remotepath, UNESCAPE);
+	if (key == NULL)
+		return -1;
+
+	/* the directory's key */
+	char *slash = strrchr(key, '/');
+	if (slash == NULL || slash[1] == '\0') {
+		FREE(key);
+		return -1;
+	}
+	*slash = '\0';
+	if (!prefetch_in_mount(key)) {
+		FREE(key);
+		return -1;
+	}
+
+	time_t now = time(NULL);
+	bool_t prefetch = false;
+	pthread_mutex_lock(&prefetch_mutex);
+	struct prefetch_history *history = prefetch_get(key, now);
+	if (history != NULL) {
+		if (history->window + PREFETCH_WINDOW <= now) {
+			history->window = now;
+			history->misses = 0;
+		}
+		history->misses++;
+		if (history->busy == false &&
+				history->misses >= wdfs.prefetch_misses) {
+			/* a big directory needs more misses to pay off */
+			if (history->entries > history->misses * PREFETCH_RATIO) {
+				prefetch_too_big++;
+			} else {
+				history->busy = true;
+				history->misses = 0;
+				prefetch = true;
+			}
+		}
+	}
+	pthread_mutex_unlock(&prefetch_mutex);
+
+	if (prefetch == false) {
+		FREE(key);
+		return -1;
+	}
+
+	if (wdfs.debug == true)
+		fprintf(stderr, "** prefetching the directory '%s'\n", key);
+
+	/* refresh_directory() tells the number of entries to prefetch_learn() */
+	int ret = -1;
+	char *directory = unify_path(key, ESCAPE);
+	if (directory != NULL && refresh_directory(directory, NULL, NULL) == 0) {
+		ret = cache_get_item(stat, remotepath);
+		if (ret == -1)
+			ret = dir_cache_lookup(remotepath, stat);
+	}
+	FREE(directory);
+
+	pthread_mutex_lock(&prefetch_mutex);
+	history = (struct prefetch_history*)
+		g_hash_table_lookup(prefetch_table, key);
+	if (history != NULL)
+		history->busy = false;
+	prefetch_sent++;
+	if (ret != -1)
+		prefetch_answered++;
+	pthread_mutex_unlock(&prefetch_mutex);
+
+	FREE(key);
+	return ret;
+}
+
+
+/* remembers the number of entries of the directory remotepath, after it
+ * was listed. */
+void prefetch_learn(const char *remotepath, int entries)
+{
+	assert(remotepath);
+
+	if (prefetch_root == NULL)
+		return;
+
+	char *key = unify_path(remotepath, UNESCAPE);
+	if (key == NULL)
+		return;
+
+	pthread_mutex_lock(&prefetch_mutex);
+	struct prefetch_history *history = prefetch_get(key, time(NULL));
+	if (history != NULL)
+		history->entries = entries;
+	pthread_mutex_unlock(&prefetch_mutex);
+	FREE(key);
+}
+
+
+/* prints the statistics of the sibling prefetch. */
+void prefetch_print_stats(FILE *stream)
+{
+	if (wdfs.prefetch_misses == 0)
+		return;
+
+	pthread_mutex_lock(&prefetch_mutex);
+	fprintf(stream, "sibling prefetch: %lu directories listed, %lu getattr() "
+		"answered, %lu directories too big\n", prefetch_sent,
+		prefetch_answered, prefetch_too_big);
+	pthread_mutex_unlock(&prefetch_mutex);
+}
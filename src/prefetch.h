@@ -0,0 +1,10 @@
+#ifndef PREFETCH_H_
+#define PREFETCH_H_
+
+void prefetch_initialize();
+void prefetch_destroy();
+int prefetch_siblings(const char *remotepath, struct stat *stat);
+void prefetch_learn(const char *remotepath, int entries);
+void prefetch_print_stats(FILE *stream);
+
+#endif /*PREFETCH_H_*/
@@ -0,0 +1,885 @@
+/*
+ *  this file is part of wdfs --> http://noedler.de/projekte/wdfs/
+ *
+ *  wdfs is a webdav filesystem with special features for accessing subversion
+ *  repositories. it is based on fuse v2.5+ and neon v0.24.7+.
+ *
+ *  copyright (c) 2005 - 2007 jens m. noedler, noedler@web.de
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *  This program is released under the GPL with the additional exemption
+ *  that compiling, linking and/or using OpenSSL is allowed.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <glib.h>
+
+#include "wdfs-main.h"
+#include "async.h"
+#include "cache.h"
+#include "dircache.h"
+#include "upload.h"
+#include "snapshot.h"
+
+/* the snapshot keeps the attribute cache and the directory cache across
+ * mounts. it's written to the file "-o metadata_cache" every
+ * SNAPSHOT_INTERVAL seconds and when wdfs is unmounted. at the next mount
+ * the file is mapped into memory and nothing else is read, so the mount is
+ * not delayed by a big snapshot.
+ * the snapshot is used after the caches: getattr() and readdir() are
+ * answered from it, if the caches don't know the file or the directory. the
+ * first use of a directory's data starts a background job, that revalidates
+ * the directory with a PROPFIND of depth 1. the answer of the server fills
+ * the caches and the snapshot's data of the directory is not used anymore.
+ * every local change and every newer data in the caches make the records of
+ * the snapshot stale, too.
+ * the file has a header, the records and a table of strings. each record
+ * is a file, its name and its directory (parent) are offsets in the string
+ * table. a record with an empty name marks a complete listing of the
+ * directory. the records are sorted by parent and name, so a file is found
+ * by a binary search and the members of a directory follow its mark. the
+ * first string of the table is the address of the webdav resource, the
+ * snapshot of another resource is ignored.
+ * the file is mapped read-only and only the header is checked at the mount.
+ * the offsets of a record are checked, when the record is used. a snapshot
+ * with a bad offset is unmapped. the flags of the records are kept in an
+ * array, that is allocated with the first change.
+ * each record has the time, when its data was known to be current. records
+ * older than SNAPSHOT_MAX_AGE are not written again. a missing file is only
+ * reported as not existing, if the listing is younger than
+ * "-o negative_timeout" seconds. a file created at the server meanwhile is
+ * found then. */
+
+#define SNAPSHOT_MAGIC		"wdfssnap"
+#define SNAPSHOT_VERSION	2
+
+/* seconds between two writes of the snapshot */
+#define SNAPSHOT_INTERVAL	300
+
+/* seconds, after which a record is not written anymore */
+#define SNAPSHOT_MAX_AGE	(7 * 24 * 3600)
+
+/* flags of a record, they are only set in memory. the record is not used
+ * anymore, if it's stale. a revalidation of the directory is queued, if its
+ * first record is queued. */
+#define SNAPSHOT_STALE		0x1
+#define SNAPSHOT_QUEUED		0x2
+
+struct snapshot_header {
+	char magic[8];			/* SNAPSHOT_MAGIC */
+	guint32 version;		/* SNAPSHOT_VERSION */
+	guint32 records;		/* number of records */
+	guint64 strings;		/* size of the string table in bytes */
+};
+
+struct snapshot_record {
+	guint32 parent;			/* offset of the directory's unified path */
+	guint32 name;			/* offset of the name, empty for the mark */
+	guint32 mode;
+	guint32 reserved;		/* always 0 */
+	gint64 size;
+	gint64 mtime;
+	gint64 ctime;
+	gint64 seen;			/* time, when the data was current */
+};
+
+/* a record while the snapshot is written, with its strings */
+struct snapshot_entry {
+	char *parent;
+	char *name;
+	struct snapshot_record record;
+	bool_t old;				/* the record is taken from the old snapshot */
+};
+
+/* the mapped snapshot, protected by snapshot_mutex */
+static void *snapshot_map = NULL;
+static size_t snapshot_map_size = 0;
+static struct snapshot_record *snapshot_records = NULL;
+static guint32 snapshot_count = 0;
+static const char *snapshot_strings = NULL;
+static guint64 snapshot_strings_size = 0;
+static guint8 *snapshot_flags = NULL;	/* per record, NULL if all are 0 */
+static bool_t snapshot_damaged = false;	/* a bad offset was found */
+static pthread_mutex_t snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* unified remotepath of the mount's root directory. only the data of files
+ * below it is used. */
+static char *snapshot_root = NULL;
+
+/* the thread, that writes the snapshot periodically. it's stopped by
+ * snapshot_destroy(). */
+static pthread_t snapshot_thread_id;
+static bool_t snapshot_thread_started = false;
+static bool_t snapshot_control_stop = false;
+static pthread_mutex_t snapshot_control_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t snapshot_control_cond = PTHREAD_COND_INITIALIZER;
+
+/* statistics, protected by snapshot_mutex */
+static unsigned long snapshot_loaded = 0;
+static unsigned long snapshot_hits = 0;
+static unsigned long snapshot_absent = 0;
+static unsigned long snapshot_listings = 0;
+static unsigned long snapshot_refreshed = 0;
+static unsigned long snapshot_refresh_failed = 0;
+static unsigned long snapshot_written = 0;
+
+
+/* +++++++ local static methods +++++++ */
+
+
+/* returns true, if the unified key is the mount's root directory or below
+ * it. */
+static bool_t snapshot_in_mount(const char *key)
+{
+	size_t len = strlen(snapshot_root);
+	if (strncmp(key, snapshot_root, len))
+		return false;
+	return (key[len] == '\0' || key[len] == '/') ? true : false;
+}
+
+
+/* returns the string at the offset of the string table. a bad offset
+ * damages the snapshot, "" is returned then. the table ends with a '\0', so
+ * every string is terminated. snapshot_mutex must be held. */
+static const char* snapshot_string(guint32 offset)
+{
+	if (offset < snapshot_strings_size)
+		return snapshot_strings + offset;
+	snapshot_damaged = true;
+	return "";
+}
+
+
+static guint8 snapshot_get_flags(guint32 index)
+{
+	return (snapshot_flags != NULL) ? snapshot_flags[index] : 0;
+}
+
+
+static void snapshot_set_flags(guint32 index, guint8 flags)
+{
+	if (snapshot_flags == NULL)
+		snapshot_flags = g_new0(guint8, snapshot_count);
+	snapshot_flags[index] |= flags;
+}
+
+
+/* unmaps the snapshot. snapshot_mutex must be held. */
+static void snapshot_unmap()
+{
+	if (snapshot_map != NULL)
+		munmap(snapshot_map, snapshot_map_size);
+	snapshot_map = NULL;
+	snapshot_map_size = 0;
+	snapshot_records = NULL;
+	snapshot_count = 0;
+	snapshot_strings = NULL;
+	snapshot_strings_size = 0;
+	g_free(snapshot_flags);
+	snapshot_flags = NULL;
+	snapshot_damaged = false;
+}
+
+
+/* unmaps the snapshot, if a bad offset was found. returns true in this case.
+ * snapshot_mutex must be held. */
+static bool_t snapshot_check_damage()
+{
+	if (snapshot_damaged == false)
+		return false;
+	fprintf(stderr, "## error: snapshot '%s' is damaged, it's ignored\n",
+		wdfs.metadata_cache);
+	snapshot_unmap();
+	return true;
+}
+
+
+/* compares the record with the parent and the name. */
+static int snapshot_compare(
+	const struct snapshot_record *record, const char *parent, const char *name)
+{
+	int ret = strcmp(snapshot_string(record->parent), parent);
+	if (ret == 0)
+		ret = strcmp(snapshot_string(record->name), name);
+	return ret;
+}
+
+
+/* returns the index of the first record, that is not less than the parent
+ * and the name. snapshot_mutex must be held. */
+static guint32 snapshot_find(const char *parent, const char *name)
+{
+	guint32 low = 0, high = snapshot_count;
+	while (low < high) {
+		guint32 middle = low + (high - low) / 2;
+		if (snapshot_compare(&snapshot_records[middle], parent, name) < 0)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return low;
+}
+
+
+/* returns the index of the record of the parent and the name or
+ * snapshot_count. snapshot_mutex must be held. */
+static guint32 snapshot_get(const char *parent, const char *name)
+{
+	guint32 index = snapshot_find(parent, name);
+	if (index < snapshot_count &&
+			!snapshot_compare(&snapshot_records[index], parent, name))
+		return index;
+	return snapshot_count;
+}
+
+
+/* sets the flags of all records of the directory parent. returns the number
+ * of records. snapshot_mutex must be held. */
+static guint32 snapshot_mark_directory(const char *parent, guint32 flags)
+{
+	guint32 index = snapshot_find(parent, "");
+	guint32 marked = 0;
+	while (index < snapshot_count && !strcmp(
+			snapshot_string(snapshot_records[index].parent), parent)) {
+		snapshot_set_flags(index++, flags);
+		marked++;
+	}
+	return marked;
+}
+
+
+static void snapshot_get_stat(
+	const struct snapshot_record *record, struct stat *stat)
+{
+	memset(stat, 0, sizeof(struct stat));
+	stat->st_mode = record->mode;
+	stat->st_nlink = 1;
+	stat->st_size = record->size;
+	stat->st_blocks = (stat->st_size + 511) / 512;
+	stat->st_atime = time(NULL);
+	stat->st_mtime = record->mtime;
+	stat->st_ctime = record->ctime;
+	stat->st_uid = getuid();
+	stat->st_gid = getgid();
+}
+
+
+/* the background job, that revalidates the directory with the key data. */
+static int snapshot_refresh_work(void *data)
+{
+	char *remotepath = unify_path((char*)data, ESCAPE);
+	if (remotepath == NULL)
+		return -ENOMEM;
+
+	int ret = refresh_directory(remotepath, NULL, NULL);
+	FREE(remotepath);
+	return ret;
+}
+
+
+/* the data of the directory is not used anymore after the revalidation. the
+ * caches know the current data or the directory is gone. */
+static void snapshot_refresh_done(void *data, int ret)
+{
+	char *key = (char*)data;
+
+	pthread_mutex_lock(&snapshot_mutex);
+	snapshot_mark_directory(key, SNAPSHOT_STALE);
+	snapshot_check_damage();
+	if (ret == 0)
+		snapshot_refreshed++;
+	else
+		snapshot_refresh_failed++;
+	pthread_mutex_unlock(&snapshot_mutex);
+
+	if (wdfs.debug == true)
+		fprintf(stderr, "** revalidated snapshot of '%s': %s\n",
+			key, ret == 0 ? "ok" : "failed");
+	FREE(key);
+}
+
+
+/* queues the revalidation of the directory parent, unless it's already
+ * queued. snapshot_mutex must not be held. */
+static void snapshot_queue_refresh(const char *parent)
+{
+	pthread_mutex_lock(&snapshot_mutex);
+	guint32 index = snapshot_find(parent, "");
+	bool_t queue = false;
+	if (index < snapshot_count && !strcmp(
+			snapshot_string(snapshot_records[index].parent), parent) &&
+			!(snapshot_get_flags(index) & SNAPSHOT_QUEUED)) {
+		snapshot_set_flags(index, SNAPSHOT_QUEUED);
+		queue = true;
+	}
+	if (snapshot_check_damage() == true)
+		queue = false;
+	pthread_mutex_unlock(&snapshot_mutex);
+	if (queue == false)
+		return;
+
+	char *key = strdup(parent);
+	if (key == NULL || async_submit(background_jobs,
+			snapshot_refresh_work, snapshot_refresh_done, key)) {
+		/* without a revalidation the data must not be used */
+		FREE(key);
+		pthread_mutex_lock(&snapshot_mutex);
+		snapshot_mark_directory(parent, SNAPSHOT_STALE);
+		snapshot_check_damage();
+		pthread_mutex_unlock(&snapshot_mutex);
+	}
+}
+
+
+/* maps the snapshot file into memory, if it's a valid snapshot of this
+ * webdav resource. only the header and the ends of the string table are
+ * read. */
+static void snapshot_load()
+{
+	int fh = open(wdfs.metadata_cache, O_RDONLY);
+	if (fh == -1) {
+		if (errno != ENOENT)
+			fprintf(stderr, "## error: could not open snapshot '%s': %s\n",
+				wdfs.metadata_cache, strerror(errno));
+		return;
+	}
+
+	struct stat st;
+	void *map = MAP_FAILED;
+	if (fstat(fh, &st) == 0 &&
+			st.st_size >= (off_t)sizeof(struct snapshot_header))
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fh, 0);
+	close(fh);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "## error: could not map snapshot '%s'\n",
+			wdfs.metadata_cache);
+		return;
+	}
+
+	/* check the header, the size and the string table */
+	struct snapshot_header *header = (struct snapshot_header*)map;
+	struct snapshot_record *records =
+		(struct snapshot_record*)((char*)map + sizeof(struct snapshot_header));
+	const char *strings = (char*)(records + header->records);
+	bool_t valid = (!memcmp(header->magic, SNAPSHOT_MAGIC, 8) &&
+		header->version == SNAPSHOT_VERSION && header->strings > 0 &&
+		sizeof(struct snapshot_header) + (guint64)header->records *
+		sizeof(struct snapshot_record) + header->strings ==
+		(guint64)st.st_size) ? true : false;
+	if (valid == true && (strings[header->strings - 1] != '\0' ||
+			strcmp(strings, wdfs.webdav_resource)))
+		valid = false;
+
+	if (valid == false) {
+		fprintf(stderr, "## error: snapshot '%s' is invalid or of another "
+			"webdav resource, it's ignored\n", wdfs.metadata_cache);
+		munmap(map, st.st_size);
+		return;
+	}
+
+	pthread_mutex_lock(&snapshot_mutex);
+	snapshot_map = map;
+	snapshot_map_size = st.st_size;
+	snapshot_records = records;
+	snapshot_count = header->records;
+	snapshot_strings = strings;
+	snapshot_strings_size = header->strings;
+	snapshot_loaded = header->records;
+	pthread_mutex_unlock(&snapshot_mutex);
+
+	if (wdfs.debug == true)
+		fprintf(stderr, "** mapped snapshot '%s' with %u records\n",
+			wdfs.metadata_cache, header->records);
+}
+
+
+/* adds the record of the unified key to the entries. */
+static void snapshot_collect(GArray *entries,
+	const char *parent, const char *name, const struct stat *stat)
+{
+	if (!snapshot_in_mount(parent))
+		return;
+
+	struct snapshot_entry entry;
+	memset(&entry, 0, sizeof(entry));
+	entry.parent = g_strdup(parent);
+	entry.name = g_strdup(name);
+	if (stat != NULL) {
+		entry.record.mode = stat->st_mode;
+		entry.record.size = stat->st_size;
+		entry.record.mtime = stat->st_mtime;
+		entry.record.ctime = stat->st_ctime;
+	}
+	entry.record.seen = time(NULL);
+	entry.old = false;
+	g_array_append_val(entries, entry);
+}
+
+
+/* called by cache_foreach() for each item of the attribute cache */
+static void snapshot_collect_item(
+	const char *key, const struct stat *stat, void *data)
+{
+	const char *slash = strrchr(key, '/');
+	if (slash == NULL || slash[1] == '\0')
+		return;
+
+	char *parent = g_strndup(key, slash - key);
+	snapshot_collect((GArray*)data, parent, slash + 1, stat);
+	g_free(parent);
+}
+
+
+/* called by dir_cache_foreach() for each listing and its members */
+static void snapshot_collect_listing(const char *key, const char *name,
+	const struct stat *stat, void *data)
+{
+	snapshot_collect((GArray*)data, key, name != NULL ? name : "", stat);
+}
+
+
+/* sorts the entries by parent and name, the entries of the caches first */
+static gint snapshot_entry_compare(gconstpointer a, gconstpointer b)
+{
+	const struct snapshot_entry *entry_a = (const struct snapshot_entry*)a;
+	const struct snapshot_entry *entry_b = (const struct snapshot_entry*)b;
+	int ret = strcmp(entry_a->parent, entry_b->parent);
+	if (ret == 0)
+		ret = strcmp(entry_a->name, entry_b->name);
+	if (ret == 0)
+		ret = (int)entry_a->old - (int)entry_b->old;
+	return ret;
+}
+
+
+/* returns the offset of the string in the string table and adds it, if
+ * it's not in the table yet. */
+static guint32 snapshot_intern(
+	GString *strings, GHashTable *offsets, const char *string)
+{
+	gpointer offset = g_hash_table_lookup(offsets, string);
+	if (offset != NULL)
+		return GPOINTER_TO_UINT(offset);
+
+	guint32 new_offset = strings->len;
+	g_string_append_len(strings, string, strlen(string) + 1);
+	g_hash_table_insert(offsets, (gpointer)string,
+		GUINT_TO_POINTER(new_offset));
+	return new_offset;
+}
+
+
+/* frees the strings of the entries and sets their number to 0. */
+static void snapshot_clear_entries(GArray *entries)
+{
+	guint32 i;
+	for (i = 0; i < entries->len; i++) {
+		struct snapshot_entry *entry =
+			&g_array_index(entries, struct snapshot_entry, i);
+		g_free(entry->parent);
+		g_free(entry->name);
+	}
+	g_array_set_size(entries, 0);
+}
+
+
+/* writes the snapshot of the caches and of the still valid records of the
+ * mapped snapshot to a temporary file and renames it. the mapping keeps the
+ * old file. returns 0 on success or -1 on error. */
+static int snapshot_write()
+{
+	GArray *entries = g_array_new(FALSE, FALSE, sizeof(struct snapshot_entry));
+
+	guint32 i;
+	time_t now = time(NULL);
+	pthread_mutex_lock(&snapshot_mutex);
+	for (i = 0; i < snapshot_count; i++) {
+		const struct snapshot_record *record = &snapshot_records[i];
+		if ((snapshot_get_flags(i) & SNAPSHOT_STALE) ||
+				record->seen + SNAPSHOT_MAX_AGE < now)
+			continue;
+		struct snapshot_entry entry;
+		entry.parent = g_strdup(snapshot_string(record->parent));
+		entry.name = g_strdup(snapshot_string(record->name));
+		entry.record = *record;
+		entry.old = true;
+		g_array_append_val(entries, entry);
+	}
+	if (snapshot_check_damage() == true)
+		snapshot_clear_entries(entries);
+	pthread_mutex_unlock(&snapshot_mutex);
+
+	cache_foreach(snapshot_collect_item, entries);
+	dir_cache_foreach(snapshot_collect_listing, entries);
+
+	g_array_sort(entries, snapshot_entry_compare);
+
+	/* the first string is the address of the webdav resource. the offset of
+	 * every other string is bigger than 0. */
+	GString *strings = g_string_new(NULL);
+	g_string_append_len(strings,
+		wdfs.webdav_resource, strlen(wdfs.webdav_resource) + 1);
+	GHashTable *offsets = g_hash_table_new(g_str_hash, g_str_equal);
+	GArray *records = g_array_new(FALSE, FALSE, sizeof(struct snapshot_record));
+	struct snapshot_entry *previous = NULL;
+	for (i = 0; i < entries->len; i++) {
+		struct snapshot_entry *entry =
+			&g_array_index(entries, struct snapshot_entry, i);
+		/* the entry of a cache is newer than the one of the old snapshot */
+		if (previous != NULL && !strcmp(previous->parent, entry->parent) &&
+				!strcmp(previous->name, entry->name))
+			continue;
+		previous = entry;
+
+		struct snapshot_record record = entry->record;
+		record.parent = snapshot_intern(strings, offsets, entry->parent);
+		record.name = snapshot_intern(strings, offsets, entry->name);
+		record.reserved = 0;
+		g_array_append_val(records, record);
+	}
+
+	struct snapshot_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SNAPSHOT_MAGIC, 8);
+	header.version = SNAPSHOT_VERSION;
+	header.records = records->len;
+	header.strings = strings->len;
+
+	int ret = -1;
+	char *tmp = g_strconcat(wdfs.metadata_cache, ".tmp", NULL);
+	FILE *file = fopen(tmp, "w");
+	if (file != NULL) {
+		if (fwrite(&header, sizeof(header), 1, file) == 1 &&
+				fwrite(records->data, sizeof(struct snapshot_record),
+				records->len, file) == records->len &&
+				fwrite(strings->str, 1, strings->len, file) == strings->len &&
+				!fflush(file) && !fsync(fileno(file)))
+			ret = 0;
+		if (fclose(file))
+			ret = -1;
+		if (ret == 0 && rename(tmp, wdfs.metadata_cache))
+			ret = -1;
+		if (ret)
+			unlink(tmp);
+	}
+	if (ret)
+		fprintf(stderr, "## error: could not write snapshot '%s': %s\n",
+			wdfs.metadata_cache, strerror(errno));
+	else if (wdfs.debug == true)
+		fprintf(stderr, "** wrote snapshot '%s' with %u records\n",
+			wdfs.metadata_cache, records->len);
+
+	pthread_mutex_lock(&snapshot_mutex);
+	if (ret == 0)
+		snapshot_written++;
+	pthread_mutex_unlock(&snapshot_mutex);
+
+	g_free(tmp);
+	g_hash_table_destroy(offsets);
+	g_array_free(records, TRUE);
+	g_string_free(strings, TRUE);
+	snapshot_clear_entries(entries);
+	g_array_free(entries, TRUE);
+	return ret;
+}
+
+
+/* this thread runs until it is stopped by snapshot_destroy() and writes the
+ * snapshot every SNAPSHOT_INTERVAL seconds. */
+static void* snapshot_thread(void *unused)
+{
+	pthread_mutex_lock(&snapshot_control_mutex);
+	while (snapshot_control_stop == false) {
+		struct timespec wakeup;
+		wakeup.tv_sec = time(NULL) + SNAPSHOT_INTERVAL;
+		wakeup.tv_nsec = 0;
+		pthread_cond_timedwait(
+			&snapshot_control_cond, &snapshot_control_mutex, &wakeup);
+		if (snapshot_control_stop == true)
+			break;
+		pthread_mutex_unlock(&snapshot_control_mutex);
+
+		snapshot_write();
+
+		pthread_mutex_lock(&snapshot_control_mutex);
+	}
+	pthread_mutex_unlock(&snapshot_control_mutex);
+	return NULL;
+}
+
+
+/* +++++++ exported non-static methods +++++++ */
+
+
+/* maps the snapshot of the last mount and starts the thread, that writes the
+ * snapshot periodically. must be called after the fork() of fuse. */
+void snapshot_initialize()
+{
+	if (wdfs.metadata_cache == NULL)
+		return;
+
+	snapshot_root = unify_path(remotepath_basedir, UNESCAPE);
+	if (snapshot_root == NULL) {
+		fprintf(stderr, "## fatal error: unify_path() returned NULL\n");
+		return;
+	}
+
+	snapshot_load();
+
+	snapshot_control_stop = false;
+	if (pthread_create(&snapshot_thread_id, NULL, snapshot_thread, NULL))
+		fprintf(stderr, "## error: could not start the snapshot thread, "
+			"the snapshot is only written on unmount\n");
+	else
+		snapshot_thread_started = true;
+}
+
+
+/* stops the thread, writes the snapshot and unmaps the old one. must be
+ * called before the caches are destroyed. */
+void snapshot_destroy()
+{
+	if (snapshot_root == NULL)
+		return;
+
+	if (snapshot_thread_started == true) {
+		pthread_mutex_lock(&snapshot_control_mutex);
+		snapshot_control_stop = true;
+		pthread_cond_signal(&snapshot_control_cond);
+		pthread_mutex_unlock(&snapshot_control_mutex);
+		pthread_join(snapshot_thread_id, NULL);
+		snapshot_thread_started = false;
+	}
+
+	snapshot_write();
+
+	pthread_mutex_lock(&snapshot_mutex);
+	snapshot_unmap();
+	pthread_mutex_unlock(&snapshot_mutex);
+	FREE(snapshot_root);
+}
+
+
+/* looks up the file remotepath in the snapshot. if it's found, stat is set
+ * to its attributes and the revalidation of its directory is queued.
+ * returns 0 on success, -ENOENT if the file is not in the complete listing
+ * of its directory, that is younger than "-o negative_timeout" seconds, or
+ * -1 if the snapshot does not know the file. */
+int snapshot_lookup(const char *remotepath, struct stat *stat)
+{
+	assert(remotepath && stat);
+
+	/* without background jobs the data could not be revalidated */
+	if (snapshot_root == NULL || background_jobs == NULL)
+		return -1;
+
+	char *key = unify_path(remotepath, UNESCAPE);
+	if (key == NULL)
+		return -1;
+
+	/* split the path into the directory's key and the name */
+	char *slash = strrchr(key, '/');
+	if (slash == NULL || slash[1] == '\0') {
+		FREE(key);
+		return -1;
+	}
+	*slash = '\0';
+	const char *name = slash + 1;
+	if (!snapshot_in_mount(key)) {
+		FREE(key);
+		return -1;
+	}
+
+	int ret = -1;
+	pthread_mutex_lock(&snapshot_mutex);
+	guint32 record = snapshot_get(key, name);
+	guint32 mark = snapshot_get(key, "");
+	if (record < snapshot_count) {
+		if (!(snapshot_get_flags(record) & SNAPSHOT_STALE)) {
+			snapshot_get_stat(&snapshot_records[record], stat);
+			snapshot_hits++;
+			ret = 0;
+		}
+	} else if (mark < snapshot_count &&
+			!(snapshot_get_flags(mark) & SNAPSHOT_STALE) &&
+			snapshot_records[mark].seen + wdfs.negative_timeout > time(NULL)) {
+		snapshot_absent++;
+		ret = -ENOENT;
+	}
+	if (snapshot_check_damage() == true)
+		ret = -1;
+	pthread_mutex_unlock(&snapshot_mutex);
+
+	if (ret != -1) {
+		if (wdfs.debug == true)
+			fprintf(stderr, "** snapshot of '%s' %s '%s'\n", key,
+				ret == 0 ? "contains" : "does not contain", name);
+		snapshot_queue_refresh(key);
+	}
+	FREE(key);
+	return ret;
+}
+
+
+/* adds the members of the directory remotepath from the snapshot with the
+ * fuse filler method and queues the revalidation of the directory. returns
+ * 0 on success or -1 if the snapshot has no complete listing of it. */
+int snapshot_fill(const char *remotepath, void *buf, fuse_fill_dir_t filler)
+{
+	assert(remotepath && filler);
+
+	if (snapshot_root == NULL || background_jobs == NULL)
+		return -1;
+
+	char *key = unify_path(remotepath, UNESCAPE);
+	if (key == NULL)
+		return -1;
+	if (!snapshot_in_mount(key)) {
+		FREE(key);
+		return -1;
+	}
+
+	/* the names are checked, before the first one is added */
+	pthread_mutex_lock(&snapshot_mutex);
+	guint32 first = snapshot_get(key, "");
+	guint32 end = first;
+	if (first < snapshot_count &&
+			!(snapshot_get_flags(first) & SNAPSHOT_STALE)) {
+		for (end++; end < snapshot_count && !strcmp(
+				snapshot_string(snapshot_records[end].parent), key); end++)
+			snapshot_string(snapshot_records[end].name);
+	}
+	if (snapshot_check_damage() == true || first >= snapshot_count ||
+			(snapshot_get_flags(first) & SNAPSHOT_STALE)) {
+		pthread_mutex_unlock(&snapshot_mutex);
+		FREE(key);
+		return -1;
+	}
+
+	snapshot_listings++;
+	guint32 index;
+	for (index = first + 1; index < end; index++) {
+		const char *name = snapshot_string(snapshot_records[index].name);
+		struct stat stat;
+		snapshot_get_stat(&snapshot_records[index], &stat);
+		/* a file with a pending upload has the attributes of the local
+		 * version */
+		if (wdfs.write_behind == true) {
+			char *path = g_strconcat(key, "/", name, NULL);
+			upload_get_stat(&stat, path);
+			g_free(path);
+		}
+		if (filler(buf, name, &stat, 0))
+			fprintf(stderr, "## filler() error in %s()!\n", __func__);
+	}
+	pthread_mutex_unlock(&snapshot_mutex);
+
+	if (wdfs.debug == true)
+		fprintf(stderr, "** snapshot listing hit for '%s'\n", key);
+	snapshot_queue_refresh(key);
+	FREE(key);
+	return 0;
+}
+
+
+/* the record of the unified key is not used anymore, because newer data is
+ * known or the file was changed. */
+void snapshot_forget(const char *key)
+{
+	assert(key);
+
+	if (snapshot_root == NULL)
+		return;
+
+	const char *slash = strrchr(key, '/');
+	if (slash == NULL)
+		return;
+	char *parent = g_strndup(key, slash - key);
+
+	pthread_mutex_lock(&snapshot_mutex);
+	guint32 index = snapshot_get(parent, slash + 1);
+	if (index < snapshot_count)
+		snapshot_set_flags(index, SNAPSHOT_STALE);
+	snapshot_check_damage();
+	pthread_mutex_unlock(&snapshot_mutex);
+	g_free(parent);
+}
+
+
+/* the records of the directory with the unified key are not used anymore,
+ * because it was listed again or changed. */
+void snapshot_forget_directory(const char *key)
+{
+	assert(key);
+
+	if (snapshot_root == NULL)
+		return;
+
+	pthread_mutex_lock(&snapshot_mutex);
+	snapshot_mark_directory(key, SNAPSHOT_STALE);
+	snapshot_check_damage();
+	pthread_mutex_unlock(&snapshot_mutex);
+}
+
+
+/* the records of the directory with the unified key and of all directories
+ * below it are not used anymore, e.g. if the directory was moved. */
+void snapshot_forget_tree(const char *key)
+{
+	assert(key);
+
+	if (snapshot_root == NULL)
+		return;
+
+	size_t len = strlen(key);
+	pthread_mutex_lock(&snapshot_mutex);
+	guint32 i;
+	for (i = 0; i < snapshot_count; i++) {
+		const char *parent = snapshot_string(snapshot_records[i].parent);
+		if (!strncmp(parent, key, len) &&
+				(parent[len] == '\0' || parent[len] == '/'))
+			snapshot_set_flags(i, SNAPSHOT_STALE);
+	}
+	snapshot_check_damage();
+	pthread_mutex_unlock(&snapshot_mutex);
+}
+
+
+/* prints the statistics of the snapshot. */
+void snapshot_print_stats(FILE *stream)
+{
+	if (wdfs.metadata_cache == NULL)
+		return;
+
+	pthread_mutex_lock(&snapshot_mutex);
+	fprintf(stream, "snapshot: %lu records loaded, %lu getattr() answered, "
+		"%lu of them not existing, %lu readdir() answered\n",
+		snapshot_loaded, snapshot_hits + snapshot_absent, snapshot_absent,
+		snapshot_listings);
+	fprintf(stream, "snapshot: %lu directories revalidated, %lu failed, "
+		"%lu snapshots written\n", snapshot_refreshed,
+		snapshot_refresh_failed, snapshot_written);
+	pthread_mutex_unlock(&snapshot_mutex);
+}
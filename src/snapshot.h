@@ -0,0 +1,13 @@
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+void snapshot_initialize();
+void snapshot_destroy();
+int snapshot_lookup(const char *remotepath, struct stat *stat);
+int snapshot_fill(const char *remotepath, void *buf, fuse_fill_dir_t filler);
+void snapshot_forget(const char *key);
+void snapshot_forget_directory(const char *key);
+void snapshot_forget_tree(const char *key);
+void snapshot_print_stats(FILE *stream);
+
+#endif /*SNAPSHOT_H_*/
@@ -0,0 +1,305 @@
+/*
+ *  this file is part of wdfs --> http://noedler.de/projekte/wdfs/
+ *
+ *  wdfs is a webdav filesystem with special features for accessing subversion
+ *  repositories. it is based on fuse v2.5+ and neon v0.24.7+.
+ *
+ *  copyright (c) 2005 - 2007 jens m. noedler, noedler@web.de
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *  This program is released under the GPL with the additional exemption
+ *  that compiling, linking and/or using OpenSSL is allowed.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <glib.h>
+#include <ne_request.h>
+#include <ne_dates.h>
+
+#include "wdfs-main.h"
+#include "webdav.h"
+#include "async.h"
+#include "cache.h"
+#include "content.h"
+#include "spool.h"
+
+/* a test of the spool. it's only built with the cmake option WDFS_TESTS and
+ * run by ctest. the spool is linked without the rest of wdfs and without
+ * neon. the functions of neon, that the spool uses, are replaced by a fake
+ * server below, that answers range requests from remote_data. */
+
+/* the remote file */
+static char *remote_data = NULL;
+static off_t remote_size = 0;
+static unsigned long requests = 0;
+
+/* a request to the fake server */
+struct ne_request_s {
+	long long start, end;			/* the requested range */
+	ne_accept_response acceptor;
+	ne_block_reader reader;
+	void *userdata;
+	ne_status status;
+	char content_range[64];
+};
+
+static int session_dummy;
+
+
+/* +++++++ replacements of wdfs and neon +++++++ */
+
+
+struct wdfs_conf wdfs;
+struct async_pool *background_jobs = NULL;
+
+void free_chars(char **arg, ...)
+{
+	va_list ap;
+	va_start(ap, arg);
+	while (arg) {
+		FREE(*arg);
+		arg = va_arg(ap, char **);
+	}
+	va_end(ap);
+}
+
+int get_filehandle()
+{
+	char name[] = "/tmp/spool-test-XXXXXX";
+	int fh = mkstemp(name);
+	if (fh != -1)
+		unlink(name);
+	return fh;
+}
+
+int async_submit(
+	struct async_pool *pool, async_work_fn work, async_done_fn done, void *data)
+{
+	return -1;
+}
+
+int content_cache_filehandle()
+{
+	return -1;
+}
+
+void content_cache_remove(const char *remotepath)
+{
+}
+
+void cache_delete_item(const char *remotepath)
+{
+}
+
+ne_session* session_acquire()
+{
+	return (ne_session*)&session_dummy;
+}
+
+void session_release(ne_session *session)
+{
+}
+
+ne_request* ne_request_create(
+	ne_session *session, const char *method, const char *path)
+{
+	ne_request *req = g_new0(ne_request, 1);
+	req->start = 0;
+	req->end = remote_size - 1;
+	return req;
+}
+
+void ne_print_request_header(
+	ne_request *req, const char *name, const char *format, ...)
+{
+	char value[128];
+	va_list ap;
+	va_start(ap, format);
+	vsnprintf(value, sizeof(value), format, ap);
+	va_end(ap);
+	if (!strcmp(name, "Range"))
+		sscanf(value, "bytes=%lld-%lld", &req->start, &req->end);
+}
+
+void ne_add_request_header(ne_request *req, const char *name, const char *value)
+{
+}
+
+void ne_add_response_body_reader(ne_request *req,
+	ne_accept_response acceptor, ne_block_reader reader, void *userdata)
+{
+	req->acceptor = acceptor;
+	req->reader = reader;
+	req->userdata = userdata;
+}
+
+/* answers the range with 206 in chunks of 4 KiB */
+int ne_request_dispatch(ne_request *req)
+{
+	requests++;
+	if (req->end >= remote_size)
+		req->end = remote_size - 1;
+	req->status.code = 206;
+	req->status.klass = 2;
+	snprintf(req->content_range, sizeof(req->content_range),
+		"bytes %lld-%lld/%lld", req->start, req->end, (long long)remote_size);
+	if (req->acceptor(req->userdata, req, &req->status) == 0)
+		return NE_OK;
+
+	long long offset;
+	for (offset = req->start; offset <= req->end; offset += 4096) {
+		size_t len = (req->end + 1 - offset < 4096) ?
+			req->end + 1 - offset : 4096;
+		req->reader(req->userdata, remote_data + offset, len);
+	}
+	return NE_OK;
+}
+
+const ne_status* ne_get_status(const ne_request *req)
+{
+	return &req->status;
+}
+
+const char* ne_get_response_header(ne_request *req, const char *name)
+{
+	if (!strcmp(name, "Content-Range"))
+		return req->content_range;
+	if (!strcmp(name, "ETag"))
+		return "\"test\"";
+	return NULL;
+}
+
+void ne_request_destroy(ne_request *req)
+{
+	g_free(req);
+}
+
+void ne_set_error(ne_session *session, const char *format, ...)
+{
+}
+
+const char* ne_get_error(ne_session *session)
+{
+	return "fake server error";
+}
+
+time_t ne_rfc1123_parse(const char *date)
+{
+	return -1;
+}
+
+
+/* +++++++ local static methods +++++++ */
+
+
+static int failures = 0;
+
+static void check(bool_t ok, const char *test)
+{
+	printf("%s: %s\n", ok == true ? "ok" : "FAILED", test);
+	if (ok == false)
+		failures++;
+}
+
+
+/* creates a remote file of size bytes with data, that differs per byte */
+static void set_remote_file(off_t size)
+{
+	FREE(remote_data);
+	remote_data = (char*)malloc(size);
+	off_t i;
+	for (i = 0; i < size; i++)
+		remote_data[i] = 'a' + i % 23;
+	remote_size = size;
+}
+
+
+/* returns true, if the complete spool is the remote file with the data
+ * written at offset. the spool is fetched completely before, as for a PUT. */
+static bool_t spool_equals(
+	struct spool *spool, const char *data, size_t size, off_t offset)
+{
+	off_t expected_size = (offset + (off_t)size > remote_size) ?
+		offset + size : remote_size;
+	char *expected = (char*)calloc(expected_size, 1);
+	memcpy(expected, remote_data, remote_size);
+	memcpy(expected + offset, data, size);
+
+	char *actual = (char*)calloc(expected_size, 1);
+	bool_t ret = (spool_fetch_all(spool) == 0 &&
+		pread(spool->fh, actual, expected_size, 0) == expected_size &&
+		!memcmp(expected, actual, expected_size)) ? true : false;
+	free(expected);
+	free(actual);
+	return ret;
+}
+
+
+/* writes data at offset to a new spool of a remote file of remote bytes */
+static bool_t write_test(off_t remote, const char *data, off_t offset)
+{
+	set_remote_file(remote);
+	struct spool *spool = spool_new("/test", remote_size);
+	bool_t ret = (spool != NULL &&
+		spool_write(spool, data, strlen(data), offset) == (int)strlen(data) &&
+		spool_equals(spool, data, strlen(data), offset)) ? true : false;
+	spool_free(spool);
+	return ret;
+}
+
+
+int main(int argc, char *argv[])
+{
+	memset(&wdfs, 0, sizeof(wdfs));
+	wdfs.debug = false;
+	wdfs.readahead = 0;
+	wdfs.readahead_budget = 0;
+
+	/* the remote end is in the middle of the second block */
+	check(write_test(100000, "appended\n", 100000),
+		"append to a file, that ends in the middle of a block");
+	check(write_test(100000, "behind\n", 100010),
+		"write behind the end of a file in its last block");
+	check(write_test(100000, "over the end\n", 99995),
+		"write over the end of a file");
+	check(write_test(131072, "appended\n", 131072),
+		"append to a file, that ends with a complete block");
+	check(write_test(100000, "middle\n", 70000),
+		"write in the middle of a block");
+	check(write_test(100000, "across\n", 65533),
+		"write across two blocks");
+
+	/* the spool reads the data of the remote file */
+	set_remote_file(200000);
+	struct spool *spool = spool_new("/test", remote_size);
+	char buffer[1000];
+	check((spool_read(spool, buffer, sizeof(buffer), 99500) ==
+		sizeof(buffer) && !memcmp(buffer, remote_data + 99500,
+		sizeof(buffer))) ? true : false, "read across two blocks");
+	requests = 0;
+	spool_read(spool, buffer, sizeof(buffer), 99500);
+	check(requests == 0 ? true : false, "read present blocks again");
+	spool_free(spool);
+
+	FREE(remote_data);
+	printf("%d tests failed\n", failures);
+	return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,940 @@
+/* 
+ *  this file is part of wdfs --> http://noedler.de/projekte/wdfs/
+ *
+ *  wdfs is a webdav filesystem with special features for accessing subversion
+ *  repositories. it is based on fuse v2.5+ and neon v0.24.7+.
+ * 
+ *  copyright (c) 2005 - 2007 jens m. noedler, noedler@web.de
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *  This program is released under the GPL with the additional exemption
+ *  that compiling, linking and/or using OpenSSL is allowed.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <glib.h>
+#include <ne_request.h>
+#include <ne_dates.h>
+
+#include "wdfs-main.h"
+#include "webdav.h"
+#include "spool.h"
+#include "cache.h"
+#include "content.h"
+#include "async.h"
+
+/* open() does not download the complete file anymore. instead a spool file is
+ * created, that has the size of the remote file but contains no data (it's a
+ * sparse file). the spool is divided into blocks of spool_block_size bytes
+ * and a bitmap tracks, which blocks are present. read() and write() fetch the
+ * blocks they need with a http range request. before the file is put to the
+ * server all missing blocks are fetched.
+ * servers that ignore the range header send the complete file. in this case
+ * the data is written to all blocks that are not present and the spool is 
+ * complete afterwards. the first response's etag is sent as "If-Range" header
+ * with the following range requests. the etag and the last modification time
+ * of each response are compared with the spool's. if the file was changed at
+ * the server, the request fails instead of mixing old and new data. a 
+ * response, that ends before the requested range, fails too.
+ * the spool's mutex is not held while a request is running. the blocks of
+ * a running request are marked as "fetching" instead. others wait for these
+ * blocks on the condition "fetched".
+ * read-ahead: if a file is read sequentially, the following blocks are 
+ * fetched by background jobs before they are read. the read-ahead window
+ * starts with two blocks and is doubled with each sequential read up to
+ * wdfs.readahead kilobytes. a read at another offset resets the window. all
+ * running read-ahead requests together fetch at most wdfs.readahead_budget
+ * kilobytes, further read-ahead is skipped until some of them finished.
+ * unchanged data: before a present block is written the first time, the hash
+ * of its data is saved. spool_modified() compares the hashes with the data
+ * at the end, so files that were written with the same data again need not
+ * be uploaded. blocks written without being present can't be compared.
+ */
+
+
+/* size of a block in bytes. this value can be edit here. */
+static const off_t spool_block_size = 64 * 1024;
+
+/* state of a range request, used by the callbacks of spool_fetch_range() */
+struct range_request {
+	struct spool *spool;
+	off_t start;			/* first byte requested */
+	off_t offset;			/* offset of the next byte of the response */
+	int error;				/* set to errno, if writing to the spool failed */
+	bool_t changed;			/* the remote file differs from the spool's */
+	size_t first, last;		/* blocks requested and marked as fetching */
+	std::vector<size_t> claimed;	/* other blocks written by this request */
+};
+
+/* a read-ahead job, see spool_readahead() */
+struct readahead_job {
+	struct spool *spool;
+	off_t offset;
+	off_t size;
+};
+
+/* bytes of all running read-ahead jobs and statistics */
+static off_t readahead_in_flight = 0;
+static unsigned long readahead_jobs = 0, readahead_skipped = 0;
+static unsigned long long readahead_bytes = 0;
+static pthread_mutex_t readahead_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* +++++++ local static methods +++++++ */
+
+
+/* marks the blocks first to last as present */
+static void spool_set_present(struct spool *spool, size_t first, size_t last)
+{
+	size_t block;
+	for (block = first; block <= last && block < spool->present.size(); block++) {
+		if (spool->present[block] == false) {
+			spool->present[block] = true;
+			spool->missing--;
+		}
+	}
+}
+
+
+/* returns true if the block is written by this request */
+static bool_t range_owns_block(struct range_request *range, size_t block)
+{
+	if (block >= range->first && block <= range->last)
+		return true;
+	return (!range->claimed.empty() && range->claimed.back() == block);
+}
+
+
+/* this method is called by neon after the response headers were read. it sets
+ * the offset of the response's data and saves the etag. the body of a changed
+ * remote file is not accepted. */
+static int spool_accept_response(
+	void *userdata, ne_request *req, const ne_status *status)
+{
+	struct range_request *range = (struct range_request*)userdata;
+	struct spool *spool = range->spool;
+
+	if (status->klass != 2)
+		return 0;
+
+	/* the server ignored the range header and sends the complete file */
+	range->offset = (status->code == 206) ? range->start : 0;
+
+#if NEON_VERSION >= 26
+	const char *content_range = ne_get_response_header(req, "Content-Range");
+	long long first;
+	if (status->code == 206 && content_range != NULL &&
+			sscanf(content_range, "bytes %lld-", &first) == 1)
+		range->offset = first;
+
+	/* weak etags are compared, too. they change with the content. */
+	const char *etag = ne_get_response_header(req, "ETag");
+	const char *lastmodified = ne_get_response_header(req, "Last-Modified");
+	time_t mtime = lastmodified ? ne_rfc1123_parse(lastmodified) : -1;
+	pthread_mutex_lock(&spool->mutex);
+	if (etag != NULL && spool->etag != NULL && strcmp(etag, spool->etag))
+		range->changed = true;
+	if (mtime > 0 && spool->mtime != 0 && mtime != spool->mtime)
+		range->changed = true;
+	if (etag != NULL && spool->etag == NULL && range->changed == false)
+		spool->etag = strdup(etag);
+	pthread_mutex_unlock(&spool->mutex);
+#endif
+
+	return (range->changed == true) ? 0 : 1;
+}
+
+
+/* this method is called by neon for each block of the response body. the data
+ * is written to the spool, but only to the blocks of this request. blocks 
+ * outside of the requested range (the server sent the complete file) are 
+ * claimed by this request, if they are neither present nor fetching. data of
+ * present blocks may be modified by write() and must not be overwritten. */
+#if NEON_VERSION >= 26
+static int spool_body_reader(void *userdata, const char *buf, size_t len)
+#else
+static void spool_body_reader(void *userdata, const char *buf, size_t len)
+#endif
+{
+	struct range_request *range = (struct range_request*)userdata;
+	struct spool *spool = range->spool;
+
+	pthread_mutex_lock(&spool->mutex);
+	while (len > 0 && range->error == 0) {
+		size_t block = range->offset / spool_block_size;
+		off_t block_end = (block + 1) * spool_block_size;
+		size_t chunk = len;
+		if (range->offset + (off_t)chunk > block_end)
+			chunk = block_end - range->offset;
+
+		/* data behind the used part of the remote file is ignored */
+		if (range->offset >= spool->remote_size)
+			break;
+		if (range->offset + (off_t)chunk > spool->remote_size)
+			chunk = spool->remote_size - range->offset;
+
+		if (range->offset % spool_block_size == 0 && 
+				range_owns_block(range, block) == false &&
+				spool->present[block] == false && 
+				spool->fetching[block] == false) {
+			spool->fetching[block] = true;
+			range->claimed.push_back(block);
+		}
+
+		if (range_owns_block(range, block) == true) {
+			if (pwrite(spool->fh, buf, chunk, range->offset) != (ssize_t)chunk)
+				range->error = errno ? errno : EIO;
+		}
+
+		buf += chunk;
+		len -= chunk;
+		range->offset += chunk;
+	}
+	pthread_mutex_unlock(&spool->mutex);
+
+#if NEON_VERSION >= 26
+	return range->error ? -1 : 0;
+#endif
+}
+
+
+/* marks the block as no longer fetching. if it was received completely, it's
+ * marked as present. the spool's mutex must be held. */
+static void range_release_block(
+	struct range_request *range, size_t block, bool_t success)
+{
+	struct spool *spool = range->spool;
+	if (block >= spool->present.size())
+		return;
+
+	spool->fetching[block] = false;
+	off_t block_end = (block + 1) * spool_block_size;
+	if (success == true && 
+			(range->offset >= block_end || range->offset >= spool->remote_size))
+		spool_set_present(spool, block, block);
+}
+
+
+/* fetches the blocks first to last from the server. the spool's mutex must be
+ * held, but it's released during the request. the blocks must neither be
+ * present nor fetching. returns 0 on success or -EIO on error. */
+static int spool_fetch_range(struct spool *spool, size_t first, size_t last)
+{
+	off_t start = first * spool_block_size;
+	off_t end = (last + 1) * spool_block_size;
+	if (end > spool->remote_size)
+		end = spool->remote_size;
+	if (start >= end)
+		return 0;
+
+	if (wdfs.debug == true)
+		fprintf(stderr, "** fetching bytes %lld-%lld of '%s'\n",
+			(long long)start, (long long)end - 1, spool->remotepath);
+
+	struct range_request range;
+	range.spool = spool;
+	range.start = range.offset = start;
+	range.error = 0;
+	range.changed = false;
+	range.first = first;
+	range.last = last;
+
+	size_t block;
+	for (block = first; block <= last; block++)
+		spool->fetching[block] = true;
+	spool->fetches++;
+
+	char *etag = spool->etag ? strdup(spool->etag) : NULL;
+	pthread_mutex_unlock(&spool->mutex);
+
+	pooled_session session;
+	if (session == NULL) {
+		FREE(etag);
+		pthread_mutex_lock(&spool->mutex);
+		for (block = first; block <= last; block++)
+			range_release_block(&range, block, false);
+		spool->fetches--;
+		pthread_cond_broadcast(&spool->fetched);
+		return -EIO;
+	}
+	ne_request *req = ne_request_create(session, "GET", spool->remotepath);
+	ne_print_request_header(req, "Range", "bytes=%lld-%lld",
+		(long long)start, (long long)end - 1);
+	/* a weak etag must not be used with If-Range */
+	if (etag != NULL && strncmp(etag, "W/", 2))
+		ne_add_request_header(req, "If-Range", etag);
+	ne_add_response_body_reader(
+		req, spool_accept_response, spool_body_reader, &range);
+
+	int ret = ne_request_dispatch(req);
+	const ne_status *status = ne_get_status(req);
+	if (ret == NE_OK && status->klass != 2) {
+		ne_set_error(session, "%d %s", status->code, status->reason_phrase);
+		ret = NE_ERROR;
+	}
+
+	bool_t success = (ret == NE_OK && range.error == 0) ? true : false;
+	if (success == false)
+		fprintf(stderr, "## GET error: %s\n", 
+			range.error ? strerror(range.error) : ne_get_error(session));
+	else if (range.changed == true)
+		fprintf(stderr, "## GET error: '%s' was changed on the server, "
+			"it must be opened again.\n", spool->remotepath);
+	else if (status->code != 206 && wdfs.debug == true)
+		fprintf(stderr, "** server ignored the range, got the complete "
+			"file '%s'\n", spool->remotepath);
+	ne_request_destroy(req);
+	FREE(etag);
+
+	/* the next open() must not use the old attributes or data */
+	if (range.changed == true) {
+		success = false;
+		cache_delete_item(spool->remotepath);
+		content_cache_remove(spool->remotepath);
+	}
+
+	/* the response's data is now in the spool. the last block may be
+	 * incomplete if it's the end of the file. a shorter response is an 
+	 * error, the missing blocks would be read as zeros. */
+	pthread_mutex_lock(&spool->mutex);
+	if (success == true && range.offset < end && 
+			range.offset < spool->remote_size) {
+		fprintf(stderr, "## GET error: the response for '%s' ended at byte "
+			"%lld\n", spool->remotepath, (long long)range.offset);
+		success = false;
+	}
+	for (block = first; block <= last; block++)
+		range_release_block(&range, block, success);
+	std::vector<size_t>::iterator claimed;
+	for (claimed = range.claimed.begin(); 
+			claimed != range.claimed.end(); claimed++)
+		range_release_block(&range, *claimed, success);
+	spool->fetches--;
+	pthread_cond_broadcast(&spool->fetched);
+
+	return (success == true) ? 0 : -EIO;
+}
+
+
+/* fetches all missing blocks of the byte range offset to offset + size.
+ * blocks fetched by others are waited for, if wait is true, otherwise they
+ * are skipped. the spool's mutex must be held. returns 0 on success or -EIO
+ * on error. */
+static int spool_fetch(
+	struct spool *spool, off_t offset, off_t size, bool_t wait)
+{
+	if (spool->missing == 0 || size == 0 || offset >= spool->remote_size)
+		return 0;
+
+	size_t first = offset / spool_block_size;
+	size_t last = (offset + size - 1) / spool_block_size;
+
+	/* fetch each run of missing blocks with a single request. the size of
+	 * the spool may change while the mutex is released. */
+	size_t block = first;
+	while (block <= last && block < spool->present.size()) {
+		if (spool->present[block] == true) {
+			block++;
+			continue;
+		}
+		if (spool->fetching[block] == true) {
+			if (wait == true)
+				pthread_cond_wait(&spool->fetched, &spool->mutex);
+			else
+				block++;
+			continue;
+		}
+		size_t run_end = block;
+		while (run_end + 1 <= last && run_end + 1 < spool->present.size() &&
+				spool->present[run_end + 1] == false && 
+				spool->fetching[run_end + 1] == false)
+			run_end++;
+		if (spool_fetch_range(spool, block, run_end))
+			return -EIO;
+		block = run_end + 1;
+	}
+	return 0;
+}
+
+
+/* waits until no block of the byte range offset to offset + size is fetching.
+ * the spool's mutex must be held. */
+static void spool_wait_fetched(struct spool *spool, off_t offset, off_t size)
+{
+	size_t first = offset / spool_block_size;
+	size_t last = (offset + size - 1) / spool_block_size;
+	size_t block = first;
+	while (block <= last && block < spool->fetching.size()) {
+		if (spool->fetching[block] == true)
+			pthread_cond_wait(&spool->fetched, &spool->mutex);
+		else
+			block++;
+	}
+}
+
+
+/* the work of a read-ahead job */
+static int spool_readahead_work(void *data)
+{
+	struct readahead_job *job = (struct readahead_job*)data;
+	struct spool *spool = job->spool;
+
+	pthread_mutex_lock(&spool->mutex);
+	int ret = 0;
+	if (spool->closing == false)
+		ret = spool_fetch(spool, job->offset, job->size, false);
+	pthread_mutex_unlock(&spool->mutex);
+	return ret;
+}
+
+
+/* called after a read-ahead job. spool_free() waits for this. */
+static void spool_readahead_done(void *data, int)
+{
+	struct readahead_job *job = (struct readahead_job*)data;
+	struct spool *spool = job->spool;
+
+	pthread_mutex_lock(&readahead_mutex);
+	readahead_in_flight -= job->size;
+	pthread_mutex_unlock(&readahead_mutex);
+
+	pthread_mutex_lock(&spool->mutex);
+	spool->readaheads--;
+	pthread_cond_broadcast(&spool->fetched);
+	pthread_mutex_unlock(&spool->mutex);
+	FREE(job);
+}
+
+
+/* detects sequential reads and starts a read-ahead job for the blocks behind
+ * the read. the spool's mutex must be held. */
+static void spool_readahead(struct spool *spool, off_t offset, size_t size)
+{
+	const off_t max_window = (off_t)wdfs.readahead * 1024;
+	off_t end = offset + size;
+
+	/* a read at another offset than the end of the last read is random */
+	bool_t sequential = (offset == spool->ra_next) ? true : false;
+	spool->ra_next = end;
+	if (sequential == false) {
+		spool->ra_window = 0;
+		spool->ra_end = 0;
+		return;
+	}
+
+	if (max_window <= 0 || background_jobs == NULL || spool->missing == 0)
+		return;
+
+	/* grow the window like the kernel does, start with two blocks */
+	if (spool->ra_window == 0)
+		spool->ra_window = 2 * spool_block_size;
+	else if (spool->ra_window < max_window)
+		spool->ra_window *= 2;
+	if (spool->ra_window > max_window)
+		spool->ra_window = max_window;
+
+	/* start the next job, if the reader consumed half of the window */
+	if (spool->ra_end < end)
+		spool->ra_end = end;
+	if (spool->ra_end - end > spool->ra_window / 2)
+		return;
+
+	off_t ra_start = spool->ra_end;
+	off_t ra_size = end + spool->ra_window - ra_start;
+	if (ra_start + ra_size > spool->remote_size)
+		ra_size = spool->remote_size - ra_start;
+	if (ra_size <= 0)
+		return;
+
+	/* respect the budget of all running read-ahead jobs */
+	pthread_mutex_lock(&readahead_mutex);
+	bool_t allowed = (readahead_in_flight + ra_size <= 
+		(off_t)wdfs.readahead_budget * 1024) ? true : false;
+	if (allowed == true) {
+		readahead_in_flight += ra_size;
+		readahead_jobs++;
+		readahead_bytes += ra_size;
+	} else {
+		readahead_skipped++;
+	}
+	pthread_mutex_unlock(&readahead_mutex);
+	if (allowed == false)
+		return;
+
+	struct readahead_job *job = g_new0(struct readahead_job, 1);
+	job->spool = spool;
+	job->offset = ra_start;
+	job->size = ra_size;
+	spool->readaheads++;
+	if (async_submit(background_jobs, 
+			spool_readahead_work, spool_readahead_done, job)) {
+		spool->readaheads--;
+		pthread_mutex_lock(&readahead_mutex);
+		readahead_in_flight -= ra_size;
+		pthread_mutex_unlock(&readahead_mutex);
+		FREE(job);
+		return;
+	}
+	spool->ra_end = ra_start + ra_size;
+}
+
+
+/* adds the data to a 64 bit hash. it's not a cryptographic hash, but good 
+ * enough to detect modified data and fast. all but the last call must pass
+ * a multiple of 8 bytes. */
+static guint64 spool_hash(guint64 hash, const char *buf, size_t len)
+{
+	const guint64 prime = G_GUINT64_CONSTANT(0x9E3779B97F4A7C15);
+	guint64 word;
+
+	while (len >= sizeof(word)) {
+		memcpy(&word, buf, sizeof(word));
+		hash = (hash ^ (word * prime)) * prime;
+		hash ^= hash >> 29;
+		buf += sizeof(word);
+		len -= sizeof(word);
+	}
+	if (len > 0) {
+		word = 0;
+		memcpy(&word, buf, len);
+		hash = (hash ^ (word * prime)) * prime;
+	}
+	return hash;
+}
+
+
+/* computes the hash of the data of a block, that belongs to the remote file.
+ * returns 0 on success or -1 on error. */
+static int spool_block_hash(struct spool *spool, size_t block, guint64 *hash)
+{
+	off_t start = block * spool_block_size;
+	off_t len = spool->base_size - start;
+	if (len > spool_block_size)
+		len = spool_block_size;
+	if (len <= 0)
+		return -1;
+
+	char buffer[8192];
+	*hash = len;
+	off_t offset = 0;
+	while (offset < len) {
+		ssize_t chunk = sizeof(buffer);
+		if (chunk > len - offset)
+			chunk = len - offset;
+		if (pread(spool->fh, buffer, chunk, start + offset) != chunk)
+			return -1;
+		*hash = spool_hash(*hash, buffer, chunk);
+		offset += chunk;
+	}
+	*hash ^= *hash >> 32;
+	return 0;
+}
+
+
+/* initializes the members of a new spool with size bytes */
+static void spool_init(struct spool *spool, int fh, 
+	const char *remotepath, off_t size, bool_t present)
+{
+	size_t blocks = (size + spool_block_size - 1) / spool_block_size;
+	spool->fh = fh;
+	spool->remotepath = strdup(remotepath);
+	spool->remote_size = size;
+	spool->missing = (present == true) ? 0 : blocks;
+	spool->present.assign(blocks, present);
+	spool->fetching.assign(blocks, false);
+	spool->dirty.assign(blocks, false);
+	spool->hashed.assign(blocks, false);
+	spool->hash.assign(blocks, 0);
+	spool->base_size = size;
+	spool->truncated = false;
+	spool->fetches = 0;
+	spool->etag = NULL;
+	spool->mtime = 0;
+	spool->cached = false;
+	spool->readonly = false;
+	spool->ra_next = 0;
+	spool->ra_window = 0;
+	spool->ra_end = 0;
+	spool->readaheads = 0;
+	spool->closing = false;
+	pthread_mutex_init(&spool->mutex, NULL);
+	pthread_cond_init(&spool->fetched, NULL);
+}
+
+
+/* +++++++ exported non-static methods +++++++ */
+
+
+/* creates a new spool for the remote file with the given size. no data is 
+ * fetched yet. returns the spool on success or NULL on error. */
+struct spool* spool_new(const char *remotepath, off_t remote_size)
+{
+	assert(remotepath);
+
+	/* the spool file is created in the content cache's directory if 
+	 * possible. so it may be added to the content cache without copying. */
+	int fh = content_cache_filehandle();
+	if (fh == -1)
+		fh = get_filehandle();
+	if (fh == -1)
+		return NULL;
+
+	/* the spool file has the size of the remote file, but uses no space */
+	if (ftruncate(fh, remote_size)) {
+		fprintf(stderr, "## ftruncate() error: %s\n", strerror(errno));
+		close(fh);
+		return NULL;
+	}
+
+	struct spool *spool = new struct spool;
+	spool_init(spool, fh, remotepath, remote_size, false);
+	return spool;
+}
+
+
+/* creates a new spool from the filehandle, that already contains the data of
+ * the remote file. the spool owns the filehandle. returns the new spool. */
+struct spool* spool_new_complete(
+	const char *remotepath, int fh, off_t size, const char *etag)
+{
+	assert(remotepath && fh != -1);
+
+	struct spool *spool = new struct spool;
+	spool_init(spool, fh, remotepath, size, true);
+	spool->etag = etag ? strdup(etag) : NULL;
+	return spool;
+}
+
+
+/* waits for the read-ahead jobs, closes the spool file and frees the spool. */
+void spool_free(struct spool *spool)
+{
+	if (spool == NULL)
+		return;
+
+	pthread_mutex_lock(&spool->mutex);
+	spool->closing = true;
+	while (spool->readaheads > 0)
+		pthread_cond_wait(&spool->fetched, &spool->mutex);
+	pthread_mutex_unlock(&spool->mutex);
+
+	close(spool->fh);
+	free_chars(&spool->remotepath, &spool->etag, NULL);
+	pthread_cond_destroy(&spool->fetched);
+	pthread_mutex_destroy(&spool->mutex);
+	delete spool;
+}
+
+
+/* reads size bytes at offset to buf. missing blocks are fetched before.
+ * returns the number of bytes read or -EIO on error. */
+int spool_read(struct spool *spool, char *buf, size_t size, off_t offset)
+{
+	pthread_mutex_lock(&spool->mutex);
+	spool_readahead(spool, offset, size);
+	int ret = spool_fetch(spool, offset, size, true);
+	pthread_mutex_unlock(&spool->mutex);
+	if (ret)
+		return ret;
+
+	ret = pread(spool->fh, buf, size, offset);
+	if (ret < 0) {
+		fprintf(stderr, "## pread() error: %d\n", ret);
+		return -EIO;
+	}
+	return ret;
+}
+
+
+/* writes size bytes of buf at offset. the blocks that are only partly written
+ * are fetched before, blocks that are completely overwritten not. returns the
+ * number of bytes written or -EIO on error. */
+int spool_write(struct spool *spool, const char *buf, size_t size, off_t offset)
+{
+	if (size == 0)
+		return 0;
+
+	pthread_mutex_lock(&spool->mutex);
+
+	off_t end = offset + size;
+	size_t first = offset / spool_block_size;
+	size_t last = (end - 1) / spool_block_size;
+
+	/* fetch the first and the last block, if they are only partly written
+	 * and contain remote data. they are fetched by their start, an append
+	 * behind the remote end may start in the partly filled last block. */
+	off_t first_start = first * spool_block_size;
+	off_t last_start = last * spool_block_size;
+	if ((offset % spool_block_size != 0 && first_start < spool->remote_size &&
+			spool_fetch(spool, first_start, 1, true)) ||
+			(end % spool_block_size != 0 && end < spool->remote_size &&
+			 spool_fetch(spool, last_start, 1, true))) {
+		pthread_mutex_unlock(&spool->mutex);
+		return -EIO;
+	}
+
+	/* a running request must not overwrite the new data */
+	spool_wait_fetched(spool, offset, size);
+
+	/* save the hashes of the remote data, that is overwritten now */
+	size_t block;
+	for (block = first; block <= last && block < spool->present.size(); 
+			block++) {
+		if (spool->present[block] == true && spool->hashed[block] == false &&
+				(block >= spool->dirty.size() || spool->dirty[block] == false)
+				&& spool_block_hash(spool, block, &spool->hash[block]) == 0)
+			spool->hashed[block] = true;
+	}
+
+	int ret = pwrite(spool->fh, buf, size, offset);
+	if (ret < 0) {
+		fprintf(stderr, "## pwrite() error: %d\n", ret);
+		pthread_mutex_unlock(&spool->mutex);
+		return -EIO;
+	}
+
+	/* the written blocks contain valid data now and must be uploaded */
+	spool_set_present(spool, first, last);
+	if (spool->dirty.size() <= last)
+		spool->dirty.resize(last + 1, false);
+	for (block = first; block <= last; block++)
+		spool->dirty[block] = true;
+
+	pthread_mutex_unlock(&spool->mutex);
+	return ret;
+}
+
+
+/* truncates the spool to size bytes. the blocks in front of size keep their 
+ * state, data behind size is no longer fetched. returns 0 or -EIO on error. */
+int spool_truncate(struct spool *spool, off_t size)
+{
+	pthread_mutex_lock(&spool->mutex);
+
+	/* the block, that contains the new end, is partly cut off */
+	if (size % spool_block_size != 0 && 
+			spool_fetch(spool, size - 1, 1, true)) {
+		pthread_mutex_unlock(&spool->mutex);
+		return -EIO;
+	}
+
+	/* the blocks must not change while requests are running */
+	while (spool->fetches > 0)
+		pthread_cond_wait(&spool->fetched, &spool->mutex);
+
+	if (ftruncate(spool->fh, size)) {
+		fprintf(stderr, "## ftruncate() error: %s\n", strerror(errno));
+		pthread_mutex_unlock(&spool->mutex);
+		return -EIO;
+	}
+
+	/* a partial upload can't shrink the remote file */
+	if (size < spool->base_size)
+		spool->truncated = true;
+	size_t dirty_blocks = (size + spool_block_size - 1) / spool_block_size;
+	if (spool->dirty.size() > dirty_blocks)
+		spool->dirty.resize(dirty_blocks);
+
+	/* blocks behind the new size contain zeros, if the file grows again */
+	if (size < spool->remote_size) {
+		spool->remote_size = size;
+		size_t blocks = (size + spool_block_size - 1) / spool_block_size;
+		size_t block;
+		for (block = blocks; block < spool->present.size(); block++) {
+			if (spool->present[block] == false)
+				spool->missing--;
+		}
+		spool->present.resize(blocks);
+		spool->fetching.resize(blocks);
+	}
+
+	pthread_mutex_unlock(&spool->mutex);
+	return 0;
+}
+
+
+/* fetches all missing blocks, e.g. before the file is put to the server.
+ * returns 0 on success or -EIO on error. */
+int spool_fetch_all(struct spool *spool)
+{
+	pthread_mutex_lock(&spool->mutex);
+	int ret = spool_fetch(spool, 0, spool->remote_size, true);
+	pthread_mutex_unlock(&spool->mutex);
+	return ret;
+}
+
+
+/* replaces the spool file by a writable copy, if the spool uses the read-only
+ * file of the content cache. the spool may be used by other threads, their 
+ * filehandle is replaced atomically by dup2(). returns 0 or -EIO on error. */
+int spool_make_writable(struct spool *spool)
+{
+	pthread_mutex_lock(&spool->mutex);
+	if (spool->readonly == false) {
+		pthread_mutex_unlock(&spool->mutex);
+		return 0;
+	}
+
+	int fh = content_cache_filehandle();
+	if (fh == -1)
+		fh = get_filehandle();
+
+	char buffer[64 * 1024];
+	off_t offset = 0;
+	while (fh != -1 && offset < spool->remote_size) {
+		ssize_t chunk = pread(spool->fh, buffer, sizeof(buffer), offset);
+		if (chunk <= 0 || pwrite(fh, buffer, chunk, offset) != chunk) {
+			fprintf(stderr, "## could not copy the spool file\n");
+			close(fh);
+			fh = -1;
+		}
+		offset += chunk;
+	}
+
+	int ret = -EIO;
+	if (fh != -1 && dup2(fh, spool->fh) != -1) {
+		spool->readonly = false;
+		ret = 0;
+	}
+	if (fh != -1)
+		close(fh);
+	pthread_mutex_unlock(&spool->mutex);
+	return ret;
+}
+
+
+/* called after the spool was put to the server. the spool contains the data
+ * of the remote file now, so it has no dirty blocks and every block is 
+ * present. the etag and the time of the new remote file are unknown. */
+void spool_uploaded(struct spool *spool)
+{
+	pthread_mutex_lock(&spool->mutex);
+
+	struct stat stat;
+	if (fstat(spool->fh, &stat) == 0) {
+		size_t blocks = (stat.st_size + spool_block_size - 1) / spool_block_size;
+		spool->remote_size = stat.st_size;
+		spool->base_size = stat.st_size;
+		spool->present.resize(blocks, true);
+		spool->fetching.resize(blocks, false);
+		spool->hash.resize(blocks, 0);
+	}
+	spool->truncated = false;
+	spool->dirty.assign(spool->dirty.size(), false);
+	spool->hashed.assign(spool->hash.size(), false);
+	FREE(spool->etag);
+	spool->mtime = 0;
+
+	pthread_mutex_unlock(&spool->mutex);
+}
+
+
+/* compares the modified blocks with the hashes of their remote data. blocks 
+ * that contain the remote data again are no longer dirty. the spool must not
+ * be written meanwhile. returns true if the spool differs from the remote 
+ * file or false if it contains the same data. */
+bool_t spool_modified(struct spool *spool)
+{
+	pthread_mutex_lock(&spool->mutex);
+	if (spool->truncated == true) {
+		pthread_mutex_unlock(&spool->mutex);
+		return true;
+	}
+
+	struct stat stat;
+	bool_t modified = 
+		(fstat(spool->fh, &stat) || stat.st_size != spool->base_size);
+
+	size_t block;
+	for (block = 0; block < spool->dirty.size(); block++) {
+		if (spool->dirty[block] == false)
+			continue;
+		guint64 hash;
+		if (block < spool->hashed.size() && spool->hashed[block] == true &&
+				spool_block_hash(spool, block, &hash) == 0 &&
+				hash == spool->hash[block])
+			spool->dirty[block] = false;
+		else
+			modified = true;
+	}
+	pthread_mutex_unlock(&spool->mutex);
+	return modified;
+}
+
+
+/* gets the byte ranges, that differ from the remote file: the blocks modified
+ * by write() and the part behind the remote file's end, if the file grew. 
+ * adjacent ranges are merged. the spool must not be written meanwhile. 
+ * returns 0 on success or -1 if the file was truncated or on error. */
+int spool_dirty_ranges(
+	struct spool *spool, std::vector<struct spool_range> &ranges)
+{
+	ranges.clear();
+	pthread_mutex_lock(&spool->mutex);
+	struct stat stat;
+	if (spool->truncated == true || fstat(spool->fh, &stat)) {
+		pthread_mutex_unlock(&spool->mutex);
+		return -1;
+	}
+	off_t size = stat.st_size;
+
+	size_t blocks = (size + spool_block_size - 1) / spool_block_size;
+	size_t block;
+	for (block = 0; block < blocks; block++) {
+		off_t start = block * spool_block_size;
+		off_t end = start + spool_block_size;
+		if (end > size)
+			end = size;
+
+		/* of a block that was not written, only the grown part is sent */
+		if (block >= spool->dirty.size() || spool->dirty[block] == false) {
+			if (end <= spool->base_size)
+				continue;
+			if (start < spool->base_size)
+				start = spool->base_size;
+		}
+
+		if (!ranges.empty() && 
+				ranges.back().start + ranges.back().length >= start) {
+			ranges.back().length = end - ranges.back().start;
+		} else {
+			struct spool_range range;
+			range.start = start;
+			range.length = end - start;
+			ranges.push_back(range);
+		}
+	}
+	pthread_mutex_unlock(&spool->mutex);
+	return 0;
+}
+
+
+/* prints the statistics of the read-ahead. */
+void spool_print_stats(FILE *stream)
+{
+	pthread_mutex_lock(&readahead_mutex);
+	fprintf(stream, "read-ahead: %lu jobs, %llu bytes, %lu skipped (budget)\n",
+		readahead_jobs, readahead_bytes, readahead_skipped);
+	pthread_mutex_unlock(&readahead_mutex);
+}
@@ -0,0 +1,54 @@
+#ifndef SPOOL_H_
+#define SPOOL_H_
+
+#include <vector>
+
+/* the local copy of a remote file. see spool.cpp for details. */
+struct spool {
+	int fh;					/* filehandle of the sparse spool file */
+	char *remotepath;		/* escaped remotepath of the remote file */
+	off_t remote_size;		/* bytes of the remote file, that are used */
+	std::vector<bool> present;	/* per block: data is in the spool file */
+	std::vector<bool> fetching;	/* per block: a request is running */
+	std::vector<bool> dirty;	/* per block: modified by write() */
+	std::vector<bool> hashed;	/* per block: hash holds the remote data's hash */
+	std::vector<guint64> hash;	/* per block: hash before the first write() */
+	off_t base_size;		/* size of the remote file at open() */
+	bool_t truncated;		/* the file was truncated below base_size */
+	size_t missing;			/* number of blocks, that are not present */
+	int fetches;			/* number of running requests */
+	char *etag;				/* etag of the fetched data or NULL */
+	time_t mtime;			/* last modification time of the remote file */
+	bool_t cached;			/* data was taken from the content cache */
+	bool_t readonly;		/* fh is the content cache's read-only file */
+	off_t ra_next;			/* read-ahead: offset of a sequential read */
+	off_t ra_window;		/* read-ahead: current size of the window */
+	off_t ra_end;			/* read-ahead: end of the requested data */
+	int readaheads;			/* read-ahead: number of queued jobs */
+	bool_t closing;			/* set by spool_free(), cancels read-ahead */
+	pthread_mutex_t mutex;
+	pthread_cond_t fetched;	/* signaled if requests or jobs finished */
+};
+
+/* a modified byte range of a spool */
+struct spool_range {
+	off_t start;
+	off_t length;
+};
+
+struct spool* spool_new(const char *remotepath, off_t remote_size);
+struct spool* spool_new_complete(
+	const char *remotepath, int fh, off_t size, const char *etag);
+void spool_free(struct spool *spool);
+
+int spool_read(struct spool *spool, char *buf, size_t size, off_t offset);
+int spool_write(struct spool *spool, const char *buf, size_t size, off_t offset);
+int spool_truncate(struct spool *spool, off_t size);
+int spool_fetch_all(struct spool *spool);
+int spool_make_writable(struct spool *spool);
+void spool_uploaded(struct spool *spool);
+bool_t spool_modified(struct spool *spool);
+int spool_dirty_ranges(struct spool *spool, std::vector<struct spool_range> &ranges);
+void spool_print_stats(FILE *stream);
+
+#endif /*SPOOL_H_*/
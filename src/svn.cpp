@@ -145,6 +145,9 @@ static void svn_get_latest_revision_callback(
 static int svn_get_latest_revision()
 {
 	int latest_revision;
+	pooled_session session;
+	if (session == NULL)
+		return -1;
 	char *uri = ne_concat(svn_repository_root, "!svn/vcc/default", NULL);
 	ne_propfind_handler *pfh = ne_propfind_create(session, uri, NE_DEPTH_ZERO);
 	int ret = ne_propfind_named(pfh, property_checked_in,
@@ -225,6 +228,9 @@ int svn_set_repository_root()
 		return 0;
 	}
 
+	pooled_session session;
+	if (session == NULL)
+		return -1;
 	ne_propfind_handler *pfh = 
 		ne_propfind_create(session, remotepath_basedir, NE_DEPTH_ZERO);
 	int ret = ne_propfind_named(pfh, property_vcc, 
@@ -0,0 +1,502 @@
+/* 
+ *  this file is part of wdfs --> http://noedler.de/projekte/wdfs/
+ *
+ *  wdfs is a webdav filesystem with special features for accessing subversion
+ *  repositories. it is based on fuse v2.5+ and neon v0.24.7+.
+ * 
+ *  copyright (c) 2005 - 2007 jens m. noedler, noedler@web.de
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *  This program is released under the GPL with the additional exemption
+ *  that compiling, linking and/or using OpenSSL is allowed.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <glib.h>
+#include <ne_basic.h>
+#include <ne_request.h>
+#include <vector>
+
+#include "wdfs-main.h"
+#include "webdav.h"
+#include "cache.h"
+#include "dircache.h"
+#include "content.h"
+#include "spool.h"
+#include "async.h"
+#include "upload.h"
+
+/* write-behind: if wdfs.write_behind is set, release() does not put modified
+ * files to the server itself. instead the spool is handed to the upload pool
+ * and release() returns immediately. the pool has wdfs.upload_threads threads
+ * and at most wdfs.upload_queue uploads are pending, further release() calls
+ * wait for a free slot.
+ * until the upload is finished, getattr() and readdir() report the attributes
+ * of the local version of the file. open(), fsync(), truncate(), unlink() and
+ * rename() wait for the pending uploads of the file and unmount waits for all
+ * uploads.
+ * uploads of the same file are done in the order of release(). an upload is 
+ * skipped, if a newer one of the same file is pending, because the newer one
+ * overwrites it anyway. errors can't be reported to the application, they are
+ * printed only.
+ * partial uploads: if the server supports it (see PARTIAL_PUT_* in 
+ * wdfs-main.h), only the modified blocks of a file and the part behind the
+ * old end of the file are sent. if the file was truncated, most of the file
+ * was modified or a partial upload fails, the complete file is put. */
+
+
+/* the pending uploads of a file. the key is the unified remotepath. */
+struct upload_entry {
+	unsigned long last_seq;		/* sequence number of the newest upload */
+	unsigned long done_seq;		/* sequence number of the last finished one */
+	struct stat stat;			/* attributes of the newest local version */
+};
+
+/* an upload job for the pool */
+struct upload_job {
+	char *remotepath;
+	struct spool *spool;
+	struct upload_entry *entry;
+	unsigned long seq;			/* sequence number of this upload */
+	unsigned long prev_seq;		/* the upload before this one or 0 */
+};
+
+/* pending uploads, the number of queued jobs and the sequence counter. all
+ * protected by the upload_mutex. */
+static GHashTable *pending = NULL;
+static int queued = 0;
+static unsigned long upload_seq = 0;
+static pthread_mutex_t upload_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t upload_cond = PTHREAD_COND_INITIALIZER;
+
+static struct async_pool *upload_pool = NULL;
+
+/* method of partial uploads used with this server, set by upload_initialize() */
+static int partial_put = PARTIAL_PUT_NONE;
+
+static struct {
+	unsigned long submitted;	/* uploads handed to the pool */
+	unsigned long failed;		/* uploads that failed */
+	unsigned long superseded;	/* uploads skipped due to a newer one */
+	unsigned long queue_full;	/* release() calls that had to wait */
+	unsigned long partial;		/* files uploaded partially */
+	unsigned long partial_failed;	/* partial uploads that failed */
+	unsigned long long saved;	/* bytes not sent due to partial uploads */
+	unsigned long unchanged;	/* modified files with the remote data */
+	unsigned long long unchanged_bytes;	/* bytes not sent, file unchanged */
+} upload_stats;
+
+
+/* +++++++ local static methods +++++++ */
+
+
+/* asks the server with an OPTIONS request, if it supports sabredav's partial
+ * updates. returns PARTIAL_PUT_SABREDAV or PARTIAL_PUT_NONE. */
+static int detect_partial_put()
+{
+	int method = PARTIAL_PUT_NONE;
+
+#if NEON_VERSION >= 26
+	const char *path = 
+		(remotepath_basedir && *remotepath_basedir) ? remotepath_basedir : "/";
+	pooled_session session;
+	if (session == NULL)
+		return method;
+	ne_request *req = ne_request_create(session, "OPTIONS", path);
+	if (ne_request_dispatch(req) == NE_OK && ne_get_status(req)->klass == 2) {
+		const char *dav = ne_get_response_header(req, "DAV");
+		if (dav != NULL && strstr(dav, "sabredav-partialupdate") != NULL)
+			method = PARTIAL_PUT_SABREDAV;
+	}
+	ne_request_destroy(req);
+#endif
+
+	if (wdfs.debug == true)
+		fprintf(stderr, ">> %s(): partial uploads %s\n", __func__,
+			method == PARTIAL_PUT_SABREDAV ? "with PATCH" : "not supported");
+	return method;
+}
+
+
+/* sends only the modified parts of the spool to the server. returns 0 on 
+ * success or -1 if the complete file must be put. */
+static int upload_partial(const char *remotepath, struct spool *spool)
+{
+	if (partial_put == PARTIAL_PUT_NONE)
+		return -1;
+
+	std::vector<struct spool_range> ranges;
+	struct stat stat;
+	if (spool_dirty_ranges(spool, ranges) || fstat(spool->fh, &stat))
+		return -1;
+
+	off_t bytes = 0;
+	std::vector<struct spool_range>::iterator range;
+	for (range = ranges.begin(); range != ranges.end(); range++)
+		bytes += range->length;
+
+	/* a complete upload needs no special support of the server */
+	if (ranges.empty() || bytes >= stat.st_size / 2)
+		return -1;
+
+	if (wdfs.debug == true)
+		fprintf(stderr, ">> %s(): sending %lld of %lld bytes in %u ranges\n",
+			__func__, (long long)bytes, (long long)stat.st_size, 
+			(unsigned int)ranges.size());
+
+	/* the first request fails, if the file was changed by somebody else.
+	 * the following requests change the etag themselves. */
+	const char *etag = spool->etag;
+	if (etag != NULL && !strncmp(etag, "W/", 2))
+		etag = NULL;
+
+	pooled_session session;
+	if (session == NULL)
+		return -1;
+	int ret = 0;
+	lockstore_read_lock();
+	for (range = ranges.begin(); range != ranges.end() && ret == 0; range++) {
+		ret = webdav_put_range(session, remotepath, spool->fh, range->start,
+			range->length, stat.st_size, partial_put, 
+			range == ranges.begin() ? etag : NULL);
+	}
+	lockstore_read_unlock();
+
+	pthread_mutex_lock(&upload_mutex);
+	if (ret) {
+		upload_stats.partial_failed++;
+	} else {
+		upload_stats.partial++;
+		upload_stats.saved += stat.st_size - bytes;
+	}
+	pthread_mutex_unlock(&upload_mutex);
+
+	if (ret) {
+		fprintf(stderr, "## partial upload error: %s\n"
+			"## putting the complete file.\n", ne_get_error(session));
+		return -1;
+	}
+	return 0;
+}
+
+
+/* does the upload of a job */
+static int upload_work(void *data)
+{
+	struct upload_job *job = (struct upload_job*)data;
+
+	/* wait for the previous upload of this file. the job holds no session
+	 * yet, so the previous upload can get one. */
+	pthread_mutex_lock(&upload_mutex);
+	while (job->entry->done_seq != job->prev_seq)
+		pthread_cond_wait(&upload_cond, &upload_mutex);
+	bool_t superseded = (job->seq != job->entry->last_seq) ? true : false;
+	if (superseded == true)
+		upload_stats.superseded++;
+	pthread_mutex_unlock(&upload_mutex);
+
+	if (superseded == true)
+		return 0;
+
+	int ret = upload_spool(job->remotepath, job->spool);
+	if (ret) {
+		fprintf(stderr, "## error: upload of '%s' failed, the changes "
+			"are lost!\n", job->remotepath);
+		return ret;
+	}
+
+	/* with SIMPLE_LOCK the lock is kept until the upload is done */
+	if (wdfs.locking_mode == SIMPLE_LOCK)
+		return unlockfile(job->remotepath) ? -EACCES : 0;
+	return 0;
+}
+
+
+/* called after an upload. removes it from the pending uploads. */
+static void upload_done(void *data, int ret)
+{
+	struct upload_job *job = (struct upload_job*)data;
+
+	spool_free(job->spool);
+
+	pthread_mutex_lock(&upload_mutex);
+	if (ret)
+		upload_stats.failed++;
+	job->entry->done_seq = job->seq;
+	if (job->entry->done_seq == job->entry->last_seq) {
+		char *key = unify_path(job->remotepath, UNESCAPE);
+		if (key != NULL)
+			g_hash_table_remove(pending, key);
+		FREE(key);
+	}
+	queued--;
+	pthread_cond_broadcast(&upload_cond);
+	pthread_mutex_unlock(&upload_mutex);
+
+	FREE(job->remotepath);
+	FREE(job);
+}
+
+
+/* +++++++ exported non-static methods +++++++ */
+
+
+/* selects the method of partial uploads and starts the upload pool, if 
+ * write-behind is enabled. must be called in wdfs_init(). returns 0 on 
+ * success or -1 on error. */
+int upload_initialize()
+{
+	partial_put = wdfs.partial_put;
+	if (partial_put == PARTIAL_PUT_AUTO)
+		partial_put = detect_partial_put();
+
+	if (wdfs.write_behind == false)
+		return 0;
+
+	pending = g_hash_table_new_full(g_str_hash, g_str_equal, free, g_free);
+	upload_pool = async_pool_new("upload", wdfs.upload_threads);
+	return (upload_pool == NULL) ? -1 : 0;
+}
+
+
+/* waits for all pending uploads and stops the upload pool. */
+void upload_destroy()
+{
+	if (upload_pool == NULL)
+		return;
+
+	async_pool_wait(upload_pool);
+	async_pool_free(upload_pool);
+	upload_pool = NULL;
+
+	pthread_mutex_lock(&upload_mutex);
+	g_hash_table_destroy(pending);
+	pending = NULL;
+	pthread_mutex_unlock(&upload_mutex);
+}
+
+
+/* puts the data of the spool to the server, partially if possible. for a 
+ * complete upload the missing blocks are fetched before. returns 0 on 
+ * success, -EIO on error or -EACCES if the file can't be unlocked. */
+int upload_spool(const char *remotepath, struct spool *spool)
+{
+	assert(remotepath && spool);
+
+	/* editors often write the same data again. then there is nothing to do
+	 * but unlocking. */
+	if (spool_modified(spool) == false) {
+		if (wdfs.debug == true)
+			fprintf(stderr, ">> %s(): '%s' is unchanged, not uploaded.\n",
+				__func__, remotepath);
+		pthread_mutex_lock(&upload_mutex);
+		upload_stats.unchanged++;
+		upload_stats.unchanged_bytes += spool->base_size;
+		pthread_mutex_unlock(&upload_mutex);
+
+		if (wdfs.locking_mode == ADVANCED_LOCK && unlockfile(remotepath))
+			return -EACCES;
+		return 0;
+	}
+
+	if (upload_partial(remotepath, spool)) {
+		if (spool_fetch_all(spool))
+			return -EIO;
+
+		pooled_session session;
+		if (session == NULL)
+			return -EIO;
+		lockstore_read_lock();
+		int ret = webdav_put(session, remotepath, spool->fh);
+		lockstore_read_unlock();
+		if (ret) {
+			fprintf(stderr, "## PUT error: %s\n", ne_get_error(session));
+			return -EIO;
+		}
+	}
+
+	if (wdfs.debug == true)
+		fprintf(stderr, ">> %s(): PUT the file to the server.\n", __func__);
+
+	/* attributes and data of this file are no longer up to date.
+	 * so remove it from the caches. */
+	cache_delete_item(remotepath);
+	dir_cache_invalidate_parent(remotepath);
+	content_cache_remove(remotepath);
+
+	/* unlock if locking is enabled and mode is ADVANCED_LOCK, because data
+	 * has been read and writen and so now it's time to remove the lock. */
+	if (wdfs.locking_mode == ADVANCED_LOCK) {
+		if (unlockfile(remotepath))
+			return -EACCES;
+	}
+
+	return 0;
+}
+
+
+/* hands the spool to the upload pool, which puts it to the server and frees
+ * it. with SIMPLE_LOCK the file is unlocked after the upload. returns 0 on 
+ * success or -1 if write-behind is disabled or on error. */
+int upload_submit(const char *remotepath, struct spool *spool)
+{
+	assert(remotepath && spool);
+
+	if (upload_pool == NULL)
+		return -1;
+
+	char *key = unify_path(remotepath, UNESCAPE);
+	if (key == NULL)
+		return -1;
+
+	/* the attributes of the local version, reported until the upload is done */
+	struct stat stat;
+	if (cache_get_item(&stat, remotepath)) {
+		memset(&stat, 0, sizeof(struct stat));
+		stat.st_mode = (S_IFREG | 0666) & ~umask(0);
+		stat.st_nlink = 1;
+		stat.st_uid = getuid();
+		stat.st_gid = getgid();
+	}
+	struct stat spool_stat;
+	if (fstat(spool->fh, &spool_stat) == 0)
+		stat.st_size = spool_stat.st_size;
+	stat.st_mtime = stat.st_atime = time(NULL);
+	stat.st_blocks = (stat.st_size + 511) / 512;
+
+	struct upload_job *job = g_new0(struct upload_job, 1);
+	job->remotepath = strdup(remotepath);
+	job->spool = spool;
+
+	pthread_mutex_lock(&upload_mutex);
+	if (queued >= wdfs.upload_queue)
+		upload_stats.queue_full++;
+	while (queued >= wdfs.upload_queue)
+		pthread_cond_wait(&upload_cond, &upload_mutex);
+
+	struct upload_entry *entry = 
+		(struct upload_entry*)g_hash_table_lookup(pending, key);
+	if (entry == NULL) {
+		entry = g_new0(struct upload_entry, 1);
+		g_hash_table_insert(pending, key, entry);
+	} else {
+		FREE(key);
+	}
+	job->entry = entry;
+	job->prev_seq = entry->last_seq;
+	job->seq = ++upload_seq;
+	entry->last_seq = job->seq;
+	entry->stat = stat;
+	queued++;
+	upload_stats.submitted++;
+	pthread_mutex_unlock(&upload_mutex);
+
+	if (wdfs.debug == true)
+		fprintf(stderr, ">> %s(): queued upload of '%s'\n", 
+			__func__, remotepath);
+
+	/* if the job can't be queued, upload the file right now */
+	if (async_submit(upload_pool, upload_work, upload_done, job))
+		upload_done(job, upload_work(job));
+	return 0;
+}
+
+
+/* gets the attributes of the local version of a file with a pending upload.
+ * returns 0 on success or -1 if there is no pending upload. */
+int upload_get_stat(struct stat *stat, const char *remotepath)
+{
+	assert(stat && remotepath);
+
+	if (upload_pool == NULL)
+		return -1;
+
+	char *key = unify_path(remotepath, UNESCAPE);
+	if (key == NULL)
+		return -1;
+
+	pthread_mutex_lock(&upload_mutex);
+	struct upload_entry *entry = 
+		(struct upload_entry*)g_hash_table_lookup(pending, key);
+	if (entry != NULL)
+		*stat = entry->stat;
+	pthread_mutex_unlock(&upload_mutex);
+
+	FREE(key);
+	return (entry != NULL) ? 0 : -1;
+}
+
+
+/* waits until the pending uploads of the file are done. */
+void upload_wait(const char *remotepath)
+{
+	assert(remotepath);
+
+	if (upload_pool == NULL)
+		return;
+
+	char *key = unify_path(remotepath, UNESCAPE);
+	if (key == NULL)
+		return;
+
+	pthread_mutex_lock(&upload_mutex);
+	struct upload_entry *entry = 
+		(struct upload_entry*)g_hash_table_lookup(pending, key);
+	if (entry != NULL) {
+		unsigned long target = entry->last_seq;
+		if (wdfs.debug == true)
+			fprintf(stderr, ">> %s(): waiting for '%s'\n", 
+				__func__, remotepath);
+		while ((entry = (struct upload_entry*)g_hash_table_lookup(
+				pending, key)) != NULL && entry->done_seq < target)
+			pthread_cond_wait(&upload_cond, &upload_mutex);
+	}
+	pthread_mutex_unlock(&upload_mutex);
+
+	FREE(key);
+}
+
+
+/* prints the statistics of the partial and write-behind uploads. */
+void upload_print_stats(FILE *stream)
+{
+	pthread_mutex_lock(&upload_mutex);
+	fprintf(stream, "partial uploads: %lu files, %lu failed, %llu bytes "
+		"saved\n", upload_stats.partial, upload_stats.partial_failed,
+		upload_stats.saved);
+	fprintf(stream, "unchanged files: %lu, %llu bytes not uploaded\n",
+		upload_stats.unchanged, upload_stats.unchanged_bytes);
+	pthread_mutex_unlock(&upload_mutex);
+
+	if (upload_pool == NULL)
+		return;
+
+	pthread_mutex_lock(&upload_mutex);
+	fprintf(stream, "write-behind uploads: %lu submitted, %lu failed, "
+		"%lu superseded, %lu waits for the queue\n",
+		upload_stats.submitted, upload_stats.failed, 
+		upload_stats.superseded, upload_stats.queue_full);
+	pthread_mutex_unlock(&upload_mutex);
+	async_print_stats(upload_pool, stream);
+}
@@ -0,0 +1,12 @@
+#ifndef UPLOAD_H_
+#define UPLOAD_H_
+
+int upload_initialize();
+void upload_destroy();
+int upload_spool(const char *remotepath, struct spool *spool);
+int upload_submit(const char *remotepath, struct spool *spool);
+int upload_get_stat(struct stat *stat, const char *remotepath);
+void upload_wait(const char *remotepath);
+void upload_print_stats(FILE *stream);
+
+#endif /*UPLOAD_H_*/
@@ -0,0 +1,330 @@
+/*
+ *  this file is part of wdfs --> http://noedler.de/projekte/wdfs/
+ *
+ *  wdfs is a webdav filesystem with special features for accessing subversion
+ *  repositories. it is based on fuse v2.5+ and neon v0.24.7+.
+ *
+ *  copyright (c) 2005 - 2007 jens m. noedler, noedler@web.de
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *  This program is released under the GPL with the additional exemption
+ *  that compiling, linking and/or using OpenSSL is allowed.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <glib.h>
+
+#include "wdfs-main.h"
+#include "async.h"
+#include "warmup.h"
+
+/* the warm-up crawler fills the attribute cache and the directory cache
+ * after the mount, so that the first walk over a tree needs no requests.
+ * "-o warmup" is a list of directories, separated by ':', relative to the
+ * mount's root. each directory is first asked for with one propfind of depth
+ * infinity. if the server does not allow it, the tree is walked with a
+ * propfind of depth 1 per directory. the directories wait in a queue. a feeder
+ * thread hands them to a pool of "-o warmup_threads" threads, at most
+ * "-o warmup_rate" per second. the rate is kept by the feeder, so the jobs
+ * never wait while holding a session. a job sends one request and queues
+ * the subdirectories it found. the crawler stops, when the queue is empty or
+ * wdfs is unmounted. the caches limit the memory, so a big tree may not stay
+ * cached completely. */
+
+/* a job lists one directory or the tree below it */
+struct warmup_job {
+	char *key;			/* unified remotepath of the directory */
+	bool_t tree;		/* try a propfind of depth infinity first */
+};
+
+static struct async_pool *warmup_pool = NULL;
+
+/* the feeder thread, see warmup_feeder() */
+static pthread_t warmup_thread_id;
+static bool_t warmup_thread_started = false;
+
+/* the state of the crawler is protected by warmup_mutex. warmup_cond is
+ * signaled if a job is queued or done or the crawler is stopped. */
+static pthread_mutex_t warmup_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t warmup_cond = PTHREAD_COND_INITIALIZER;
+
+/* set by warmup_destroy(), the jobs stop then */
+static bool_t warmup_stop = false;
+
+/* the jobs, that are not yet submitted to the pool */
+static GQueue *warmup_queue = NULL;
+
+/* number of submitted jobs, that are not done */
+static int warmup_running = 0;
+
+/* statistics */
+static unsigned long warmup_trees = 0;
+static unsigned long warmup_directories = 0;
+static unsigned long warmup_files = 0;
+static unsigned long warmup_failed = 0;
+
+
+/* +++++++ local static methods +++++++ */
+
+
+static void warmup_free_job(struct warmup_job *job)
+{
+	FREE(job->key);
+	FREE(job);
+}
+
+
+/* queues a job for the directory with the unified key. */
+static void warmup_queue_job(const char *key, bool_t tree)
+{
+	struct warmup_job *job = g_new0(struct warmup_job, 1);
+	job->key = strdup(key);
+	job->tree = tree;
+	if (job->key == NULL) {
+		FREE(job);
+		return;
+	}
+
+	pthread_mutex_lock(&warmup_mutex);
+	if (warmup_stop == false) {
+		g_queue_push_tail(warmup_queue, job);
+		job = NULL;
+		pthread_cond_broadcast(&warmup_cond);
+	}
+	pthread_mutex_unlock(&warmup_mutex);
+
+	if (job != NULL)
+		warmup_free_job(job);
+}
+
+
+/* called by refresh_directory() for each file of a listed directory. queues
+ * a job for each subdirectory. */
+static int warmup_filler(
+	void *buf, const char *name, const struct stat *stat, off_t offset)
+{
+	struct warmup_job *job = (struct warmup_job*)buf;
+
+	if (stat != NULL && S_ISDIR(stat->st_mode)) {
+		char *key = g_strconcat(job->key, "/", name, NULL);
+		warmup_queue_job(key, false);
+		g_free(key);
+	}
+
+	pthread_mutex_lock(&warmup_mutex);
+	warmup_files++;
+	pthread_mutex_unlock(&warmup_mutex);
+	return 0;
+}
+
+
+static int warmup_work(void *data)
+{
+	struct warmup_job *job = (struct warmup_job*)data;
+
+	pthread_mutex_lock(&warmup_mutex);
+	bool_t stop = warmup_stop;
+	pthread_mutex_unlock(&warmup_mutex);
+	if (stop == true)
+		return 0;
+
+	char *remotepath = unify_path(job->key, ESCAPE);
+	if (remotepath == NULL)
+		return -ENOMEM;
+
+	int ret;
+	if (job->tree == true) {
+		ret = refresh_tree(remotepath);
+		if (ret >= 0) {
+			pthread_mutex_lock(&warmup_mutex);
+			warmup_trees++;
+			warmup_files += ret;
+			pthread_mutex_unlock(&warmup_mutex);
+			if (wdfs.debug == true)
+				fprintf(stderr, "** warm-up got the tree '%s' at once\n",
+					job->key);
+		} else {
+			/* walk the tree one directory after another */
+			warmup_queue_job(job->key, false);
+		}
+		ret = 0;
+	} else {
+		ret = refresh_directory(remotepath, job, warmup_filler);
+		pthread_mutex_lock(&warmup_mutex);
+		warmup_directories++;
+		pthread_mutex_unlock(&warmup_mutex);
+	}
+
+	FREE(remotepath);
+	return (ret < 0) ? ret : 0;
+}
+
+
+static void warmup_done(void *data, int ret)
+{
+	struct warmup_job *job = (struct warmup_job*)data;
+
+	pthread_mutex_lock(&warmup_mutex);
+	if (ret != 0 && warmup_stop == false)
+		warmup_failed++;
+	warmup_running--;
+	pthread_cond_broadcast(&warmup_cond);
+	pthread_mutex_unlock(&warmup_mutex);
+
+	warmup_free_job(job);
+}
+
+
+/* this thread submits the queued jobs to the pool, at most "-o warmup_rate"
+ * per second and not more than the pool runs at once. it runs until the
+ * queue is empty and no job is left or until it's stopped by 
+ * warmup_destroy(). */
+static void* warmup_feeder(void *unused)
+{
+	gint64 next = 0;	/* time in microseconds, when the next job may run */
+
+	pthread_mutex_lock(&warmup_mutex);
+	while (warmup_stop == false) {
+		if (g_queue_is_empty(warmup_queue)) {
+			if (warmup_running == 0)
+				break;
+			pthread_cond_wait(&warmup_cond, &warmup_mutex);
+			continue;
+		}
+		if (warmup_running >= wdfs.warmup_threads) {
+			pthread_cond_wait(&warmup_cond, &warmup_mutex);
+			continue;
+		}
+
+		gint64 now = g_get_real_time();
+		if (wdfs.warmup_rate > 0 && next > now) {
+			struct timespec wakeup;
+			wakeup.tv_sec = next / 1000000;
+			wakeup.tv_nsec = (next % 1000000) * 1000;
+			pthread_cond_timedwait(&warmup_cond, &warmup_mutex, &wakeup);
+			continue;
+		}
+		if (wdfs.warmup_rate > 0)
+			next = now + 1000000 / wdfs.warmup_rate;
+
+		struct warmup_job *job = 
+			(struct warmup_job*)g_queue_pop_head(warmup_queue);
+		warmup_running++;
+		pthread_mutex_unlock(&warmup_mutex);
+		bool_t failed = 
+			async_submit(warmup_pool, warmup_work, warmup_done, job) ? 
+			true : false;
+		pthread_mutex_lock(&warmup_mutex);
+		if (failed == true) {
+			warmup_running--;
+			warmup_failed++;
+			warmup_free_job(job);
+		}
+	}
+	pthread_mutex_unlock(&warmup_mutex);
+
+	if (wdfs.debug == true)
+		fprintf(stderr, "** warm-up is done\n");
+	return NULL;
+}
+
+
+/* +++++++ exported non-static methods +++++++ */
+
+
+/* starts the pool of the crawler and adds a job for each directory of
+ * "-o warmup". must be called after the fork() of fuse. */
+void warmup_initialize()
+{
+	if (wdfs.warmup == NULL)
+		return;
+
+	warmup_stop = false;
+	warmup_pool = async_pool_new("warm-up jobs", wdfs.warmup_threads);
+	if (warmup_pool == NULL) {
+		fprintf(stderr, "## error: could not start the warm-up pool\n");
+		return;
+	}
+	warmup_queue = g_queue_new();
+
+	char **directories = g_strsplit(wdfs.warmup, ":", 0);
+	int i;
+	for (i = 0; directories[i] != NULL; i++) {
+		char *localpath = g_strconcat("/", directories[i], NULL);
+		char *remotepath = get_remotepath(localpath);
+		char *key = remotepath ? unify_path(remotepath, UNESCAPE) : NULL;
+		if (key != NULL) {
+			if (wdfs.debug == true)
+				fprintf(stderr, "** warm-up of '%s'\n", key);
+			warmup_queue_job(key, true);
+		}
+		g_free(localpath);
+		free_chars(&remotepath, &key, NULL);
+	}
+	g_strfreev(directories);
+
+	if (pthread_create(&warmup_thread_id, NULL, warmup_feeder, NULL))
+		fprintf(stderr, "## error: could not start the warm-up thread\n");
+	else
+		warmup_thread_started = true;
+}
+
+
+/* stops the crawler and waits for the running jobs. */
+void warmup_destroy()
+{
+	if (warmup_pool == NULL)
+		return;
+
+	pthread_mutex_lock(&warmup_mutex);
+	warmup_stop = true;
+	pthread_cond_broadcast(&warmup_cond);
+	pthread_mutex_unlock(&warmup_mutex);
+
+	if (warmup_thread_started == true)
+		pthread_join(warmup_thread_id, NULL);
+	warmup_thread_started = false;
+
+	async_pool_free(warmup_pool);
+	warmup_pool = NULL;
+
+	/* the jobs, that were not submitted anymore */
+	struct warmup_job *job;
+	while ((job = (struct warmup_job*)g_queue_pop_head(warmup_queue)) != NULL)
+		warmup_free_job(job);
+	g_queue_free(warmup_queue);
+	warmup_queue = NULL;
+}
+
+
+/* prints the statistics of the crawler. */
+void warmup_print_stats(FILE *stream)
+{
+	if (wdfs.warmup == NULL)
+		return;
+
+	pthread_mutex_lock(&warmup_mutex);
+	fprintf(stream, "warm-up: %lu trees with depth infinity, %lu directories "
+		"with depth 1, %lu files, %lu failed\n", warmup_trees,
+		warmup_directories, warmup_files, warmup_failed);
+	pthread_mutex_unlock(&warmup_mutex);
+}
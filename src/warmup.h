@@ -0,0 +1,8 @@
+#ifndef WARMUP_H_
+#define WARMUP_H_
+
+void warmup_initialize();
+void warmup_destroy();
+void warmup_print_stats(FILE *stream);
+
+#endif /*WARMUP_H_*/
@@ -31,6 +31,7 @@
 #include <fcntl.h>
 #include <assert.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <glib.h>
 #include <fuse_opt.h>
 #include <ne_props.h>
@@ -44,22 +45,18 @@
 #include "wdfs-main.h"
 #include "webdav.h"
 #include "cache.h"
+#include "dircache.h"
+#include "snapshot.h"
+#include "prefetch.h"
+#include "warmup.h"
 #include "svn.h"
+#include "async.h"
+#include "spool.h"
+#include "content.h"
+#include "upload.h"
 
 
 
-/* there are four locking modes available. the simple locking mode locks a file 
- * on open()ing it and unlocks it on close()ing the file. the advanced mode 
- * prevents data curruption by locking the file on open() and holds the lock 
- * until the file was writen and closed or the lock timed out. the eternity 
- * mode holds the lock until wdfs is unmounted or the lock times out. the last
- * mode is to do no locking at all which is the default behaviour. */
-#define NO_LOCK 0
-#define SIMPLE_LOCK 1
-#define ADVANCED_LOCK 2
-#define ETERNITY_LOCK 3
-
-
 static void print_help();
 static int call_fuse_main(struct fuse_args *args);
 
@@ -86,6 +83,31 @@ struct wdfs_conf wdfs = [] () {
     w.svn_mode = false;
     w.locking_mode = NO_LOCK;
     w.locking_timeout = 300;
+    w.sessions = 4;
+    w.keepalive = 0;
+    w.spare_sessions = 1;
+    w.stats = false;
+    w.async_threads = 4;
+    w.cache_ttl_min = 20;
+    w.cache_ttl_max = 20;
+    w.cache_memory = 64;
+    w.negative_timeout = 5;
+    w.stale_grace = 0;
+    w.stale_max = 60;
+    w.dir_timeout = 20;
+    w.prefetch_misses = 0;
+    w.metadata_cache = NULL;
+    w.warmup = NULL;
+    w.warmup_threads = 2;
+    w.warmup_rate = 10;
+    w.content_cache = NULL;
+    w.content_cache_size = 1024;
+    w.readahead = 1024;
+    w.readahead_budget = 8192;
+    w.write_behind = false;
+    w.upload_threads = 4;
+    w.upload_queue = 64;
+    w.partial_put = PARTIAL_PUT_AUTO;
     w.webdav_resource = NULL;
     return w;
 } ();
@@ -135,6 +157,35 @@ static struct fuse_opt wdfs_opts[] = {
 	WDFS_OPT("locking=eternity",	locking_mode, ETERNITY_LOCK),
 	WDFS_OPT("-t %u",				locking_timeout, 300),
 	WDFS_OPT("locking_timeout=%u",	locking_timeout, 300),
+	WDFS_OPT("sessions=%u",			sessions, 4),
+	WDFS_OPT("keepalive=%u",		keepalive, 0),
+	WDFS_OPT("spare_sessions=%u",	spare_sessions, 1),
+	WDFS_OPT("stats",				stats, true),
+	WDFS_OPT("async_threads=%u",	async_threads, 4),
+	WDFS_OPT("cache_ttl_min=%u",	cache_ttl_min, 20),
+	WDFS_OPT("cache_ttl_max=%u",	cache_ttl_max, 20),
+	WDFS_OPT("cache_memory=%u",		cache_memory, 64),
+	WDFS_OPT("negative_timeout=%u",	negative_timeout, 5),
+	WDFS_OPT("stale_grace=%u",		stale_grace, 0),
+	WDFS_OPT("stale_max=%u",		stale_max, 60),
+	WDFS_OPT("dir_timeout=%u",		dir_timeout, 20),
+	WDFS_OPT("prefetch_misses=%u",	prefetch_misses, 0),
+	WDFS_OPT("metadata_cache=%s",	metadata_cache, 0),
+	WDFS_OPT("warmup=%s",			warmup, 0),
+	WDFS_OPT("warmup_threads=%u",	warmup_threads, 2),
+	WDFS_OPT("warmup_rate=%u",		warmup_rate, 10),
+	WDFS_OPT("content_cache=%s",	content_cache, 0),
+	WDFS_OPT("content_cache_size=%u",	content_cache_size, 1024),
+	WDFS_OPT("readahead=%u",		readahead, 1024),
+	WDFS_OPT("readahead_budget=%u",	readahead_budget, 8192),
+	WDFS_OPT("write_behind",		write_behind, true),
+	WDFS_OPT("upload_threads=%u",	upload_threads, 4),
+	WDFS_OPT("upload_queue=%u",		upload_queue, 64),
+	WDFS_OPT("partial_put=none",	partial_put, PARTIAL_PUT_NONE),
+	WDFS_OPT("partial_put=auto",	partial_put, PARTIAL_PUT_AUTO),
+	WDFS_OPT("partial_put=content-range",	partial_put, 
+		PARTIAL_PUT_CONTENT_RANGE),
+	WDFS_OPT("partial_put=sabredav",	partial_put, PARTIAL_PUT_SABREDAV),
 	FUSE_OPT_END
 };
 
@@ -200,12 +251,266 @@ static int wdfs_opt_proc(
  * if connected to the root directory (http://server/) it will be set to "". */
 char *remotepath_basedir;
 
-/* infos about an open file. used by open(), read(), write() and release()   */
+/* the pool that runs jobs in the background, e.g. prefetching or uploading
+ * files. it's created at wdfs_init() and destroyed at wdfs_destroy(). */
+struct async_pool *background_jobs = NULL;
+
+/* infos about an open file. used by open(), read(), write() and release().
+ * all filehandles of a file share one "struct open_file" and one spool, so 
+ * the data is fetched only once and every filehandle sees the writes of the
+ * others. the file is put to the server, when the last filehandle opened for
+ * writing or the last filehandle at all is released. */
 struct open_file {
-	unsigned long fh;	/* this file's filehandle                            */
-	bool_t modified;	/* set true if the filehandle's content is modified  */
+	char *key;				/* unified remotepath, the key of open_files     */
+	struct spool *spool;	/* local copy of the file, see spool.cpp         */
+	bool_t modified;	/* set true if the file's content is modified        */
+	int refs;				/* filehandles using this file                   */
+	int writers;			/* filehandles opened for writing                */
+	bool_t busy;			/* set while open() or the last release() runs   */
+	/* held for reading by write() and ftruncate(), for writing by uploads */
+	pthread_rwlock_t upload_lock;
 };
 
+/* the open files, the key is the unified remotepath. protected by the 
+ * open_files_mutex, open_files_cond is signaled if a file is no longer busy.
+ */
+static GHashTable *open_files = NULL;
+static pthread_mutex_t open_files_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t open_files_cond = PTHREAD_COND_INITIALIZER;
+
+/* number of open() calls that shared an already open file */
+static unsigned long open_files_shared = 0;
+
+
+/* returns the open file of the unified key or NULL. waits while the file is
+ * busy. the open_files_mutex must be held. */
+static struct open_file* open_file_lookup(const char *key)
+{
+	if (open_files == NULL)
+		open_files = g_hash_table_new(g_str_hash, g_str_equal);
+
+	struct open_file *file;
+	while ((file = (struct open_file*)g_hash_table_lookup(open_files, key)) 
+			!= NULL && file->busy == true)
+		pthread_cond_wait(&open_files_cond, &open_files_mutex);
+	return file;
+}
+
+
+/* looks up the open file of remotepath and adds a reference to it. if the 
+ * file is not open, a new "struct open_file" without spool is added, that
+ * is busy until open_file_ready() is called. returns the file or NULL on 
+ * error. */
+static struct open_file* open_file_get(const char *remotepath, bool_t writable)
+{
+	char *key = unify_path(remotepath, UNESCAPE);
+	if (key == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&open_files_mutex);
+	struct open_file *file = open_file_lookup(key);
+	if (file != NULL) {
+		open_files_shared++;
+		FREE(key);
+	} else {
+		file = g_new0(struct open_file, 1);
+		file->key = key;
+		file->busy = true;
+		pthread_rwlock_init(&file->upload_lock, NULL);
+		g_hash_table_insert(open_files, file->key, file);
+	}
+	file->refs++;
+	if (writable == true)
+		file->writers++;
+	pthread_mutex_unlock(&open_files_mutex);
+	return file;
+}
+
+
+/* frees the file. the spool must be freed before. */
+static void open_file_free(struct open_file *file)
+{
+	pthread_rwlock_destroy(&file->upload_lock);
+	FREE(file->key);
+	FREE(file);
+}
+
+
+/* resets the busy flag and wakes up the waiting open() calls. a file without 
+ * spool or references is removed from the open files. */
+static void open_file_ready(struct open_file *file)
+{
+	pthread_mutex_lock(&open_files_mutex);
+	file->busy = false;
+	if ((file->spool == NULL || file->refs == 0) &&
+			g_hash_table_lookup(open_files, file->key) == file)
+		g_hash_table_remove(open_files, file->key);
+	pthread_cond_broadcast(&open_files_cond);
+	pthread_mutex_unlock(&open_files_mutex);
+}
+
+
+/* puts the shared spool of the file to the server, if it was modified. the
+ * upload_lock must be held for writing. returns 0 on success or a negative
+ * error code. */
+static int open_file_put(const char *remotepath, struct open_file *file)
+{
+	int ret = 0;
+	if (file->modified == true) {
+		ret = upload_spool(remotepath, file->spool);
+		if (ret == 0) {
+			spool_uploaded(file->spool);
+			file->modified = false;
+		}
+	}
+	return ret;
+}
+
+
+/* puts the shared spool of the file to the server, while other filehandles
+ * may still read it. returns 0 on success or a negative error code. */
+static int open_file_upload(const char *remotepath, struct open_file *file)
+{
+	pthread_rwlock_wrlock(&file->upload_lock);
+	int ret = open_file_put(remotepath, file);
+	pthread_rwlock_unlock(&file->upload_lock);
+	return ret;
+}
+
+
+/* removes a reference of the file. if it was the last filehandle opened for
+ * writing or the last one at all, the modified file is put to the server. 
+ * the last reference frees the file. open() waits meanwhile, so it gets the 
+ * new data from the server. returns 0 on success or a negative error code. */
+static int open_file_release(
+	const char *remotepath, struct open_file *file, bool_t writable)
+{
+	pthread_mutex_lock(&open_files_mutex);
+	file->refs--;
+	if (writable == true)
+		file->writers--;
+	bool_t last = (file->refs == 0) ? true : false;
+	bool_t last_writer = (writable == true && file->writers == 0) ? true : false;
+	if (last == true)
+		file->busy = true;
+	pthread_mutex_unlock(&open_files_mutex);
+
+	/* put the file only to the server, if it was modified. with write_behind
+	 * the upload pool puts the file and frees the spool. the upload_lock
+	 * waits for the upload of another writer's release(), which still uses
+	 * the file. */
+	int ret = 0;
+	bool_t submitted = false;
+	if (last == true || last_writer == true) {
+		pthread_rwlock_wrlock(&file->upload_lock);
+		if (file->modified == true && last == true &&
+				upload_submit(remotepath, file->spool) == 0) {
+			file->spool = NULL;
+			file->modified = false;
+			submitted = true;
+		} else {
+			ret = open_file_put(remotepath, file);
+		}
+		pthread_rwlock_unlock(&file->upload_lock);
+	}
+
+	if (submitted == true) {
+		open_file_ready(file);
+		open_file_free(file);
+		return 0;
+	}
+
+	if (last == false)
+		return ret;
+
+	/* if locking is enabled and mode is SIMPLE_LOCK, simple unlock on close()
+	 * of the last filehandle */
+	if (ret == 0 && wdfs.locking_mode == SIMPLE_LOCK) {
+		if (unlockfile(remotepath))
+			ret = -EACCES;
+	}
+
+	/* keep the data of a completely fetched file for the next open() */
+	if (file->modified == false)
+		content_cache_store(file->spool);
+
+	/* close filehandle and free memory */
+	open_file_ready(file);
+	spool_free(file->spool);
+	open_file_free(file);
+	return ret;
+}
+
+
+/* removes the file of remotepath from the open files, e.g. if it's deleted. 
+ * the filehandles that use it keep it. */
+static void open_file_forget(const char *remotepath)
+{
+	char *key = unify_path(remotepath, UNESCAPE);
+	if (key == NULL)
+		return;
+
+	pthread_mutex_lock(&open_files_mutex);
+	struct open_file *file = NULL;
+	if (open_files != NULL)
+		file = (struct open_file*)g_hash_table_lookup(open_files, key);
+	if (file != NULL)
+		g_hash_table_remove(open_files, key);
+	pthread_mutex_unlock(&open_files_mutex);
+	FREE(key);
+}
+
+
+/* truncates the shared spool of the open file of remotepath to size bytes 
+ * and puts it to the server. returns 0 on success, a negative error code on
+ * error or -ENOENT if the file is not open. */
+static int truncate_open_file(const char *remotepath, off_t size)
+{
+	char *key = unify_path(remotepath, UNESCAPE);
+	if (key == NULL)
+		return -ENOMEM;
+
+	/* get a reference, so that the file is not freed by release() */
+	pthread_mutex_lock(&open_files_mutex);
+	struct open_file *file = open_file_lookup(key);
+	if (file != NULL)
+		file->refs++;
+	pthread_mutex_unlock(&open_files_mutex);
+	FREE(key);
+
+	if (file == NULL)
+		return -ENOENT;
+
+	int ret = spool_make_writable(file->spool);
+	if (ret == 0) {
+		pthread_rwlock_rdlock(&file->upload_lock);
+		ret = spool_truncate(file->spool, size);
+		if (ret == 0)
+			file->modified = true;
+		pthread_rwlock_unlock(&file->upload_lock);
+	}
+	if (ret == 0)
+		ret = open_file_upload(remotepath, file);
+
+	int ret_release = open_file_release(remotepath, file, false);
+	return ret ? ret : ret_release;
+}
+
+
+/* sets the size of the file in the cache, if it's cached */
+static void update_cached_size(const char *remotepath, off_t size)
+{
+	struct stat stat;
+	if (cache_get_item(&stat, remotepath))
+		return;
+
+	stat.st_size = size;
+	/* calculate number of 512 byte blocks */
+	stat.st_blocks = (stat.st_size + 511) / 512;
+	cache_add_item(&stat, remotepath);
+	dir_cache_invalidate_parent(remotepath);
+}
+
 enum field_e {
     TYPE = 0,
     LENGTH,
@@ -331,25 +636,40 @@ char* unify_path(const char *path_in, int mode)
 }
 
 
+/* returns a filehandle for read and write on success or -1 on error */
+int get_filehandle()
+{
+	char dummyfile[] = "/tmp/wdfs-tmp-XXXXXX";
+	/* mkstemp() replaces XXXXXX by unique random chars and
+	 * returns a filehandle for reading and writing */
+	int fh = mkstemp(dummyfile);
+	if (fh == -1)
+		fprintf(stderr, "## mkstemp(%s) error\n", dummyfile);
+	if (unlink(dummyfile))
+		fprintf(stderr, "## unlink() error\n");
+	return fh;
+}
+
+
 
 /* +++ helper methods +++ */
 
 
-/* this method prints some debug output and sets the http user agent string to
- * a more informative value. */
+/* this method prints some debug output and sets the http user agent string of
+ * this thread's session to a more informative value. */
 static void print_debug_infos(const char *method, const char *parameter)
 {
 	assert(method);
 	fprintf(stderr, ">> %s(%s)\n", method, parameter);
 	char *useragent = 
 		ne_concat(project_name, " ", method, "(", parameter, ")", NULL);
-	ne_set_useragent(session, useragent);
+	set_useragent(useragent);
 	FREE(useragent);
 }
 
 
 /* returns the malloc()ed escaped remotepath on success or NULL on error */
-static char* get_remotepath(const char *localpath)
+char* get_remotepath(const char *localpath)
 {
 	assert(localpath);
 	char *remotepath = ne_concat(remotepath_basedir, localpath, NULL);
@@ -363,20 +683,6 @@ static char* get_remotepath(const char *localpath)
 }
 
 
-/* returns a filehandle for read and write on success or -1 on error */
-static int get_filehandle()
-{
-	char dummyfile[] = "/tmp/wdfs-tmp-XXXXXX";
-	/* mkstemp() replaces XXXXXX by unique random chars and
-	 * returns a filehandle for reading and writing */
-	int fh = mkstemp(dummyfile);
-	if (fh == -1)
-		fprintf(stderr, "## mkstemp(%s) error\n", dummyfile);
-	if (unlink(dummyfile))
-		fprintf(stderr, "## unlink() error\n");
-	return fh;
-}
-
 const char* get_helper(const ne_prop_result_set *results, field_e field) {
     const char* data = ne_propset_value(results, &prop_names[field]);
     return (data) 
@@ -454,6 +760,9 @@ static int handle_redirect(char **remotepath)
 	/* free the old value of remotepath, because it's no longer needed */
 	FREE(*remotepath);
 
+	/* this is the session, that received the redirect */
+	pooled_session session;
+
 	/* get the current_uri and new_uri structs */
 	ne_uri current_uri;
 	ne_fill_server_uri(session, &current_uri);
@@ -479,7 +788,30 @@ static int handle_redirect(char **remotepath)
 /* +++ fuse callback methods +++ */
 
 
-/* this method is called by ne_simple_propfind() from wdfs_getattr() for a
+/* userdata of wdfs_getattr_propfind_callback() */
+struct getattr_data {
+	struct stat *stat;		/* set to the file's attributes */
+	ne_request *req;		/* the propfind request, for its response headers */
+};
+
+
+/* returns the max-age of the "Cache-Control" header of the response in 
+ * seconds, 0 for "no-cache" or "no-store" or -1 if there is no such hint. */
+static int get_max_age(ne_request *req)
+{
+	const char *value = ne_get_response_header(req, "Cache-Control");
+	if (value == NULL)
+		return -1;
+	if (strcasestr(value, "no-cache") || strcasestr(value, "no-store"))
+		return 0;
+	const char *max_age = strcasestr(value, "max-age=");
+	if (max_age == NULL)
+		return -1;
+	return atoi(max_age + strlen("max-age="));
+}
+
+
+/* this method is called by ne_propfind_named() from wdfs_getattr() for a
  * specific file. it sets the file's attributes and and them to the cache. */
 static void wdfs_getattr_propfind_callback(
 #if NEON_VERSION >= 26
@@ -495,13 +827,15 @@ static void wdfs_getattr_propfind_callback(
 	if (wdfs.debug == true)
 		print_debug_infos(__func__, remotepath);
 
-	struct stat *stat = (struct stat*)userdata;
+	struct getattr_data *data = (struct getattr_data*)userdata;
+	struct stat *stat = data->stat;
 	memset(stat, 0, sizeof(struct stat));
 
 	assert(stat && remotepath);
 
 	set_stat(stat, results);
-	cache_add_item(stat, remotepath);
+	/* the response headers are known, while the body is parsed */
+	cache_add_item_max_age(stat, remotepath, get_max_age(data->req));
 
 #if NEON_VERSION >= 26
 	FREE(remotepath);
@@ -509,6 +843,124 @@ static void wdfs_getattr_propfind_callback(
 }
 
 
+/* concurrent requests for the attributes of the same file are served by one
+ * depth 0 propfind request. the first caller sends the request and the other
+ * callers wait for its result, instead of sending the same request again.
+ * the requests in progress are stored in a hash with the remotepath as key. */
+struct propfind_request {
+	int ret;				/* result of the request: 0 or -ENOENT */
+	bool_t done;			/* set true if the request is finished */
+	struct stat stat;		/* the file's attributes on success */
+	int users;				/* number of callers sharing this request */
+	pthread_cond_t cond;	/* signaled, if the request is finished */
+};
+
+static GHashTable *propfind_requests = g_hash_table_new(g_str_hash, g_str_equal);
+static pthread_mutex_t propfind_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* number of propfind requests sent and requests shared by waiting callers */
+static unsigned long propfind_sent = 0, propfind_shared = 0;
+
+
+/* sends a depth 0 propfind request for the remotepath with the session and
+ * sets stat. returns the neon error code. */
+static int getattr_propfind_named(
+	ne_session *session, const char *remotepath, struct stat *stat)
+{
+	ne_propfind_handler *handler = 
+		ne_propfind_create(session, remotepath, NE_DEPTH_ZERO);
+	struct getattr_data data;
+	data.stat = stat;
+	data.req = ne_propfind_get_request(handler);
+	int ret = ne_propfind_named(handler, &prop_names[0], 
+		wdfs_getattr_propfind_callback, &data);
+	ne_propfind_destroy(handler);
+	return ret;
+}
+
+
+/* sends a depth 0 propfind request for the remotepath and sets stat. returns
+ * 0 on success or -ENOENT on error. side effect: remotepath is freed and set
+ * to the redirect target on a redirect or set to NULL on error. */
+static int send_getattr_propfind(char **remotepath, struct stat *stat)
+{
+	pooled_session session;
+	if (session == NULL)
+		return -ENOENT;
+	int ret = getattr_propfind_named(session, *remotepath, stat);
+	/* handle the redirect and retry the propfind with the new target */
+	if (ret == NE_REDIRECT && wdfs.redirect == true) {
+		if (handle_redirect(remotepath))
+			return -ENOENT;
+		ret = getattr_propfind_named(session, *remotepath, stat);
+	}
+	if (ret != NE_OK) {
+		/* remember files, that do not exist */
+		if (!strncmp(ne_get_error(session), "404", 3)) {
+			cache_add_negative(*remotepath);
+			return -ENOENT;
+		}
+		fprintf(stderr, "## PROPFIND error in %s(): %s\n",
+			__func__, ne_get_error(session));
+		return -ENOENT;
+	}
+	return 0;
+}
+
+
+/* gets the file's attributes from the webdav server or from a request for
+ * the same file, that is already in progress. returns 0 on success or -ENOENT
+ * on error. side effect: see send_getattr_propfind(). */
+static int getattr_propfind(char **remotepath, struct stat *stat)
+{
+	pthread_mutex_lock(&propfind_mutex);
+	struct propfind_request *request = (struct propfind_request*)
+		g_hash_table_lookup(propfind_requests, *remotepath);
+
+	/* another thread already asked for this file, wait for its answer */
+	if (request != NULL) {
+		request->users++;
+		propfind_shared++;
+		while (request->done == false)
+			pthread_cond_wait(&request->cond, &propfind_mutex);
+		int ret = request->ret;
+		if (ret == 0)
+			*stat = request->stat;
+		if (--request->users == 0) {
+			pthread_cond_destroy(&request->cond);
+			FREE(request);
+		}
+		pthread_mutex_unlock(&propfind_mutex);
+		return ret;
+	}
+
+	/* otherwise send the request and share the answer */
+	request = g_new0(struct propfind_request, 1);
+	request->users = 1;
+	pthread_cond_init(&request->cond, NULL);
+	char *key = strdup(*remotepath);
+	g_hash_table_insert(propfind_requests, key, request);
+	propfind_sent++;
+	pthread_mutex_unlock(&propfind_mutex);
+
+	int ret = send_getattr_propfind(remotepath, stat);
+
+	pthread_mutex_lock(&propfind_mutex);
+	g_hash_table_remove(propfind_requests, key);
+	request->ret = ret;
+	request->stat = *stat;
+	request->done = true;
+	pthread_cond_broadcast(&request->cond);
+	if (--request->users == 0) {
+		pthread_cond_destroy(&request->cond);
+		FREE(request);
+	}
+	pthread_mutex_unlock(&propfind_mutex);
+	FREE(key);
+	return ret;
+}
+
+
 /* this method returns the file attributes (stat) for a requested file either
  * from the cache or directly from the webdav server by performing a propfind
  * request. */
@@ -545,22 +997,32 @@ static int wdfs_getattr(const char *localpath, struct stat *stat)
 	if (remotepath == NULL)
 		return -ENOMEM;
 
-	/* stat not found in the cache? perform a propfind to get stat! */
-	if (cache_get_item(stat, remotepath)) {
-		int ret = ne_simple_propfind(
-			session, remotepath, NE_DEPTH_ZERO, &prop_names[0],
-			wdfs_getattr_propfind_callback, stat);
-		/* handle the redirect and retry the propfind with the new target */
-		if (ret == NE_REDIRECT && wdfs.redirect == true) {
-			if (handle_redirect(&remotepath))
-				return -ENOENT;
-			ret = ne_simple_propfind(
-				session, remotepath, NE_DEPTH_ZERO, &prop_names[0],
-				wdfs_getattr_propfind_callback, stat);
-		}
-		if (ret != NE_OK) {
-			fprintf(stderr, "## PROPFIND error in %s(): %s\n",
-				__func__, ne_get_error(session));
+	/* a file with a pending upload has the attributes of the local version */
+	if (upload_get_stat(stat, remotepath) == 0) {
+		FREE(remotepath);
+		return 0;
+	}
+
+	/* stat not found in the cache? perform a propfind to get stat! a file,
+	 * that is known not to exist, is not asked for again. */
+	int ret = cache_get_item(stat, remotepath);
+	/* the complete listing of the directory knows all of its files */
+	if (ret == -1)
+		ret = dir_cache_lookup(remotepath, stat);
+	/* a timed out item is served while it's refreshed in the background */
+	if (ret == -1)
+		ret = cache_get_stale(stat, remotepath);
+	/* the snapshot of the last mount is revalidated in the background */
+	if (ret == -1)
+		ret = snapshot_lookup(remotepath, stat);
+	/* a burst of misses in one directory is answered by listing it */
+	if (ret == -1)
+		ret = prefetch_siblings(remotepath, stat);
+	if (ret == -ENOENT) {
+		FREE(remotepath);
+		return -ENOENT;
+	} else if (ret) {
+		if (getattr_propfind(&remotepath, stat)) {
 			FREE(remotepath);
 			return -ENOENT;
 		}
@@ -618,17 +1080,235 @@ static void wdfs_readdir_propfind_callback(
 	struct stat stat;
 	set_stat(&stat, results);
 
-	/* add this file's attributes to the cache */
-	cache_add_item(&stat, remotepath1);
+	item_data->entries++;
+
+	/* the listing keeps the attributes known by the server */
+	if (item_data->listing != NULL)
+		dir_listing_add(item_data->listing, filename, &stat);
+
+	/* add this file's attributes to the cache. if an upload of the file is 
+	 * pending, the server does not know the current attributes yet. */
+	if (upload_get_stat(&stat, remotepath1))
+		cache_add_item(&stat, remotepath1);
 
-	/* add directory entry */
-	if (item_data->filler(item_data->buf, filename, &stat, 0))
+	/* add directory entry, unless the directory is only refreshed */
+	if (item_data->filler != NULL &&
+			item_data->filler(item_data->buf, filename, &stat, 0))
 		fprintf(stderr, "## filler() error in %s()!\n", __func__);
 
 	free_chars(&remotepath, &remotepath1, &remotepath2, NULL);
 }
 
 
+/* sends the propfind with depth 1 for the directory item_data->remotepath.
+ * the attributes of its files are added to the cache and the complete 
+ * listing to the directory cache. returns 0 on success or -ENOENT on error. */
+static int readdir_propfind(struct dir_item *item_data)
+{
+	pooled_session session;
+	if (session == NULL)
+		return -ENOENT;
+
+	item_data->entries = 0;
+	item_data->listing = dir_listing_new(item_data->remotepath);
+	int ret = ne_simple_propfind(
+		session, item_data->remotepath, NE_DEPTH_ONE,
+		&prop_names[0], wdfs_readdir_propfind_callback, item_data);
+	/* handle the redirect and retry the propfind with the redirect target */
+	if (ret == NE_REDIRECT && wdfs.redirect == true) {
+		dir_listing_free(item_data->listing);
+		item_data->listing = NULL;
+		if (handle_redirect(&item_data->remotepath))
+			return -ENOENT;
+		item_data->entries = 0;
+		item_data->listing = dir_listing_new(item_data->remotepath);
+		ret = ne_simple_propfind(
+			session, item_data->remotepath, NE_DEPTH_ONE,
+			&prop_names[0], wdfs_readdir_propfind_callback, item_data);
+	}
+	if (ret != NE_OK) {
+			fprintf(stderr, "## PROPFIND error in %s(): %s\n",
+				__func__, ne_get_error(session));
+		dir_listing_free(item_data->listing);
+		item_data->listing = NULL;
+		return -ENOENT;
+	}
+
+	/* keep the complete listing for the next readdir() */
+	dir_cache_store(item_data->listing);
+	item_data->listing = NULL;
+	prefetch_learn(item_data->remotepath, item_data->entries);
+	return 0;
+}
+
+
+/* gets the current attributes of the file remotepath from the server and
+ * updates the cache. used by the background jobs, that refresh cached data.
+ * returns 0 on success or -ENOENT on error. */
+int refresh_attributes(const char *remotepath)
+{
+	assert(remotepath);
+
+	char *remotepath2 = strdup(remotepath);
+	if (remotepath2 == NULL)
+		return -ENOMEM;
+
+	struct stat stat;
+	int ret = getattr_propfind(&remotepath2, &stat);
+	FREE(remotepath2);
+	return ret;
+}
+
+
+/* gets the current attributes of all files of the directory remotepath from
+ * the server and updates the cache and the directory cache. if filler is not
+ * NULL, it's called for each file like fuse's filler method. used by the 
+ * background jobs, that refresh cached data. returns 0 on success or -ENOENT
+ * on error. */
+int refresh_directory(
+	const char *remotepath, void *buf, fuse_fill_dir_t filler)
+{
+	assert(remotepath);
+
+	struct dir_item item_data;
+	item_data.buf = buf;
+	item_data.filler = filler;
+	item_data.listing = NULL;
+	item_data.entries = 0;
+	item_data.remotepath = strdup(remotepath);
+	if (item_data.remotepath == NULL)
+		return -ENOMEM;
+
+	int ret = readdir_propfind(&item_data);
+	FREE(item_data.remotepath);
+	return ret;
+}
+
+
+/* userdata of wdfs_tree_propfind_callback() */
+struct tree_data {
+	char *key;				/* unified remotepath of the tree's root */
+	GHashTable *listings;	/* the listings by the directory's unified path */
+	int entries;			/* number of files in the answer */
+};
+
+
+/* returns the listing of the directory with the unified key from the tree
+ * and creates it, if it's not known yet. returns NULL, if the directory 
+ * cache is disabled. */
+static struct dir_listing* tree_get_listing(
+	struct tree_data *data, const char *key)
+{
+	struct dir_listing *listing = (struct dir_listing*)
+		g_hash_table_lookup(data->listings, key);
+	if (listing != NULL || wdfs.dir_timeout == 0)
+		return listing;
+
+	char *remotepath = unify_path(key, ESCAPE);
+	if (remotepath == NULL)
+		return NULL;
+	listing = dir_listing_new(remotepath);
+	FREE(remotepath);
+	if (listing != NULL)
+		g_hash_table_insert(data->listings, strdup(key), listing);
+	return listing;
+}
+
+
+/* this method is called by ne_simple_propfind() from refresh_tree() for each
+ * file of the tree. the file's attributes are added to the cache and to the
+ * listing of its directory. each directory of the tree gets a listing, 
+ * because the answer contains all of its files. */
+static void wdfs_tree_propfind_callback(
+#if NEON_VERSION >= 26
+	void *userdata, const ne_uri* href_uri, const ne_prop_result_set *results)
+#else
+	void *userdata, const char *remotepath0, const ne_prop_result_set *results)
+#endif
+{
+#if NEON_VERSION >= 26
+	char *remotepath = ne_uri_unparse(href_uri);
+#else
+	char *remotepath = strdup(remotepath0);
+#endif
+
+	struct tree_data *data = (struct tree_data*)userdata;
+	assert(data);
+
+	char *key = unify_path(remotepath, UNESCAPE);
+	if (key == NULL) {
+		FREE(remotepath);
+		fprintf(stderr, "## fatal error: unify_path() returned NULL\n");
+		return;
+	}
+
+	struct stat stat;
+	set_stat(&stat, results);
+	data->entries++;
+
+	if (S_ISDIR(stat.st_mode))
+		tree_get_listing(data, key);
+
+	/* add the file to its directory, unless it's the root of the tree */
+	char *slash = strrchr(key, '/');
+	if (strcmp(key, data->key) && slash != NULL) {
+		*slash = '\0';
+		struct dir_listing *listing = tree_get_listing(data, key);
+		if (listing != NULL)
+			dir_listing_add(listing, slash + 1, &stat);
+		*slash = '/';
+	}
+
+	/* if an upload of the file is pending, the server does not know the
+	 * current attributes yet. */
+	if (upload_get_stat(&stat, key))
+		cache_add_item(&stat, key);
+
+	free_chars(&remotepath, &key, NULL);
+}
+
+
+/* gets the attributes of all files below the directory remotepath with one 
+ * propfind of depth infinity, and updates the cache and the directory cache.
+ * many servers don't allow this depth. returns the number of files on 
+ * success or -ENOENT on error. */
+int refresh_tree(const char *remotepath)
+{
+	assert(remotepath);
+
+	pooled_session session;
+	if (session == NULL)
+		return -ENOENT;
+
+	struct tree_data data;
+	data.key = unify_path(remotepath, UNESCAPE);
+	if (data.key == NULL)
+		return -ENOMEM;
+	data.listings = g_hash_table_new_full(g_str_hash, g_str_equal, free, NULL);
+	data.entries = 0;
+
+	int ret = ne_simple_propfind(session, remotepath, NE_DEPTH_INFINITE,
+		&prop_names[0], wdfs_tree_propfind_callback, &data);
+	if (ret != NE_OK && wdfs.debug == true)
+		fprintf(stderr, "** PROPFIND with depth infinity failed in %s(): "
+			"%s\n", __func__, ne_get_error(session));
+
+	/* the listings are complete, if the server sent the whole tree */
+	GHashTableIter iter;
+	gpointer key, listing;
+	g_hash_table_iter_init(&iter, data.listings);
+	while (g_hash_table_iter_next(&iter, &key, &listing)) {
+		if (ret == NE_OK)
+			dir_cache_store((struct dir_listing*)listing);
+		else
+			dir_listing_free((struct dir_listing*)listing);
+	}
+	g_hash_table_destroy(data.listings);
+	FREE(data.key);
+	return (ret == NE_OK) ? data.entries : -ENOENT;
+}
+
+
 /* this method adds the files to the requested directory using the webdav method
  * propfind. the server responds with status code 207 that contains metadata of 
  * all files of the requested collection. for each file the method 
@@ -645,6 +1325,8 @@ static int wdfs_readdir(
 	struct dir_item item_data;
 	item_data.buf = buf;
 	item_data.filler = filler;
+	item_data.listing = NULL;
+	item_data.entries = 0;
 
 	/* for details about the svn_mode, please have a look at svn.c */
 	/* if svn_mode is enabled, add svn_basedir to root */
@@ -675,28 +1357,25 @@ static int wdfs_readdir(
 	if (item_data.remotepath == NULL)
 		return -ENOMEM;
 
+	struct stat st;
+	memset(&st, 0, sizeof(st));
+	st.st_mode = S_IFDIR | 0777;
 
-	int ret = ne_simple_propfind(
-		session, item_data.remotepath, NE_DEPTH_ONE,
-		&prop_names[0], wdfs_readdir_propfind_callback, &item_data);
-	/* handle the redirect and retry the propfind with the redirect target */
-	if (ret == NE_REDIRECT && wdfs.redirect == true) {
-		if (handle_redirect(&item_data.remotepath))
-			return -ENOENT;
-		ret = ne_simple_propfind(
-			session, item_data.remotepath, NE_DEPTH_ONE,
-			&prop_names[0], wdfs_readdir_propfind_callback, &item_data);
+	/* use the cached listing of the directory, if it's still valid, or the
+	 * listing of the snapshot */
+	if (dir_cache_fill(item_data.remotepath, buf, filler) == 0 ||
+			snapshot_fill(item_data.remotepath, buf, filler) == 0) {
+		filler(buf, ".", &st, 0);
+		filler(buf, "..", &st, 0);
+		FREE(item_data.remotepath);
+		return 0;
 	}
-	if (ret != NE_OK) {
-			fprintf(stderr, "## PROPFIND error in %s(): %s\n",
-				__func__, ne_get_error(session));
+
+	if (readdir_propfind(&item_data)) {
 		FREE(item_data.remotepath);
 		return -ENOENT;
 	}
 
-	struct stat st;
-	memset(&st, 0, sizeof(st));
-	st.st_mode = S_IFDIR | 0777;
 	filler(buf, ".", &st, 0);
 	filler(buf, "..", &st, 0);
 
@@ -706,8 +1385,9 @@ static int wdfs_readdir(
 
 
 /* author jens, 13.08.2005 11:22:20, location: unknown, refactored in goettingen
- * get the file from the server already at open() and write the data to a new
- * filehandle. also create a "struct open_file" to store the filehandle. */
+ * create a "struct open_file" with an empty spool for the file or share the
+ * one of the already open file. the data is fetched from the server on demand
+ * by read() and write(), see spool.cpp. */
 static int wdfs_open(const char *localpath, struct fuse_file_info *fi)
 {
 	if (wdfs.debug == true) {
@@ -718,13 +1398,6 @@ static int wdfs_open(const char *localpath, struct fuse_file_info *fi)
 
 	assert(localpath &&  &fi);
 
-	struct open_file *file = g_new0(struct open_file, 1);
-	file->modified = false;
-
-	file->fh = get_filehandle();
-	if (file->fh == -1)
-		return -EIO;
-
 	char *remotepath;
 
 	if (wdfs.svn_mode == true && g_str_has_prefix(localpath, svn_basedir))
@@ -732,10 +1405,11 @@ static int wdfs_open(const char *localpath, struct fuse_file_info *fi)
 	else
 		remotepath = get_remotepath(localpath);
 
-	if (remotepath == NULL) {
-		FREE(file);
+	if (remotepath == NULL)
 		return -ENOMEM;
-	}
+
+	/* the server must have the newest version of the file */
+	upload_wait(remotepath);
 
 	/* try to lock, if locking is enabled and file is not below svn_basedir. */
 	if (wdfs.locking_mode != NO_LOCK && 
@@ -748,24 +1422,54 @@ static int wdfs_open(const char *localpath, struct fuse_file_info *fi)
 					"## error: file %s is already locked. "
 					"allowing read-only (O_RDONLY) access!\n", remotepath);
 			} else {
-				FREE(file);
 				FREE(remotepath);
 				return -EACCES;
 			}
 		}
 	}
 
-	/* GET the data to the filehandle even if the file is opened O_WRONLY,
-	 * because the opening application could use pwrite() or use O_APPEND
-	 * and than the data needs to be present. */
-	if (ne_get(session, remotepath, file->fh)) {
-		fprintf(stderr, "## GET error: %s\n", ne_get_error(session));
+	bool_t writable = ((fi->flags & O_ACCMODE) == O_RDONLY) ? false : true;
+	struct open_file *file = open_file_get(remotepath, writable);
+	if (file == NULL) {
 		FREE(remotepath);
-		return -ENOENT;
+		return -ENOMEM;
 	}
 
+	/* the file is already open, share its spool */
+	if (file->busy == false) {
+		if (writable == true && spool_make_writable(file->spool)) {
+			open_file_release(remotepath, file, writable);
+			FREE(remotepath);
+			return -EIO;
+		}
+		FREE(remotepath);
+		fi->fh = (unsigned long)file;
+		return 0;
+	}
+
+	/* an upload of the last release() may have been submitted meanwhile */
+	upload_wait(remotepath);
+
+	/* the size of the file is needed to know which blocks can be fetched */
+	struct stat stat;
+	if (cache_get_item(&stat, remotepath) == 0 ||
+			getattr_propfind(&remotepath, &stat) == 0) {
+		/* use the data of the content cache, if it's still up to date */
+		file->spool = content_cache_open(remotepath, &stat, writable);
+		if (file->spool == NULL) {
+			file->spool = spool_new(remotepath, stat.st_size);
+			if (file->spool != NULL)
+				file->spool->mtime = stat.st_mtime;
+		}
+	}
 	FREE(remotepath);
 
+	open_file_ready(file);
+	if (file->spool == NULL) {
+		open_file_free(file);
+		return -ENOENT;
+	}
+
 	/* save our "struct open_file" to the fuse filehandle
 	 * this looks like a dirty hack too me, but it's the fuse way... */
 	fi->fh = (unsigned long)file;
@@ -774,7 +1478,8 @@ static int wdfs_open(const char *localpath, struct fuse_file_info *fi)
 }
 
 
-/* reads data from the filehandle with pread() to fulfill read requests */
+/* reads data from the spool to fulfill read requests. missing data is fetched
+ * from the server. */
 static int wdfs_read(
 	const char *localpath, char *buf, size_t size,
 	off_t offset, struct fuse_file_info *fi)
@@ -786,17 +1491,11 @@ static int wdfs_read(
 
 	struct open_file *file = (struct open_file*)(uintptr_t)fi->fh;
 
-	int ret = pread(file->fh, buf, size, offset);
-	if (ret < 0) {
-		fprintf(stderr, "## pread() error: %d\n", ret);
-		return -EIO;
-	}
-
-	return ret;
+	return spool_read(file->spool, buf, size, offset);
 }
 
 
-/* writes data to the filehandle with pwrite() to fulfill write requests */
+/* writes data to the spool to fulfill write requests */
 static int wdfs_write(
 	const char *localpath, const char *buf, size_t size,
 	off_t offset, struct fuse_file_info *fi)
@@ -812,15 +1511,13 @@ static int wdfs_write(
 
 	struct open_file *file = (struct open_file*)(uintptr_t)fi->fh;
 
-	int ret = pwrite(file->fh, buf, size, offset);
-	if (ret < 0) {
-		fprintf(stderr, "## pwrite() error: %d\n", ret);
-		return -EIO;
-	}
-
+	pthread_rwlock_rdlock(&file->upload_lock);
+	int ret = spool_write(file->spool, buf, size, offset);
 	/* set this flag, to indicate that data has been modified and needs to be
 	 * put to the webdav server. */
-	file->modified = true;
+	if (ret >= 0)
+		file->modified = true;
+	pthread_rwlock_unlock(&file->upload_lock);
 
 	return ret;
 }
@@ -829,56 +1526,43 @@ static int wdfs_write(
 /* author jens, 13.08.2005 11:28:40, location: unknown, refactored in goettingen
  * wdfs_release is called by fuse, when the last reference to the filehandle is
  * removed. this happens if the file is closed. after closing the file it's
- * time to put it to the server, but only if it was modified. */
+ * time to put it to the server, but only if it was modified and this was the
+ * last filehandle opened for writing or the last filehandle at all. */
 static int wdfs_release(const char *localpath, struct fuse_file_info *fi)
 {
 	if (wdfs.debug == true)
 		print_debug_infos(__func__, localpath);
 
 	struct open_file *file = (struct open_file*)(uintptr_t)fi->fh;
+	bool_t writable = ((fi->flags & O_ACCMODE) == O_RDONLY) ? false : true;
 
 	char *remotepath = get_remotepath(localpath);
 	if (remotepath == NULL)
 		return -ENOMEM;
 
-	/* put the file only to the server, if it was modified. */
-	if (file->modified == true) 	{
-		if (ne_put(session, remotepath, file->fh)) {
-			fprintf(stderr, "## PUT error: %s\n", ne_get_error(session));
-			FREE(remotepath);
-			return -EIO;
-		}
+	int ret = open_file_release(remotepath, file, writable);
+	FREE(remotepath);
+	return ret;
+}
 
-		if (wdfs.debug == true)
-			fprintf(stderr, ">> wdfs_release(): PUT the file to the server.\n");
 
-		/* attributes for this file are no longer up to date.
-		 * so remove it from cache. */
-		cache_delete_item(remotepath);
+/* with write_behind fsync() waits until the pending uploads of the file are
+ * done. the data of the open file is put to the server on release(). */
+static int wdfs_fsync(
+	const char *localpath, int datasync, struct fuse_file_info *fi)
+{
+	if (wdfs.debug == true)
+		print_debug_infos(__func__, localpath);
 
-		/* unlock if locking is enabled and mode is ADVANCED_LOCK, because data
-		 * has been read and writen and so now it's time to remove the lock. */
-		if (wdfs.locking_mode == ADVANCED_LOCK) {
-			if (unlockfile(remotepath)) {
-				FREE(remotepath);
-				return -EACCES;
-			}
-		}
-	}
+	assert(localpath);
 
-	/* if locking is enabled and mode is SIMPLE_LOCK, simple unlock on close() */
-	if (wdfs.locking_mode == SIMPLE_LOCK) {
-		if (unlockfile(remotepath)) {
-			FREE(remotepath);
-			return -EACCES;
-		}
-	}
+	char *remotepath = get_remotepath(localpath);
+	if (remotepath == NULL)
+		return -ENOMEM;
 
-	/* close filehandle and free memory */
-	close(file->fh);
-	FREE(file);
-	FREE(remotepath);
+	upload_wait(remotepath);
 
+	FREE(remotepath);
 	return 0;
 }
 
@@ -888,6 +1572,9 @@ static int wdfs_release(const char *localpath, struct fuse_file_info *fi)
  * or truncate() is called. according to 'man truncate' if the file previously 
  * was larger than this size, the extra data is lost. if the file previously 
  * was shorter, it is extended, and the extended part is filled with zero bytes.
+ * the file is truncated in a spool, so only the blocks in front of size are
+ * fetched and an extension is a sparse part of the spool file. if the file is
+ * open, its shared spool is truncated and put to the server at once.
  */
 static int wdfs_truncate(const char *localpath, off_t size)
 {
@@ -902,71 +1589,50 @@ static int wdfs_truncate(const char *localpath, off_t size)
 	if (wdfs.svn_mode == true && g_str_has_prefix(localpath, svn_basedir))
 		return -EROFS;
 
-	/* the truncate procedure:
-	 *  1. get the complete file and write into fh_in
-	 *  2. read size bytes from fh_in to buffer
-	 *  3. write size bytes from buffer to fh_out
-	 *  4. read from fh_out and put file to the server
-	 */
-
 	char *remotepath = get_remotepath(localpath);
 	if (remotepath == NULL)
 		return -ENOMEM;
 
-	int ret;
-	int fh_in  = get_filehandle();
-	int fh_out = get_filehandle();
-	if (fh_in == -1 || fh_out == -1)
-		return -EIO;
-
-	char buffer[size];
-	memset(buffer, 0, size);
+	upload_wait(remotepath);
 
-	/* if truncate(0) is called, there is no need to get the data, because it 
-	 * would not be used. */
-	if (size != 0) {
-		if (ne_get(session, remotepath, fh_in)) {
-			fprintf(stderr, "## GET error: %s\n", ne_get_error(session));
-			close(fh_in);
-			close(fh_out);
-			FREE(remotepath);
-			return -ENOENT;
-		}
-
-		ret = pread(fh_in, buffer, size, 0);
-		if (ret < 0) {
-			fprintf(stderr, "## pread() error: %d\n", ret);
-			close(fh_in);
-			close(fh_out);
-			FREE(remotepath);
-			return -EIO;
-		}
+	int ret = truncate_open_file(remotepath, size);
+	if (ret != -ENOENT) {
+		if (ret == 0)
+			update_cached_size(remotepath, size);
+		FREE(remotepath);
+		return ret;
 	}
 
-	ret = pwrite(fh_out, buffer, size, 0);
-	if (ret < 0) {
-		fprintf(stderr, "## pwrite() error: %d\n", ret);
-		close(fh_in);
-		close(fh_out);
+	/* the size of the file is needed to know which blocks can be fetched */
+	struct stat stat;
+	if (cache_get_item(&stat, remotepath) && 
+			getattr_propfind(&remotepath, &stat)) {
 		FREE(remotepath);
-		return -EIO;
+		return -ENOENT;
 	}
 
-	if (ne_put(session, remotepath, fh_out)) {
-		fprintf(stderr, "## PUT error: %s\n", ne_get_error(session));
-		close(fh_in);
-		close(fh_out);
+	struct spool *spool = spool_new(remotepath, stat.st_size);
+	if (spool == NULL) {
 		FREE(remotepath);
 		return -EIO;
 	}
+	spool->mtime = stat.st_mtime;
 
-	/* stat for this file is no longer up to date. remove it from the cache. */
-	cache_delete_item(remotepath);
+	ret = spool_truncate(spool, size);
+	if (ret == 0)
+		ret = upload_spool(remotepath, spool);
+	spool_free(spool);
+
+	/* only the size and the time of the file changed, keep it in the cache */
+	if (ret == 0) {
+		stat.st_size = size;
+		stat.st_blocks = (stat.st_size + 511) / 512;
+		stat.st_mtime = time(NULL);
+		cache_add_item(&stat, remotepath);
+	}
 
-	close(fh_in);
-	close(fh_out);
 	FREE(remotepath);
-	return 0;
+	return ret;
 }
 
 
@@ -992,34 +1658,20 @@ static int wdfs_ftruncate(
 
 	struct open_file *file = (struct open_file*)(uintptr_t)fi->fh;
 
-	int ret = ftruncate(file->fh, size);
-	if (ret < 0) {
-		fprintf(stderr, "## ftruncate() error: %d\n", ret);
-		FREE(remotepath);
-		return -EIO;
-	}
-
+	pthread_rwlock_rdlock(&file->upload_lock);
+	int ret = spool_truncate(file->spool, size);
 	/* set this flag, to indicate that data has been modified and needs to be
 	 * put to the webdav server. */
-	file->modified = true;
-
-	/* update the cache item of the ftruncate()d file */
-	struct stat stat;
-	if (cache_get_item(&stat, remotepath) < 0) {
-		fprintf(stderr,
-			"## cache_get_item() error: item '%s' not found!\n", remotepath);
+	if (ret == 0)
+		file->modified = true;
+	pthread_rwlock_unlock(&file->upload_lock);
+	if (ret) {
 		FREE(remotepath);
 		return -EIO;
 	}
 
-	/* set the new size after the ftruncate() call */
-	stat.st_size = size;
-
-	/* calculate number of 512 byte blocks */
-	stat.st_blocks	= (stat.st_size + 511) / 512;
-
-	/* update the cache */
-	cache_add_item(&stat, remotepath);
+	/* update the cache item of the ftruncate()d file */
+	update_cached_size(remotepath, size);
 
 	FREE(remotepath);
 
@@ -1050,13 +1702,24 @@ static int wdfs_mknod(const char *localpath, mode_t mode, dev_t rdev)
 		return -EIO;
 	}
 
-	if (ne_put(session, remotepath, fh)) {
+	pooled_session session;
+	if (session == NULL) {
+		close(fh);
+		FREE(remotepath);
+		return -EIO;
+	}
+	lockstore_read_lock();
+	int ret = webdav_put(session, remotepath, fh);
+	lockstore_read_unlock();
+	if (ret) {
 		fprintf(stderr, "## PUT error: %s\n", ne_get_error(session));
 		close(fh);
 		FREE(remotepath);
 		return -EIO;
 	}
 
+	cache_delete_negative(remotepath);
+	dir_cache_invalidate_parent(remotepath);
 	close(fh);
 	FREE(remotepath);
 	return 0;
@@ -1080,12 +1743,22 @@ static int wdfs_mkdir(const char *localpath, mode_t mode)
 	if (remotepath == NULL)
 		return -ENOMEM;
 
-	if (ne_mkcol(session, remotepath)) {
+	pooled_session session;
+	if (session == NULL) {
+		FREE(remotepath);
+		return -EIO;
+	}
+	lockstore_read_lock();
+	int ret = ne_mkcol(session, remotepath);
+	lockstore_read_unlock();
+	if (ret) {
 		fprintf(stderr, "MKCOL error: %s\n", ne_get_error(session));
 		FREE(remotepath);
 		return -ENOENT;
 	}
 
+	cache_delete_negative(remotepath);
+	dir_cache_invalidate_parent(remotepath);
 	FREE(remotepath);
 	return 0;
 }
@@ -1108,6 +1781,9 @@ static int wdfs_unlink(const char *localpath)
 	if (remotepath == NULL)
 		return -ENOMEM;
 
+	/* a pending upload would create the file again */
+	upload_wait(remotepath);
+
 	/* unlock the file, to be able to unlink it */
 	if (wdfs.locking_mode != NO_LOCK) {
 		if (unlockfile(remotepath)) {
@@ -1116,16 +1792,29 @@ static int wdfs_unlink(const char *localpath)
 		}
 	}
 
+	pooled_session session;
+	if (session == NULL) {
+		FREE(remotepath);
+		return -EIO;
+	}
+	lockstore_read_lock();
 	int ret = ne_delete(session, remotepath);
+	lockstore_read_unlock();
 	if (ret == NE_REDIRECT && wdfs.redirect == true) {
 		if (handle_redirect(&remotepath))
 			return -ENOENT;
+		lockstore_read_lock();
 		ret = ne_delete(session, remotepath);
+		lockstore_read_unlock();
 	}
 
-	/* file successfully deleted! remove it also from the cache. */
+	/* file successfully deleted! remember it in the cache. */
 	if (ret == 0) {
-		cache_delete_item(remotepath);
+		cache_add_negative(remotepath);
+		content_cache_remove(remotepath);
+		dir_cache_invalidate_parent(remotepath);
+		dir_cache_invalidate_tree(remotepath);
+		open_file_forget(remotepath);
 	/* return more specific error message in case of permission problems */
 	} else if (!strcmp(ne_get_error(session), "403 Forbidden")) {
 		ret = -EPERM;
@@ -1161,6 +1850,9 @@ static int wdfs_rename(const char *localpath_src, const char *localpath_dest)
 	if (remotepath_src == NULL || remotepath_dest == NULL )
 		return -ENOMEM;
 
+	upload_wait(remotepath_src);
+	upload_wait(remotepath_dest);
+
 	/* unlock the source file, before renaming */
 	if (wdfs.locking_mode != NO_LOCK) {
 		if (unlockfile(remotepath_src)) {
@@ -1169,17 +1861,44 @@ static int wdfs_rename(const char *localpath_src, const char *localpath_dest)
 		}
 	}
 
+	pooled_session session;
+	if (session == NULL) {
+		free_chars(&remotepath_src, &remotepath_dest, NULL);
+		return -EIO;
+	}
+	lockstore_read_lock();
 	int ret = ne_move(session, 1, remotepath_src, remotepath_dest);
+	lockstore_read_unlock();
 	if (ret == NE_REDIRECT && wdfs.redirect == true) {
 		if (handle_redirect(&remotepath_src))
 			return -ENOENT;
+		lockstore_read_lock();
 		ret = ne_move(session, 1, remotepath_src, remotepath_dest);
+		lockstore_read_unlock();
 	}
 
 	if (ret == 0) {
 		/* rename was successful and the source file no longer exists.
-		 * hence, remove it from the cache. */
-		cache_delete_item(remotepath_src);
+		 * hence, remember this in the cache. the items below a directory
+		 * are removed too, the listings still know the moved directory. */
+		struct stat stat;
+		cache_delete_tree(remotepath_src,
+			(dir_cache_lookup(remotepath_src, &stat) == 0 &&
+			 S_ISDIR(stat.st_mode)) ? true : false);
+		cache_delete_tree(remotepath_dest,
+			(dir_cache_lookup(remotepath_dest, &stat) == 0 &&
+			 S_ISDIR(stat.st_mode)) ? true : false);
+		cache_add_negative(remotepath_src);
+		cache_delete_item(remotepath_dest);
+		cache_delete_negative(remotepath_dest);
+		dir_cache_invalidate_parent(remotepath_src);
+		dir_cache_invalidate_parent(remotepath_dest);
+		dir_cache_invalidate_tree(remotepath_src);
+		dir_cache_invalidate_tree(remotepath_dest);
+		content_cache_remove(remotepath_src);
+		content_cache_remove(remotepath_dest);
+		open_file_forget(remotepath_src);
+		open_file_forget(remotepath_dest);
 	} else {
 		fprintf(stderr, "## MOVE error: %s\n", ne_get_error(session));
 		ret = -EIO;
@@ -1214,10 +1933,20 @@ int wdfs_chmod(const char *localpath, mode_t mode)
         NULL
     };
     
-    if (ne_proppatch(session, remotepath.get(), ops)) {
+    pooled_session session;
+    if (session == NULL)
+        return -EIO;
+    lockstore_read_lock();
+    int ret = ne_proppatch(session, remotepath.get(), ops);
+    lockstore_read_unlock();
+    if (ret) {
         fprintf(stderr, "PROPPATCH error: %s\n", ne_get_error(session));
         return -ENOENT;
     }
+
+    /* the mode of the file changed */
+    cache_delete_item(remotepath.get());
+    dir_cache_invalidate_parent(remotepath.get());
     
 	return 0;
 }
@@ -1261,6 +1990,21 @@ static int wdfs_statfs(const char *localpath, struct statvfs *buf)
 {
 	if (wdfs.debug == true)
 		fprintf(stderr, ">> %s()\n", __func__);
+
+	/* threads must be started here, because fuse may fork() into the 
+	 * background after main() and a forked process has no other threads. */
+	start_session_control();
+	background_jobs = async_pool_new("background jobs", wdfs.async_threads);
+	if (background_jobs == NULL)
+		fprintf(stderr, "## error: could not start the background jobs, "
+			"read-ahead and background refreshes are disabled\n");
+	if (upload_initialize())
+		fprintf(stderr, "## error: could not start the upload pool, "
+			"files are uploaded on close()\n");
+	snapshot_initialize();
+	prefetch_initialize();
+	warmup_initialize();
+
 	return NULL;
 }
 
@@ -1272,10 +2016,46 @@ static void wdfs_destroy(void*)
 	if (wdfs.debug == true)
 		fprintf(stderr, ">> freeing globaly used memory\n");
 
+	/* finish the uploads and jobs, that may still need the cache and the 
+	 * sessions */
+	warmup_destroy();
+	upload_destroy();
+	async_pool_wait(background_jobs);
+	/* the snapshot is written from the caches */
+	snapshot_destroy();
+
+	if (wdfs.stats == true) {
+		print_session_stats(stderr);
+		fprintf(stderr, "attribute requests: %lu sent, %lu shared\n",
+			propfind_sent, propfind_shared);
+		async_print_stats(background_jobs, stderr);
+		cache_print_stats(stderr);
+		dir_cache_print_stats(stderr);
+		snapshot_print_stats(stderr);
+		prefetch_print_stats(stderr);
+		warmup_print_stats(stderr);
+		content_cache_print_stats(stderr);
+		spool_print_stats(stderr);
+		fprintf(stderr, "open files: %lu opens shared a spool\n",
+			open_files_shared);
+		upload_print_stats(stderr);
+	}
+
+	async_pool_free(background_jobs);
+	background_jobs = NULL;
+
+	if (open_files != NULL) {
+		g_hash_table_destroy(open_files);
+		open_files = NULL;
+	}
+
 	/* free globaly used memory */
+	prefetch_destroy();
 	cache_destroy();
+	dir_cache_destroy();
+	content_cache_destroy();
 	unlock_all_files();
-	ne_session_destroy(session);
+	destroy_webdav_sessions();
 	FREE(remotepath_basedir);
 	svn_free_repository_root();
 }
@@ -1289,6 +2069,7 @@ static struct fuse_operations wdfs_operations  = [] () {
     wo.read       = wdfs_read;
     wo.write      = wdfs_write;
     wo.release    = wdfs_release;
+    wo.fsync      = wdfs_fsync;
     wo.truncate   = wdfs_truncate;
     wo.ftruncate  = wdfs_ftruncate;
     wo.mknod      = wdfs_mknod;
@@ -1334,7 +2115,58 @@ static void print_help()
 "                           2 or advanced: from open until write + close\n"
 "                           3 or eternity: from open until umount or timeout\n"
 "    -o locking_timeout=sec timeout for a lock in seconds, -1 means infinite\n"
-"                           default is 300 seconds (5 minutes)\n\n"
+"                           default is 300 seconds (5 minutes)\n"
+"    -o sessions=num        maximum number of parallel connections to the\n"
+"                           server, default is 4\n"
+"    -o keepalive=sec       keep idle connections open by a request every sec\n"
+"                           seconds, default is 0 (disabled)\n"
+"    -o spare_sessions=num  idle connections kept open with keepalive,\n"
+"                           default is 1\n"
+"    -o stats               print statistics when wdfs is unmounted\n"
+"    -o async_threads=num   number of threads for background jobs, default 4\n"
+"    -o cache_ttl_min=sec   minimum lifetime of a cached attribute,\n"
+"                           default is 20 seconds\n"
+"    -o cache_ttl_max=sec   maximum lifetime of a cached attribute, the\n"
+"                           lifetime of unchanged files grows up to it,\n"
+"                           default is 20 seconds\n"
+"    -o cache_memory=MB     maximum memory of the attribute cache,\n"
+"                           default is 64 MB\n"
+"    -o negative_timeout=sec  seconds a non-existent file is remembered,\n"
+"                           0 disables it, default is 5 seconds\n"
+"    -o stale_grace=sec     seconds a timed out attribute is still used,\n"
+"                           while it's refreshed in the background,\n"
+"                           0 disables it, default is 0 seconds\n"
+"    -o stale_max=sec       maximum age of a used attribute with stale_grace,\n"
+"                           default is 60 seconds\n"
+"    -o dir_timeout=sec     seconds a directory listing is cached,\n"
+"                           0 disables it, default is 20 seconds\n"
+"    -o prefetch_misses=num list a directory, after the attributes of num\n"
+"                           of its files were requested within 2 seconds,\n"
+"                           0 disables it, default is 0\n"
+"    -o metadata_cache=file keep the cached attributes and directory listings\n"
+"                           in the file for the next mount\n"
+"    -o warmup=dir[:dir]    fill the caches with the trees below these\n"
+"                           directories after the mount, \"/\" is the root\n"
+"    -o warmup_threads=num  number of threads of the warm-up, default 2\n"
+"    -o warmup_rate=num     maximum requests per second of the warm-up,\n"
+"                           0 is unlimited, default is 10\n"
+"    -o content_cache=dir   keep the data of files in the directory dir\n"
+"    -o content_cache_size=MB  maximum size of the content cache,\n"
+"                           default is 1024 MB\n"
+"    -o readahead=KB        maximum read-ahead of sequentially read files,\n"
+"                           0 disables it, default is 1024 KB\n"
+"    -o readahead_budget=KB maximum data fetched by all read-ahead requests\n"
+"                           at the same time, default is 8192 KB\n"
+"    -o write_behind        upload modified files in the background after\n"
+"                           close(), fsync() waits for the upload\n"
+"    -o upload_threads=num  number of parallel uploads, default 4\n"
+"    -o upload_queue=num    maximum number of pending uploads, default 64\n"
+"    -o partial_put=method  send only the modified parts of files:\n"
+"                           none:          always put the complete file\n"
+"                           auto:          sabredav, if the server supports\n"
+"                                          it (default)\n"
+"                           content-range: PUT with Content-Range (apache)\n"
+"                           sabredav:      PATCH with X-Update-Range\n\n"
 "wdfs backwards compatibility options: (used until wdfs 1.3.1)\n"
 "    -a uri                 address of the webdav resource to mount\n"
 "    -ac                    same as -o accept_sslcert\n"
@@ -1348,6 +2180,23 @@ static void print_help()
 }
 
 
+/* makes the path of an option absolute. fuse changes to the directory "/",
+ * if it runs in the background. returns 0 on success or -1 on error. */
+static int make_path_absolute(char **path)
+{
+	if (*path == NULL || g_path_is_absolute(*path))
+		return 0;
+
+	char *cwd = g_get_current_dir();
+	char *absolute = g_build_filename(cwd, *path, NULL);
+	g_free(cwd);
+	FREE(*path);
+	*path = strdup(absolute);
+	g_free(absolute);
+	return (*path == NULL) ? -1 : 0;
+}
+
+
 /* just a simple wrapper for fuse_main(), because the interface changed...  */
 static int call_fuse_main(struct fuse_args *args)
 {
@@ -1381,12 +2230,78 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
+	if (wdfs.sessions < 1) {
+		fprintf(stderr, "## error: sessions must be bigger than 0!\n");
+		exit(1);
+	}
+
+	if (wdfs.async_threads < 1) {
+		fprintf(stderr, "## error: async_threads must be bigger than 0!\n");
+		exit(1);
+	}
+
+	if (wdfs.negative_timeout < 0 || wdfs.dir_timeout < 0 ||
+			wdfs.stale_grace < 0 || wdfs.stale_max < 0 ||
+			wdfs.prefetch_misses < 0) {
+		fprintf(stderr, "## error: negative_timeout, dir_timeout, stale_grace, "
+			"stale_max and prefetch_misses must not be negative!\n");
+		exit(1);
+	}
+
+	if (wdfs.cache_ttl_min < 1 || wdfs.cache_ttl_max < wdfs.cache_ttl_min) {
+		fprintf(stderr, "## error: cache_ttl_min must be bigger than 0 and "
+			"cache_ttl_max must not be smaller!\n");
+		exit(1);
+	}
+
+	if (wdfs.cache_memory < 1) {
+		fprintf(stderr, "## error: cache_memory must be bigger than 0!\n");
+		exit(1);
+	}
+
+	if (wdfs.content_cache != NULL && wdfs.content_cache_size < 1) {
+		fprintf(stderr, "## error: content_cache_size must be bigger than 0!\n");
+		exit(1);
+	}
+
+	if (make_path_absolute(&wdfs.content_cache) ||
+			make_path_absolute(&wdfs.metadata_cache)) {
+		fprintf(stderr, "## error: could not make content_cache and "
+			"metadata_cache absolute!\n");
+		exit(1);
+	}
+
+	if (wdfs.warmup != NULL && 
+			(wdfs.warmup_threads < 1 || wdfs.warmup_rate < 0)) {
+		fprintf(stderr, "## error: warmup_threads must be bigger than 0 and "
+			"warmup_rate must not be negative!\n");
+		exit(1);
+	}
+
+	if (wdfs.upload_threads < 1 || wdfs.upload_queue < 1) {
+		fprintf(stderr, "## error: upload_threads and upload_queue must be "
+			"bigger than 0!\n");
+		exit(1);
+	}
+
+	if (wdfs.spare_sessions > wdfs.sessions)
+		wdfs.spare_sessions = wdfs.sessions;
+
 	if (wdfs.debug == true) {
 		fprintf(stderr, 
 			"wdfs settings:\n  program_name: %s\n  webdav_resource: %s\n"
 			"  accept_certificate: %s\n  username: %s\n  password: %s\n"
 			"  redirect: %s\n  svn_mode: %s\n  locking_mode: %i\n"
-			"  locking_timeout: %i\n",
+			"  locking_timeout: %i\n  sessions: %i\n  keepalive: %i\n"
+			"  spare_sessions: %i\n  async_threads: %i\n"
+			"  cache_ttl_min: %i\n  cache_ttl_max: %i\n  cache_memory: %i\n"
+			"  negative_timeout: %i\n  stale_grace: %i\n  stale_max: %i\n"
+			"  dir_timeout: %i\n  prefetch_misses: %i\n  metadata_cache: %s\n"
+			"  warmup: %s\n  warmup_threads: %i\n  warmup_rate: %i\n"
+			"  content_cache: %s\n  content_cache_size: %i\n"
+			"  readahead: %i\n  readahead_budget: %i\n"
+			"  write_behind: %s\n  upload_threads: %i\n  upload_queue: %i\n"
+			"  partial_put: %i\n",
 			wdfs.program_name,
 			wdfs.webdav_resource ? wdfs.webdav_resource : "NULL",
 			wdfs.accept_certificate == true ? "true" : "false",
@@ -1394,7 +2309,18 @@ int main(int argc, char *argv[])
 			wdfs.password ? "****" : "NULL",
 			wdfs.redirect == true ? "true" : "false",
 			wdfs.svn_mode == true ? "true" : "false",
-			wdfs.locking_mode, wdfs.locking_timeout);
+			wdfs.locking_mode, wdfs.locking_timeout, wdfs.sessions,
+			wdfs.keepalive, wdfs.spare_sessions, wdfs.async_threads,
+			wdfs.cache_ttl_min, wdfs.cache_ttl_max,
+			wdfs.cache_memory, wdfs.negative_timeout, wdfs.stale_grace,
+			wdfs.stale_max, wdfs.dir_timeout, wdfs.prefetch_misses,
+			wdfs.metadata_cache ? wdfs.metadata_cache : "NULL",
+			wdfs.warmup ? wdfs.warmup : "NULL",
+			wdfs.warmup_threads, wdfs.warmup_rate,
+			wdfs.content_cache ? wdfs.content_cache : "NULL",
+			wdfs.content_cache_size, wdfs.readahead, wdfs.readahead_budget,
+			wdfs.write_behind == true ? "true" : "false",
+			wdfs.upload_threads, wdfs.upload_queue, wdfs.partial_put);
 	}
 
 	/* set a nice name for /proc/mounts */
@@ -1402,9 +2328,6 @@ int main(int argc, char *argv[])
 	fuse_opt_add_arg(&options, fsname);
 	FREE(fsname);
 
-	/* ensure that wdfs is called in single thread mode */
-	fuse_opt_add_arg(&options, "-s");
-
 	/* wdfs must not use the fuse caching of names (entries) and attributes! */
 	fuse_opt_add_arg(&options, "-oentry_timeout=0");
 	fuse_opt_add_arg(&options, "-oattr_timeout=0");
@@ -1424,20 +2347,28 @@ int main(int argc, char *argv[])
 		if(svn_set_repository_root()) {
 			fprintf(stderr,
 				"## error: could not set subversion repository root.\n");
-			ne_session_destroy(session);
+			destroy_webdav_sessions();
 			status_program_exec = 1;
 			goto cleanup;
 		}
 	}
 
 	cache_initialize();
+	dir_cache_initialize();
+
+	if (content_cache_initialize()) {
+		destroy_webdav_sessions();
+		status_program_exec = 1;
+		goto cleanup;
+	}
 
 	/* finally call fuse */
 	status_program_exec = call_fuse_main(&options);
 
 	/* clean up and quit wdfs */
 cleanup:
-	free_chars(&wdfs.webdav_resource, &wdfs.username, &wdfs.password, NULL);
+	free_chars(&wdfs.webdav_resource, &wdfs.username, &wdfs.password,
+		&wdfs.metadata_cache, &wdfs.warmup, &wdfs.content_cache, NULL);
 	fuse_opt_free_args(&options);
 
 	return status_program_exec;
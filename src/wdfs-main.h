@@ -11,7 +11,9 @@
 #include <ne_basic.h>
 
 /* build the neon version, which is not directly exported by the neon library */
-#if defined(NE_FEATURE_TS_SSL)	/* true for neon 0.26+  */
+#if defined(NE_FEATURE_I18N)	/* true for neon 0.27+  */
+	#define NEON_VERSION 27
+#elif defined(NE_FEATURE_TS_SSL)	/* true for neon 0.26+  */
 	#define NEON_VERSION 26
 #elif defined(NE_FEATURE_SSL)	/* true for neon 0.25+  */
 	#define NEON_VERSION 25
@@ -33,6 +35,28 @@
 typedef bool bool_t;
 
 
+/* there are four locking modes available. the simple locking mode locks a file 
+ * on open()ing it and unlocks it on close()ing the file. the advanced mode 
+ * prevents data curruption by locking the file on open() and holds the lock 
+ * until the file was writen and closed or the lock timed out. the eternity 
+ * mode holds the lock until wdfs is unmounted or the lock times out. the last
+ * mode is to do no locking at all which is the default behaviour. */
+#define NO_LOCK 0
+#define SIMPLE_LOCK 1
+#define ADVANCED_LOCK 2
+#define ETERNITY_LOCK 3
+
+/* partial uploads: modified files are put to the server completely or only
+ * the modified parts are sent. apache accepts a PUT with a "Content-Range"
+ * header, sabredav a PATCH with a "X-Update-Range" header. auto uses the 
+ * sabredav method, if the server advertises it, otherwise no partial uploads.
+ * the apache method can't be detected and must be selected explicitly. */
+#define PARTIAL_PUT_NONE 0
+#define PARTIAL_PUT_AUTO 1
+#define PARTIAL_PUT_CONTENT_RANGE 2
+#define PARTIAL_PUT_SABREDAV 3
+
+
 /* used as mode for unify_path() */
 enum {
 	ESCAPE     = 0x0,
@@ -61,6 +85,57 @@ struct wdfs_conf {
 	int locking_mode;
 	/* timeout for a lock in seconds */
 	int locking_timeout;
+	/* maximum number of parallel connections (neon sessions) to the server */
+	int sessions;
+	/* interval in seconds of the keep-alive requests of idle sessions */
+	int keepalive;
+	/* number of idle sessions that are kept open (needs keepalive) */
+	int spare_sessions;
+	/* if set to "true" statistics are printed when wdfs is unmounted */
+	bool_t stats;
+	/* number of threads that run background jobs */
+	int async_threads;
+	/* minimum and maximum lifetime of an attribute in seconds. the lifetime
+	 * of each attribute is adapted to its changes, if they differ. */
+	int cache_ttl_min;
+	int cache_ttl_max;
+	/* maximum memory of the attribute cache in megabytes */
+	int cache_memory;
+	/* seconds a non-existent file is remembered, 0 disables it */
+	int negative_timeout;
+	/* seconds a timed out attribute is served while it's refreshed */
+	int stale_grace;
+	/* maximum age in seconds of a served attribute */
+	int stale_max;
+	/* seconds a directory listing is cached, 0 disables it */
+	int dir_timeout;
+	/* number of cache misses in a directory, that let it be listed, 0 
+	 * disables it */
+	int prefetch_misses;
+	/* file of the snapshot of the metadata caches, NULL disables it */
+	char *metadata_cache;
+	/* directories, that are crawled after the mount, NULL disables it */
+	char *warmup;
+	/* number of threads of the warm-up crawler */
+	int warmup_threads;
+	/* maximum requests per second of the warm-up crawler, 0 is unlimited */
+	int warmup_rate;
+	/* directory of the persistent content cache, NULL disables it */
+	char *content_cache;
+	/* maximum size of the content cache in megabytes */
+	int content_cache_size;
+	/* maximum read-ahead window of a file in kilobytes, 0 disables it */
+	int readahead;
+	/* maximum kilobytes fetched by all running read-ahead requests */
+	int readahead_budget;
+	/* if set to "true" modified files are uploaded in the background */
+	bool_t write_behind;
+	/* number of threads that upload files in the background */
+	int upload_threads;
+	/* maximum number of pending background uploads */
+	int upload_queue;
+	/* method of partial uploads, see PARTIAL_PUT_* */
+	int partial_put;
 	/* address of the webdav resource we are connecting to */
 	char *webdav_resource;
 };
@@ -70,6 +145,7 @@ extern struct wdfs_conf wdfs;
 /* look at wdfs-main.c for comments on these extern variables */
 extern const char *project_name;
 extern char *remotepath_basedir;
+extern struct async_pool *background_jobs;
 
 /* used by wdfs_readdir() and by svn.h/svn.c to add files to requested 
  * directories using fuse's filler() method. */
@@ -77,11 +153,19 @@ struct dir_item {
 	void *buf;
 	fuse_fill_dir_t filler;
 	char *remotepath;
+	struct dir_listing *listing;	/* listing for the directory cache or NULL */
+	int entries;					/* number of files added by the propfind */
 };
 
 char* remove_ending_slashes(const char *in);
 char* unify_path(const char *in, int mode);
+char* get_remotepath(const char *localpath);
 void free_chars(char **arg, ...);
+int get_filehandle();
+int refresh_attributes(const char *remotepath);
+int refresh_directory(
+	const char *remotepath, void *buf, fuse_fill_dir_t filler);
+int refresh_tree(const char *remotepath);
 
 /* takes an lvalue and sets it to NULL after freeing. taken from neon. */
 #define FREE(x) do { if ((x) != NULL) free((x)); (x) = NULL; } while (0)
@@ -30,12 +30,21 @@
 #include <unistd.h>
 #include <assert.h>
 #include <termios.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <ne_basic.h>
+#include <ne_request.h>
 #include <ne_auth.h>
 #include <ne_locks.h>
 #include <ne_socket.h>
 #include <ne_redirect.h>
 
+#include <vector>
+
 #include "wdfs-main.h"
 #include "webdav.h"
 
@@ -46,10 +55,110 @@ struct ne_auth_data {
 	const char *password;
 };
 
-ne_session *session;
 ne_lock_store *store = NULL;
 struct ne_auth_data auth_data;
 
+/* wdfs runs fuse in multi-threaded mode, but a neon session must not be used
+ * by more than one thread at a time. hence each thread checks a session out 
+ * of this pool while it talks to the webdav server and puts it back afterwards.
+ * sessions are created on demand until wdfs.sessions sessions exist, further
+ * threads wait until a session is put back.
+ * if keep-alive is enabled (wdfs.keepalive > 0), a 2nd thread sends a cheap
+ * OPTIONS request with each idle session every wdfs.keepalive seconds. so the
+ * connection stays open or a closed connection is reopened in the background
+ * and not on the critical path of the next fuse call. sessions that failed
+ * or were idle too long are closed, and spare sessions are opened in advance
+ * if all sessions are in use. */
+struct pool_session {
+	ne_session *session;
+	time_t last_used;		/* when this session was put back to the pool */
+	bool_t connected;		/* true if the session holds an open connection */
+	bool_t was_connected;	/* true if the session was connected before */
+};
+
+/* idle sessions. the most recently used session is at the end. */
+static std::vector<struct pool_session*> idle_sessions;
+static int sessions_created = 0;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+
+/* idle sessions exceeding wdfs.spare_sessions are closed after this time in
+ * seconds. this value can be edit here. */
+static const time_t session_idle_lifetime = 300;
+
+/* the session control thread and the condition to wake it up early */
+static pthread_t session_control_thread_id;
+static pthread_cond_t session_control_cond = PTHREAD_COND_INITIALIZER;
+static bool_t session_control_running = false;
+
+/* statistics of the session pool, protected by the pool_mutex */
+static struct {
+	unsigned long handshakes;		/* connections opened */
+	unsigned long reconnects;		/* connections reopened after a close */
+	unsigned long handshakes_avoided; /* checkouts of a connected session */
+	unsigned long probes;			/* keep-alive requests sent */
+	unsigned long probes_failed;	/* keep-alive requests that failed */
+	unsigned long reaped;			/* sessions closed by the control thread */
+	unsigned long spares;			/* sessions opened in advance */
+	unsigned long waits;			/* checkouts that had to wait */
+	double wait_time;				/* seconds waited for a session in total */
+	double wait_time_max;			/* longest wait for a session in seconds */
+} pool_stats;
+
+/* the data of uploaded files is mapped into memory in windows of this size. 
+ * this value can be edit here. */
+static const off_t upload_map_size = 8 * 1024 * 1024;
+
+/* state of an upload, used by upload_body_provider() */
+struct upload_body {
+	int fh;
+	off_t start;		/* offset of the first byte to upload */
+	off_t size;			/* offset behind the last byte to upload */
+	off_t offset;		/* offset of the next byte to send */
+	char *map;			/* mapped window of the file or NULL */
+	off_t map_start;
+	size_t map_len;
+};
+
+/* statistics of webdav_put(), protected by the upload_mutex */
+static struct {
+	unsigned long files;			/* files uploaded */
+	unsigned long ranges;			/* partial uploads */
+	unsigned long long range_bytes;	/* bytes sent by partial uploads */
+	unsigned long long mapped;		/* bytes sent from the mapped file */
+	unsigned long long copied;		/* bytes read with pread() */
+} upload_stats;
+static pthread_mutex_t upload_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* the server's uri, needed to create new sessions for the pool */
+static ne_uri server_uri;
+
+/* escaped path of the server's uri, used by the keep-alive requests */
+static char *server_path = NULL;
+
+/* the session checked out by this thread and the number of pooled_session 
+ * objects sharing it. nested checkouts of a thread reuse the same session. */
+static __thread struct pool_session *thread_session = NULL;
+static __thread int thread_session_users = 0;
+
+/* debug useragent string of this thread, see set_useragent() */
+static __thread char *thread_useragent = NULL;
+
+/* requests that submit lock tokens walk the lockstore, while lockfile() and
+ * unlockfile() modify it. this lock keeps them apart. */
+static pthread_rwlock_t store_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* serializes lockfile() and unlockfile(), so that two threads don't try to
+ * lock the same file at the same time. */
+static pthread_mutex_t locking_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* serializes the interactive prompts of the callbacks below */
+static pthread_mutex_t prompt_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* the certificate the user accepted for the first session. the other sessions
+ * of the pool accept it without asking again. */
+static char *accepted_certificate = NULL;
+
 
 /* reads from the terminal without displaying the typed chars. used to type
  * the password savely. */
@@ -90,6 +199,8 @@ static int ne_set_server_auth_callback(
 	const size_t length = 100;
 	char buffer[length];
 
+	pthread_mutex_lock(&prompt_mutex);
+
 	/* ask the user for the username and password if needed */
 	if (auth_data.username == NULL) {
 		printf("username: ");
@@ -115,6 +226,8 @@ static int ne_set_server_auth_callback(
 	strncpy(username, auth_data.username, NE_ABUFSIZ);
 	strncpy(password, auth_data.password, NE_ABUFSIZ);
 
+	pthread_mutex_unlock(&prompt_mutex);
+
 	return attempt;
 }
 
@@ -128,6 +241,16 @@ static int verify_ssl_certificate(
 	char from[NE_SSL_VDATELEN], to[NE_SSL_VDATELEN];
 	const char *ident;
 
+	pthread_mutex_lock(&prompt_mutex);
+
+	/* this certificate was already accepted for another session */
+	char *exported = ne_ssl_cert_export(certificate);
+	if (accepted_certificate != NULL && !strcmp(accepted_certificate, exported)) {
+		FREE(exported);
+		pthread_mutex_unlock(&prompt_mutex);
+		return 0;
+	}
+
 	ident = ne_ssl_cert_identity(certificate);
 
 	if (ident) {
@@ -154,8 +277,12 @@ static int verify_ssl_certificate(
 	free_chars(&issued_to, &issued_by, NULL);
 
 	/* don't prompt the user if the parameter "-ac" was passed to wdfs */
-	if (wdfs.accept_certificate == true)
+	if (wdfs.accept_certificate == true) {
+		FREE(accepted_certificate);
+		accepted_certificate = exported;
+		pthread_mutex_unlock(&prompt_mutex);
 		return 0;
+	}
 
 	/* prompt the user wether he/she wants to accept this certificate */
 	int answer;
@@ -171,17 +298,553 @@ static int verify_ssl_certificate(
 	}
 
 	if (answer == 'y') {
+		FREE(accepted_certificate);
+		accepted_certificate = exported;
+		pthread_mutex_unlock(&prompt_mutex);
 		return 0;
 	} else {
 		printf(" certificate rejected.\n");
+		FREE(exported);
+		pthread_mutex_unlock(&prompt_mutex);
 		return -1;
 	}
 }
 
 
+#if NEON_VERSION >= 27
+/* called by neon if the connection state of a session changes. used to 
+ * count the connections that were opened. */
+static void session_notifier(
+	void *userdata, ne_session_status status, const ne_session_status_info *info)
+{
+	struct pool_session *entry = (struct pool_session*)userdata;
+
+	if (status == ne_status_connected) {
+		pthread_mutex_lock(&pool_mutex);
+		pool_stats.handshakes++;
+		if (entry->was_connected == true)
+			pool_stats.reconnects++;
+		pthread_mutex_unlock(&pool_mutex);
+		entry->connected = entry->was_connected = true;
+	} else if (status == ne_status_disconnected) {
+		entry->connected = false;
+	}
+}
+#endif
+
+
+/* creates a new session object for server_uri, that allows to access the
+ * server. returns the session on success or NULL on error. */
+static struct pool_session* create_session()
+{
+	ne_session *session = 
+		ne_session_create(server_uri.scheme, server_uri.host, server_uri.port);
+
+	/* init ssl if needed */
+	if (!strcasecmp(server_uri.scheme, "https")) {
+#if NEON_VERSION >= 25
+		if (ne_has_support(NE_FEATURE_SSL)) {
+#else
+		if (ne_supports_ssl()) {
+#endif
+			ne_ssl_trust_default_ca(session);
+			ne_ssl_set_verify(session, verify_ssl_certificate, &server_uri);
+		} else {
+			fprintf(stderr, "## error: neon ssl support is not enabled.\n");
+			ne_session_destroy(session);
+			return NULL;
+		}
+	}
+
+	/* enable this for on-demand authentication */
+	ne_set_server_auth(session, ne_set_server_auth_callback, NULL);
+
+	/* enable redirect support */
+	ne_redirect_register(session);
+
+	/* submit the lock tokens of the lockstore with this session's requests */
+	if (store != NULL)
+		ne_lockstore_register(store, session);
+
+	/* set a useragent string, to identify wdfs in the server log files */
+	ne_set_useragent(session, project_name);
+
+	struct pool_session *entry = new pool_session;
+	entry->session = session;
+	entry->last_used = time(NULL);
+	entry->connected = entry->was_connected = false;
+
+#if NEON_VERSION >= 27
+	ne_set_notifier(session, session_notifier, entry);
+#endif
+
+	return entry;
+}
+
+
+/* closes the connection of the session and frees it. */
+static void destroy_session(struct pool_session *entry)
+{
+	ne_session_destroy(entry->session);
+	delete entry;
+}
+
+
+/* +++++++ session pool methods +++++++ */
+
+/* returns the current time of a monotonic clock in seconds */
+static double monotonic_time()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+
+/* returns this thread's session. if the thread does not hold a session yet, 
+ * an idle session is taken from the pool, or a new one is created, or the
+ * thread waits until another thread puts a session back. returns NULL, if
+ * a new session could not be created. */
+ne_session* session_acquire()
+{
+	if (thread_session_users++ > 0)
+		return thread_session->session;
+
+	pthread_mutex_lock(&pool_mutex);
+	if (idle_sessions.empty() && sessions_created >= wdfs.sessions) {
+		double wait_start = monotonic_time();
+		while (idle_sessions.empty() && sessions_created >= wdfs.sessions)
+			pthread_cond_wait(&pool_cond, &pool_mutex);
+		double wait_time = monotonic_time() - wait_start;
+		pool_stats.waits++;
+		pool_stats.wait_time += wait_time;
+		if (wait_time > pool_stats.wait_time_max)
+			pool_stats.wait_time_max = wait_time;
+	}
+
+	struct pool_session *entry = NULL;
+	if (!idle_sessions.empty()) {
+		entry = idle_sessions.back();
+		idle_sessions.pop_back();
+		if (entry->connected == true)
+			pool_stats.handshakes_avoided++;
+	} else {
+		sessions_created++;
+	}
+
+	/* the last idle session is in use, let the control thread open a spare */
+	if (idle_sessions.empty() && session_control_running == true)
+		pthread_cond_signal(&session_control_cond);
+	pthread_mutex_unlock(&pool_mutex);
+
+	/* create the session outside of the lock, this may take a while */
+	if (entry == NULL) {
+		entry = create_session();
+		if (entry == NULL) {
+			fprintf(stderr, "## error: could not create a webdav session\n");
+			/* give the slot back to the waiting threads */
+			pthread_mutex_lock(&pool_mutex);
+			sessions_created--;
+			pthread_cond_broadcast(&pool_cond);
+			pthread_mutex_unlock(&pool_mutex);
+			thread_session_users--;
+			return NULL;
+		}
+		if (wdfs.debug == true)
+			fprintf(stderr, "** created webdav session #%d\n", sessions_created);
+	}
+
+	if (thread_useragent != NULL)
+		ne_set_useragent(entry->session, thread_useragent);
+
+	thread_session = entry;
+	return entry->session;
+}
+
+
+/* puts this thread's session back to the pool, if it's no longer used. */
+void session_release(ne_session *session)
+{
+	assert(thread_session_users > 0 && session == thread_session->session);
+
+	if (--thread_session_users > 0)
+		return;
+
+	/* reset the debug useragent, the next thread does something else */
+	if (thread_useragent != NULL) {
+		ne_set_useragent(session, project_name);
+		FREE(thread_useragent);
+	}
+
+	struct pool_session *entry = thread_session;
+	thread_session = NULL;
+	entry->last_used = time(NULL);
+
+	pthread_mutex_lock(&pool_mutex);
+	idle_sessions.push_back(entry);
+	pthread_cond_signal(&pool_cond);
+	pthread_mutex_unlock(&pool_mutex);
+}
+
+
+/* sets the useragent of this thread's current and next session. used to get
+ * more informative server log files in debug mode. */
+void set_useragent(const char *useragent)
+{
+	FREE(thread_useragent);
+	thread_useragent = strdup(useragent);
+	if (thread_session != NULL)
+		ne_set_useragent(thread_session->session, thread_useragent);
+}
+
+
+/* sends a cheap OPTIONS request to keep the session's connection open or to
+ * reopen it. returns 0 on success or -1 on error. */
+static int probe_session(struct pool_session *entry)
+{
+	ne_server_capabilities capabilities;
+	int ret = ne_options(entry->session, server_path, &capabilities);
+
+	pthread_mutex_lock(&pool_mutex);
+	pool_stats.probes++;
+	if (ret != NE_OK)
+		pool_stats.probes_failed++;
+	pthread_mutex_unlock(&pool_mutex);
+
+	if (ret != NE_OK) {
+		if (wdfs.debug == true)
+			fprintf(stderr, "** keep-alive request failed: %s\n",
+				ne_get_error(entry->session));
+		return -1;
+	}
+	return 0;
+}
+
+
+/* this thread runs until stop_session_control() is called. every 
+ * wdfs.keepalive seconds it probes the idle sessions, closes dead or unused 
+ * sessions and opens spare sessions if needed. */
+static void* session_control_thread(void *unused)
+{
+	pthread_mutex_lock(&pool_mutex);
+	while (session_control_running == true) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += wdfs.keepalive;
+		pthread_cond_timedwait(&session_control_cond, &pool_mutex, &deadline);
+		if (session_control_running == false)
+			break;
+
+		/* take the idle sessions that need a keep-alive request or are
+		 * idle for too long out of the pool. the oldest ones come first. */
+		std::vector<struct pool_session*> probe, reap;
+		time_t now = time(NULL);
+		size_t idle = idle_sessions.size();
+		std::vector<struct pool_session*>::iterator it = idle_sessions.begin();
+		while (it != idle_sessions.end()) {
+			if (idle > (size_t)wdfs.spare_sessions &&
+					now - (*it)->last_used >= session_idle_lifetime) {
+				reap.push_back(*it);
+				idle--;
+			} else if (now - (*it)->last_used >= wdfs.keepalive) {
+				probe.push_back(*it);
+			} else {
+				++it;
+				continue;
+			}
+			it = idle_sessions.erase(it);
+		}
+		sessions_created -= reap.size();
+		pool_stats.reaped += reap.size();
+
+		/* open spare sessions, if too few sessions are idle */
+		int spares = 0;
+		while ((int)(idle_sessions.size() + probe.size()) + spares
+					< wdfs.spare_sessions && sessions_created < wdfs.sessions) {
+			sessions_created++;
+			spares++;
+		}
+		pthread_mutex_unlock(&pool_mutex);
+
+		/* the network i/o is done without holding the lock */
+		for (it = reap.begin(); it != reap.end(); ++it)
+			destroy_session(*it);
+		int i, failed = 0;
+		for (i = 0; i < spares; i++) {
+			struct pool_session *entry = create_session();
+			if (entry != NULL)
+				probe.push_back(entry);
+			else
+				failed++;
+		}
+
+		int dead = 0;
+		for (it = probe.begin(); it != probe.end(); ++it) {
+			if (probe_session(*it)) {
+				destroy_session(*it);
+				*it = NULL;
+				dead++;
+			} else {
+				(*it)->last_used = time(NULL);
+			}
+		}
+
+		pthread_mutex_lock(&pool_mutex);
+		pool_stats.spares += spares - failed;
+		pool_stats.reaped += dead;
+		sessions_created -= dead + failed;
+		/* put the probed sessions back in front of the recently used ones */
+		for (it = probe.begin(); it != probe.end(); ++it) {
+			if (*it != NULL)
+				idle_sessions.insert(idle_sessions.begin(), *it);
+		}
+		pthread_cond_broadcast(&pool_cond);
+	}
+	pthread_mutex_unlock(&pool_mutex);
+	return NULL;
+}
+
+
+/* starts the session control thread, if keep-alive is enabled. */
+void start_session_control()
+{
+	if (wdfs.keepalive <= 0)
+		return;
+
+	session_control_running = true;
+	if (pthread_create(&session_control_thread_id, NULL,
+			&session_control_thread, NULL)) {
+		fprintf(stderr, "## error: could not start session control thread\n");
+		session_control_running = false;
+	}
+}
+
+
+/* stops the session control thread and waits until it's finished. */
+void stop_session_control()
+{
+	pthread_mutex_lock(&pool_mutex);
+	if (session_control_running == false) {
+		pthread_mutex_unlock(&pool_mutex);
+		return;
+	}
+	session_control_running = false;
+	pthread_cond_signal(&session_control_cond);
+	pthread_mutex_unlock(&pool_mutex);
+	pthread_join(session_control_thread_id, NULL);
+}
+
+
+/* this method is called by neon to get the next part of the request body of
+ * webdav_put(). the data is copied from a mapped window of the file, which
+ * saves the read() system calls and lets the kernel read ahead. if the file
+ * can't be mapped, pread() is used. buflen 0 means start again. */
+static ssize_t upload_body_provider(void *userdata, char *buffer, size_t buflen)
+{
+	struct upload_body *body = (struct upload_body*)userdata;
+
+	if (buflen == 0) {
+		body->offset = body->start;
+		return 0;
+	}
+	if (body->offset >= body->size)
+		return 0;
+
+	/* map the window, that contains the next byte */
+	if (body->map == NULL || body->offset < body->map_start ||
+			body->offset >= body->map_start + (off_t)body->map_len) {
+		if (body->map != NULL)
+			munmap(body->map, body->map_len);
+		body->map_start = body->offset - body->offset % upload_map_size;
+		body->map_len = upload_map_size;
+		if (body->map_start + (off_t)body->map_len > body->size)
+			body->map_len = body->size - body->map_start;
+		body->map = (char*)mmap(NULL, body->map_len, PROT_READ, MAP_SHARED,
+			body->fh, body->map_start);
+		if (body->map == MAP_FAILED)
+			body->map = NULL;
+		else
+			madvise(body->map, body->map_len, MADV_SEQUENTIAL);
+	}
+
+	ssize_t len;
+	if (body->map != NULL) {
+		len = body->map_start + body->map_len - body->offset;
+		if ((size_t)len > buflen)
+			len = buflen;
+		memcpy(buffer, body->map + (body->offset - body->map_start), len);
+	} else {
+		if ((off_t)buflen > body->size - body->offset)
+			buflen = body->size - body->offset;
+		len = pread(body->fh, buffer, buflen, body->offset);
+		if (len <= 0) {
+			fprintf(stderr, "## pread() error: %s\n", 
+				len ? strerror(errno) : "unexpected end of file");
+			return -1;
+		}
+	}
+
+	pthread_mutex_lock(&upload_mutex);
+	if (body->map != NULL)
+		upload_stats.mapped += len;
+	else
+		upload_stats.copied += len;
+	pthread_mutex_unlock(&upload_mutex);
+
+	body->offset += len;
+	return len;
+}
+
+
+/* sends the bytes start to start + length of the file fh as body of the 
+ * request. returns 0 on success or a neon error code. */
+static int upload_request(
+	ne_request *req, int fh, off_t start, off_t length)
+{
+	struct upload_body body;
+	memset(&body, 0, sizeof(body));
+	body.fh = fh;
+	body.start = body.offset = start;
+	body.size = start + length;
+	posix_fadvise(fh, start, length, POSIX_FADV_SEQUENTIAL);
+
+	ne_set_request_body_provider(req, length, upload_body_provider, &body);
+
+	int ret = ne_request_dispatch(req);
+	if (ret == NE_OK && ne_get_status(req)->klass != 2) {
+		ne_set_error(ne_get_session(req), "%d %s", 
+			ne_get_status(req)->code, ne_get_status(req)->reason_phrase);
+		ret = NE_ERROR;
+	}
+
+	if (body.map != NULL)
+		munmap(body.map, body.map_len);
+	return ret;
+}
+
+
+/* puts the file fh to remotepath like ne_put(), but the request body is
+ * provided by upload_body_provider(). returns 0 on success or a neon error
+ * code. */
+int webdav_put(ne_session *session, const char *remotepath, int fh)
+{
+	assert(session && remotepath);
+
+	struct stat stat;
+	if (fstat(fh, &stat)) {
+		ne_set_error(session, "could not determine file size: %s", 
+			strerror(errno));
+		return NE_ERROR;
+	}
+
+	ne_request *req = ne_request_create(session, "PUT", remotepath);
+	ne_lock_using_resource(req, remotepath, 0);
+	ne_lock_using_parent(req, remotepath);
+	int ret = upload_request(req, fh, 0, stat.st_size);
+	ne_request_destroy(req);
+
+	if (ret == NE_OK) {
+		pthread_mutex_lock(&upload_mutex);
+		upload_stats.files++;
+		pthread_mutex_unlock(&upload_mutex);
+	}
+	return ret;
+}
+
+
+/* puts the bytes start to start + length of the file fh to remotepath. the
+ * remote file gets the size total. method is PARTIAL_PUT_CONTENT_RANGE or 
+ * PARTIAL_PUT_SABREDAV. if etag is not NULL, the request fails if the remote
+ * file has another etag. returns 0 on success or a neon error code. */
+int webdav_put_range(
+	ne_session *session, const char *remotepath, int fh, off_t start,
+	off_t length, off_t total, int method, const char *etag)
+{
+	assert(session && remotepath && length > 0);
+
+	ne_request *req;
+	if (method == PARTIAL_PUT_SABREDAV) {
+		req = ne_request_create(session, "PATCH", remotepath);
+		ne_add_request_header(req, "Content-Type", 
+			"application/x-sabredav-partialupdate");
+		ne_print_request_header(req, "X-Update-Range", "bytes=%lld-%lld",
+			(long long)start, (long long)(start + length - 1));
+	} else {
+		req = ne_request_create(session, "PUT", remotepath);
+		ne_print_request_header(req, "Content-Range", "bytes %lld-%lld/%lld",
+			(long long)start, (long long)(start + length - 1),
+			(long long)total);
+	}
+	if (etag != NULL)
+		ne_add_request_header(req, "If-Match", etag);
+	ne_lock_using_resource(req, remotepath, 0);
+	ne_lock_using_parent(req, remotepath);
+
+	int ret = upload_request(req, fh, start, length);
+	ne_request_destroy(req);
+
+	if (ret == NE_OK) {
+		pthread_mutex_lock(&upload_mutex);
+		upload_stats.ranges++;
+		upload_stats.range_bytes += length;
+		pthread_mutex_unlock(&upload_mutex);
+	}
+	return ret;
+}
+
+
+/* prints the statistics of the session pool. */
+void print_session_stats(FILE *stream)
+{
+	pthread_mutex_lock(&pool_mutex);
+	fprintf(stream,
+		"webdav sessions: %d open, %d idle\n"
+		"  connections opened:  %lu (%lu reconnects)\n"
+		"  handshakes avoided:  %lu\n"
+		"  keep-alive requests: %lu (%lu failed)\n"
+		"  sessions closed:     %lu, spare sessions opened: %lu\n"
+		"  waits for a session: %lu, %.3f s total, %.3f s max\n",
+		sessions_created, (int)idle_sessions.size(),
+		pool_stats.handshakes, pool_stats.reconnects,
+		pool_stats.handshakes_avoided,
+		pool_stats.probes, pool_stats.probes_failed,
+		pool_stats.reaped, pool_stats.spares,
+		pool_stats.waits, pool_stats.wait_time, pool_stats.wait_time_max);
+	pthread_mutex_unlock(&pool_mutex);
+
+	pthread_mutex_lock(&upload_mutex);
+	fprintf(stream, "uploads: %lu files, %llu bytes mapped, %llu bytes read\n"
+		"  partial uploads: %lu ranges, %llu bytes\n",
+		upload_stats.files, upload_stats.mapped, upload_stats.copied,
+		upload_stats.ranges, upload_stats.range_bytes);
+	pthread_mutex_unlock(&upload_mutex);
+}
+
+
+/* destroys all sessions of the pool. must not be called while other threads
+ * still use the pool. */
+void destroy_webdav_sessions()
+{
+	stop_session_control();
+
+	pthread_mutex_lock(&pool_mutex);
+	std::vector<struct pool_session*>::iterator it = idle_sessions.begin();
+	for (; it != idle_sessions.end(); ++it)
+		destroy_session(*it);
+	idle_sessions.clear();
+	sessions_created = 0;
+	pthread_mutex_unlock(&pool_mutex);
+
+	ne_uri_free(&server_uri);
+	FREE(server_path);
+	FREE(accepted_certificate);
+}
+
+
 /* sets up a webdav connection. if the servers needs authentication, the passed
  * parameters username and password are used. if they were not passed they can
- * be entered interactively. this method returns 0 on success or -1 on error. */
+ * be entered interactively. the session used to access the server is the 
+ * first session of the session pool. returns 0 on success or -1 on error. */
 int setup_webdav_session(
 	const char *uri_string, const char *username, const char *password)
 {
@@ -190,57 +853,43 @@ int setup_webdav_session(
 	auth_data.username = username;
 	auth_data.password = password;
 
-	/* parse the uri_string and return a uri struct */
-	ne_uri uri;
-	if (ne_uri_parse(uri_string, &uri)) {
+	/* parse the uri_string and save it to server_uri */
+	if (ne_uri_parse(uri_string, &server_uri)) {
 		fprintf(stderr,
 			"## ne_uri_parse() error: invalid URI '%s'.\n", uri_string);
-		ne_uri_free(&uri);
+		ne_uri_free(&server_uri);
 		return -1;
 	}
 
-	assert(uri.scheme && uri.host && uri.path);
+	assert(server_uri.scheme && server_uri.host && server_uri.path);
 
 	/* if no port was defined use the default port */
-	uri.port = uri.port ? uri.port : ne_uri_defaultport(uri.scheme);
+	server_uri.port = server_uri.port ? 
+		server_uri.port : ne_uri_defaultport(server_uri.scheme);
 
 	ne_debug_init(stderr,0);
 
 	/* needed for ssl connections. it's not documented. nice to know... ;-) */
 	ne_sock_init();
 
-	/* create a session object, that allows to access the server */
-	session = ne_session_create(uri.scheme, uri.host, uri.port);
+	/* the lockstore is shared by all sessions and must exist before them */
+	if (wdfs.locking_mode != NO_LOCK)
+		store = ne_lockstore_create();
 
-	/* init ssl if needed */
-	if (!strcasecmp(uri.scheme, "https")) {
-#if NEON_VERSION >= 25
-		if (ne_has_support(NE_FEATURE_SSL)) {
-#else
-		if (ne_supports_ssl()) {
-#endif
-			ne_ssl_trust_default_ca(session);
-			ne_ssl_set_verify(session, verify_ssl_certificate, &uri);
-		} else {
-			fprintf(stderr, "## error: neon ssl support is not enabled.\n");
-			ne_session_destroy(session);
-			ne_uri_free(&uri);
-			return -1;
-		}
+	/* create a session object, that allows to access the server */
+	struct pool_session *entry = create_session();
+	if (entry == NULL) {
+		ne_uri_free(&server_uri);
+		return -1;
 	}
-
-	/* enable this for on-demand authentication */
-	ne_set_server_auth(session, ne_set_server_auth_callback, NULL);
-
-	/* enable redirect support */
-	ne_redirect_register(session);
+	ne_session *session = entry->session;
 
 	/* escape the path for the case that it contains special chars */
-	char *path = unify_path(uri.path, ESCAPE | LEAVESLASH);
+	char *path = unify_path(server_uri.path, ESCAPE | LEAVESLASH);
 	if (path == NULL) {
 		printf("## error: unify_path() returned NULL\n");
-		ne_session_destroy(session);
-		ne_uri_free(&uri);
+		destroy_session(entry);
+		ne_uri_free(&server_uri);
 		return -1;
 	}
 
@@ -261,19 +910,22 @@ int setup_webdav_session(
 			FREE(new_uri_string);
 		}
 		fprintf(stderr, ".\n");
-		ne_session_destroy(session);
-		ne_uri_free(&uri);
+		destroy_session(entry);
+		ne_uri_free(&server_uri);
 		FREE(path);
 		return -1;
 	}
-	FREE(path);
+
+	/* keep the path for the keep-alive requests */
+	server_path = path;
 
 	/* is this a webdav server that fulfills webdav class 1? */
 	if (capabilities.dav_class1 != 1) {
 		fprintf(stderr, 
 			"## error: '%s' is not a webdav enabled server.\n", uri_string);
-		ne_session_destroy(session);
-		ne_uri_free(&uri);
+		destroy_session(entry);
+		ne_uri_free(&server_uri);
+		FREE(server_path);
 		return -1;
 	}
 
@@ -282,14 +934,20 @@ int setup_webdav_session(
 
 	/* save the remotepath, because each fuse callback method need it to 
 	 * access the files at the webdav server */
-	remotepath_basedir = remove_ending_slashes(uri.path);
+	remotepath_basedir = remove_ending_slashes(server_uri.path);
 	if (remotepath_basedir == NULL) {
-		ne_session_destroy(session);
-		ne_uri_free(&uri);
+		destroy_session(entry);
+		ne_uri_free(&server_uri);
+		FREE(server_path);
 		return -1;
 	}
 
-	ne_uri_free(&uri);
+	/* this session is the first session of the pool */
+	pthread_mutex_lock(&pool_mutex);
+	idle_sessions.push_back(entry);
+	sessions_created = 1;
+	pthread_mutex_unlock(&pool_mutex);
+
 	return 0;
 }
 
@@ -297,8 +955,10 @@ int setup_webdav_session(
 /* +++++++ locking methods +++++++ */
 
 /* returns the lock for this file from the lockstore on success 
- * or NULL if the lock is not found in the lockstore. */
-static struct ne_lock* get_lock_by_path(const char *remotepath)
+ * or NULL if the lock is not found in the lockstore. the caller must hold
+ * the store_lock. */
+static struct ne_lock* get_lock_by_path(
+	ne_session *session, const char *remotepath)
 {
 	assert(remotepath);
 
@@ -322,27 +982,43 @@ static struct ne_lock* get_lock_by_path(const char *remotepath)
 }
 
 
+/* requests that submit lock tokens (PUT, DELETE, MOVE, MKCOL, PROPPATCH) read
+ * the lockstore while they are sent. they must be enclosed by these calls. */
+void lockstore_read_lock()
+{
+	pthread_rwlock_rdlock(&store_lock);
+}
+
+void lockstore_read_unlock()
+{
+	pthread_rwlock_unlock(&store_lock);
+}
+
+
 /* tries to lock the file and returns 0 on success and 1 on error */
 int lockfile(const char *remotepath, const int timeout)
 {
 	assert(remotepath && timeout);
 
-	/* initialize the lockstore, if needed (e.g. first locking a file). */
-	if (store == NULL) {
-		store = ne_lockstore_create();
-		if (store == NULL)
-			return 1;
-		ne_lockstore_register(store, session);
-	}
+	/* the lockstore is created at setup_webdav_session() if locking is on */
+	if (store == NULL)
+		return 1;
 
+	pooled_session session;
+	if (session == NULL)
+		return 1;
+	pthread_mutex_lock(&locking_mutex);
 
 	/* check, if we already hold a lock for this file */
-	struct ne_lock *lock = get_lock_by_path(remotepath);
+	pthread_rwlock_rdlock(&store_lock);
+	struct ne_lock *lock = get_lock_by_path(session, remotepath);
+	pthread_rwlock_unlock(&store_lock);
 
 	/* we already hold a lock for this file, simply return 0 */
 	if (lock != NULL) {
 		if (wdfs.debug == true)
 			fprintf(stderr, "++ file '%s' is already locked.\n", remotepath);
+		pthread_mutex_unlock(&locking_mutex);
 		return 0;
 	}
 
@@ -356,17 +1032,25 @@ int lockfile(const char *remotepath, const int timeout)
 	ne_fill_server_uri(session, &lock->uri);
 	lock->uri.path = ne_strdup(remotepath);
 
-	if (ne_lock(session, lock)) {
+	pthread_rwlock_rdlock(&store_lock);
+	int ret = ne_lock(session, lock);
+	pthread_rwlock_unlock(&store_lock);
+
+	if (ret) {
 		fprintf(stderr, "## ne_lock() error:\n");
 		fprintf(stderr, "## could _not_ lock file '%s'.\n", lock->uri.path);
 		ne_lock_destroy(lock);
+		pthread_mutex_unlock(&locking_mutex);
 		return 1;
 	} else {
+		pthread_rwlock_wrlock(&store_lock);
 		ne_lockstore_add(store, lock);
+		pthread_rwlock_unlock(&store_lock);
 		if (wdfs.debug == true)
 			fprintf(stderr, "++ locked file '%s'.\n", remotepath);
 	}
 
+	pthread_mutex_unlock(&locking_mutex);
 	return 0;
 }
 
@@ -376,27 +1060,43 @@ int unlockfile(const char *remotepath)
 {
 	assert(remotepath);
 
-	struct ne_lock *lock = get_lock_by_path(remotepath);
+	pooled_session session;
+	if (session == NULL)
+		return 1;
+	pthread_mutex_lock(&locking_mutex);
+
+	pthread_rwlock_rdlock(&store_lock);
+	struct ne_lock *lock = get_lock_by_path(session, remotepath);
+	pthread_rwlock_unlock(&store_lock);
 
 	/* if the lock was not found, the file is already unlocked */
-	if (lock == NULL)
+	if (lock == NULL) {
+		pthread_mutex_unlock(&locking_mutex);
 		return 0;
+	}
 
 
 	/* if the lock was found, unlock the file */
 	if (ne_unlock(session, lock)) {
 		fprintf(stderr, "## ne_unlock() error:\n");
 		fprintf(stderr, "## could _not_ unlock file '%s'.\n", lock->uri.path);
+		pthread_rwlock_wrlock(&store_lock);
+		ne_lockstore_remove(store, lock);
+		pthread_rwlock_unlock(&store_lock);
 		ne_lock_destroy(lock);
+		pthread_mutex_unlock(&locking_mutex);
 		return 1;
 	} else {
 		/* on success remove the lock from the store and destroy the lock */
+		pthread_rwlock_wrlock(&store_lock);
 		ne_lockstore_remove(store, lock);
+		pthread_rwlock_unlock(&store_lock);
 		ne_lock_destroy(lock);
 		if (wdfs.debug == true)
 			fprintf(stderr, "++ unlocked file '%s'.\n", remotepath);
 	}
 
+	pthread_mutex_unlock(&locking_mutex);
 	return 0;
 }
 
@@ -406,9 +1106,13 @@ void unlock_all_files()
 {
 	/* only unlock all files, if the lockstore is initialized */
 	if (store != NULL) {
-		/* get each lock from the lockstore and try to unlock the file */
+		pooled_session session;
+		pthread_rwlock_wrlock(&store_lock);
+		/* get each lock from the lockstore and try to unlock the file. without
+		 * a session the locks just time out on the server. */
 		struct ne_lock *this_lock = NULL;
-		this_lock = ne_lockstore_first(store);
+		if (session != NULL)
+			this_lock = ne_lockstore_first(store);
 		while (this_lock != NULL) {
 			if (ne_unlock(session, this_lock)) {
 				fprintf(stderr,
@@ -427,6 +1131,8 @@ void unlock_all_files()
 		if (wdfs.debug == true)
 			fprintf(stderr, "++ destroying lockstore.\n");
 		ne_lockstore_destroy(store);
+		store = NULL;
+		pthread_rwlock_unlock(&store_lock);
 	}
 }
 
@@ -1,9 +1,37 @@
 #ifndef WEBDAV_H_
 #define WEBDAV_H_
 
-extern ne_session *session;
-
 int setup_webdav_session(const char *uri_string, const char *username, const char *password);
+void destroy_webdav_sessions();
+void start_session_control();
+void stop_session_control();
+void print_session_stats(FILE *stream);
+
+ne_session* session_acquire();
+void session_release(ne_session *session);
+void set_useragent(const char *useragent);
+int webdav_put(ne_session *session, const char *remotepath, int fh);
+int webdav_put_range(
+	ne_session *session, const char *remotepath, int fh, off_t start,
+	off_t length, off_t total, int method, const char *etag);
+
+/* checks a session out of the session pool for the lifetime of this object.
+ * nested objects of the same thread share one session. use it like a plain
+ * "ne_session *session", that is NULL if no session could be created. */
+struct pooled_session {
+	ne_session *session;
+
+	pooled_session() : session(session_acquire()) {}
+	~pooled_session() { if (session != NULL) session_release(session); }
+	operator ne_session*() const { return session; }
+
+private:
+	pooled_session(const pooled_session&);
+	pooled_session& operator=(const pooled_session&);
+};
+
+void lockstore_read_lock();
+void lockstore_read_unlock();
 
 int lockfile(const char *remotepath, const int timeout);
 int unlockfile(const char *remotepath);